@@ -0,0 +1,158 @@
+/**
+ * spawn-bench - latency of starting a command from a large process
+ *
+ * fork() copies the page tables of the caller, so starting a command gets
+ * slower the more memory the caller has touched; posix_spawn (clone with
+ * CLONE_VM | CLONE_VFORK underneath) does not. For a range of resident set
+ * sizes this grows the process to that size and then times starting and
+ * waiting for a trivial command both ways: with fork / execv / waitpid (the
+ * previous do_exec) and with do_exec, and a batch of commands with
+ * do_exec_batch.
+ *
+ * build: cc -O2 -o spawn-bench spawn-bench.c systemcalls.c
+ * usage: spawn-bench [-n iterations] [-b batch] [-p program] [sizes in MB ...]
+*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/wait.h>
+#include <sys/mman.h>
+
+#include "systemcalls.h"
+
+static double now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+/* the previous do_exec: fork, execv in the child, wait in the parent */
+static int fork_exec(char *const command[])
+{
+    pid_t pid = fork();
+    if (pid == -1) {
+        return -1;
+    }
+    if (pid == 0) {
+        execv(command[0], command);
+        _exit(EXIT_FAILURE);
+    }
+    int status;
+    if (waitpid(pid, &status, 0) == -1) {
+        return -1;
+    }
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0 ? 0 : -1;
+}
+
+int main(int argc, char *argv[])
+{
+    int iterations = 200;
+    int batch = 16;
+    char *program = "/bin/true";
+    int opt;
+    while ((opt = getopt(argc, argv, "n:b:p:")) != -1) {
+        switch (opt) {
+            case 'n':
+                iterations = atoi(optarg);
+                break;
+            case 'b':
+                batch = atoi(optarg);
+                break;
+            case 'p':
+                program = optarg;
+                break;
+            default:
+                fprintf(stderr, "usage: spawn-bench [-n iterations] [-b batch] [-p program] [sizes in MB ...]\n");
+                return 1;
+        }
+    }
+    static const size_t default_sizes[] = {0, 64, 256, 1024};
+    size_t nsizes = argc > optind ? (size_t) (argc - optind) : sizeof(default_sizes) / sizeof(default_sizes[0]);
+    if (iterations < 1 || batch < 1) {
+        fprintf(stderr, "iterations and batch must be positive\n");
+        return 1;
+    }
+
+    char *command[] = {program, NULL};
+    struct exec_command *commands = calloc(batch, sizeof(struct exec_command));
+    if (commands == NULL) {
+        perror("calloc");
+        return 1;
+    }
+    for (int i = 0; i < batch; i++) {
+        commands[i].argv = command;
+    }
+
+    // do_exec and do_exec_batch report every command, keep the table readable
+    int out = dup(STDOUT_FILENO);
+    int devnull = open("/dev/null", O_WRONLY);
+    if (out == -1 || devnull == -1) {
+        perror("open");
+        return 1;
+    }
+    FILE *report = fdopen(out, "w");
+    fprintf(report, "%10s %14s %14s %14s\n", "rss MB", "fork+exec us", "do_exec us", "batch us/cmd");
+
+    char *memory = NULL;
+    size_t mapped = 0;
+    for (size_t s = 0; s < nsizes; s++) {
+        size_t mb = argc > optind ? strtoul(argv[optind + s], NULL, 10) : default_sizes[s];
+        size_t bytes = mb * 1024 * 1024;
+        if (bytes > mapped) {
+            // grow and touch every page so it is resident and has a page table entry
+            char *grown = mapped == 0 ? mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0)
+                                      : mremap(memory, mapped, bytes, MREMAP_MAYMOVE);
+            if (grown == MAP_FAILED) {
+                perror("mmap");
+                return 1;
+            }
+            memory = grown;
+            for (size_t i = mapped; i < bytes; i += 4096) {
+                memory[i] = 1;
+            }
+            mapped = bytes;
+        }
+
+        fflush(report);
+        dup2(devnull, STDOUT_FILENO);
+
+        double start = now_us();
+        for (int i = 0; i < iterations; i++) {
+            if (fork_exec(command) == -1) {
+                fprintf(stderr, "fork+exec of %s failed\n", program);
+                return 1;
+            }
+        }
+        double forked = (now_us() - start) / iterations;
+
+        start = now_us();
+        for (int i = 0; i < iterations; i++) {
+            if (!do_exec(1, program)) {
+                fprintf(stderr, "do_exec of %s failed\n", program);
+                return 1;
+            }
+        }
+        double spawned = (now_us() - start) / iterations;
+
+        int rounds = iterations / batch > 0 ? iterations / batch : 1;
+        start = now_us();
+        for (int i = 0; i < rounds; i++) {
+            if (!do_exec_batch(commands, batch)) {
+                fprintf(stderr, "do_exec_batch of %s failed\n", program);
+                return 1;
+            }
+        }
+        double batched = (now_us() - start) / (rounds * batch);
+
+        fflush(stdout);
+        fprintf(report, "%10zu %14.1f %14.1f %14.1f\n", mb, forked, spawned, batched);
+    }
+    fclose(report);
+    return 0;
+}
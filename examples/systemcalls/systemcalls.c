@@ -1,8 +1,17 @@
+#define _GNU_SOURCE
 #include "systemcalls.h"
 #include "stdlib.h"
 #include "unistd.h"
 #include "sys/wait.h"
 #include <fcntl.h>
+#include <errno.h>
+#include <string.h>
+#include <spawn.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/syscall.h>
+
+extern char **environ;
 
 /**
  * @param cmd the command to execute with system()
@@ -35,6 +44,72 @@ bool do_system(const char *cmd)
     }
 }
 
+/**
+ * @param command - NULL terminated argument vector, command[0] is the full path
+ *   of the program (no PATH search, like execv())
+ * @param outputfile - file to redirect standard out to (created or truncated),
+ *   NULL to inherit standard out
+ * @param outfd, errfd - descriptors to use as standard out / standard error of
+ *   the command (pipe ends), -1 to leave them alone
+ * @return the pid of the started command, or -1 with errno set if it could not
+ *   be started (including a missing program or an unopenable outputfile)
+ *
+ * posix_spawn does not copy the page tables of the caller like fork() does:
+ * glibc starts the child with clone(CLONE_VM | CLONE_VFORK), so the cost of
+ * starting a command does not grow with the size of the caller. The redirect
+ * is a file action opening outputfile as standard out in the child.
+ */
+static pid_t spawn_command(char *const command[], const char *outputfile, int outfd, int errfd)
+{
+    posix_spawn_file_actions_t actions;
+    int rv = posix_spawn_file_actions_init(&actions);
+    if (rv != 0) {
+        errno = rv;
+        return -1;
+    }
+    if (outputfile != NULL) {
+        rv = posix_spawn_file_actions_addopen(&actions, STDOUT_FILENO, outputfile,
+                                              O_WRONLY | O_TRUNC | O_CREAT, 0644);
+    }
+    if (rv == 0 && outfd >= 0) {
+        rv = posix_spawn_file_actions_adddup2(&actions, outfd, STDOUT_FILENO);
+    }
+    if (rv == 0 && errfd >= 0) {
+        rv = posix_spawn_file_actions_adddup2(&actions, errfd, STDERR_FILENO);
+    }
+
+    pid_t pid = -1;
+    if (rv == 0) {
+        // pending output of the caller must not end up after the command's
+        fflush(stdout);
+        rv = posix_spawn(&pid, command[0], &actions, NULL, command, environ);
+    }
+    posix_spawn_file_actions_destroy(&actions);
+    if (rv != 0) {
+        errno = rv;
+        return -1;
+    }
+    return pid;
+}
+
+/* wait for pid; true if it exited with status 0 */
+static bool wait_command(pid_t pid, const char *prefix)
+{
+    int status;
+    while (waitpid(pid, &status, 0) == -1) {
+        if (errno != EINTR) {
+            printf("=> %sWAIT ERROR: %s\n", prefix, strerror(errno));
+            return false;
+        }
+    }
+    if (WIFEXITED(status) && WEXITSTATUS(status) == 0) {
+        printf("=> %sWAIT SUCCESS\n", prefix);
+        return true;
+    }
+    printf("=> %sWAIT FAILURE\n", prefix);
+    return false;
+}
+
 /**
  * @param count -The numbers of variables passed to the function. The variables are command to execute.
  *   followed by arguments to pass to the command
@@ -60,65 +135,223 @@ bool do_exec(int count, ...)
         command[i] = va_arg(args, char *);
     }
     command[count] = NULL;
-    // this line is to avoid a compile warning before your implementation is complete
-    // and may be removed
-    command[count] = command[count];
+    va_end(args);
 
-    /*
-     * TASK:
-     *   Execute a system command by calling fork, execv(),
-     *   and wait instead of system (see LSP page 161).
-     *   Use the command[0] as the full path to the command to execute
-     *   (first argument to execv), and use the remaining arguments
-     *   as second argument to the execv() command.
-     *
-     */
+    pid_t pid = spawn_command(command, NULL, -1, -1);
+    if (pid == -1) {
+        printf("EXEC ERROR %s: %s\n", command[0], strerror(errno));
+        return false;
+    }
+    return wait_command(pid, "");
+}
 
-    int status;
-    int rv;
-    pid_t pid;
-    pid = fork();
+/**
+ * @param outputfile - The full path to the file to write with command output.
+ *   This file will be closed at completion of the function call.
+ * All other parameters, see do_exec above
+ */
+bool do_exec_redirect(const char *outputfile, int count, ...)
+{
+    va_list args;
+    va_start(args, count);
+    char *command[count + 1];
+    int i;
+    for (i = 0; i < count; i++)
+    {
+        command[i] = va_arg(args, char *);
+    }
+    command[count] = NULL;
+    va_end(args);
 
-    switch(pid) {
-        // error
-        case -1:            
-            return false;
-        // new child process
-        case 0:             
-            rv = execv(command[0], command);
-            if (rv!=0) {
-                printf("EXEC ERROR %d\n", rv);
-            }
-            _exit(EXIT_FAILURE);
-        // parent
-        default:
-            if (waitpid(pid, &status, 0) == -1) {
-                printf("=> WAIT ERROR: %d\n", status);
-                return false;
-            } else if (WIFEXITED(status)) {
-                if (status == 0) {
-                    printf("=> WAIT SUCCESS\n");
-                    return true;
-                } else {
-                    printf("=> WAIT FAILURE\n");
-                    return false;
-                }
+    pid_t pid = spawn_command(command, outputfile, -1, -1);
+    if (pid == -1) {
+        printf("REDIR EXEC ERROR %s > %s: %s\n", command[0], outputfile, strerror(errno));
+        return false;
+    }
+    return wait_command(pid, "REDIR ");
+}
+
+/* pid file descriptor of pid, -1 if the kernel has none (before 5.3) */
+static int pidfd_open(pid_t pid)
+{
+#ifdef SYS_pidfd_open
+    return syscall(SYS_pidfd_open, pid, 0);
+#else
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+/* record the wait status of a finished command */
+static void reap_command(struct exec_command *cmd, pid_t pid)
+{
+    while (waitpid(pid, &cmd->status, 0) == -1) {
+        if (errno != EINTR) {
+            cmd->error = errno;
+            return;
+        }
+    }
+}
+
+/**
+ * @param commands - the commands to run, see struct exec_command; status and
+ *   error are filled in for every one of them
+ * @param count - number of commands
+ * @return true if every command was started and exited with status 0
+ *
+ * All commands are started right away, then reaped as they finish: a pid
+ * file descriptor of every child is watched with one epoll instance, so a
+ * slow command does not hold up collecting the others and no SIGCHLD
+ * handler is needed. Without pidfd support they are waited for in order.
+ * If the bookkeeping cannot be allocated no command is started and every
+ * error is ENOMEM.
+ */
+bool do_exec_batch(struct exec_command *commands, size_t count)
+{
+    pid_t *pids = malloc((count > 0 ? count : 1) * sizeof(pid_t));
+    int *pidfds = malloc((count > 0 ? count : 1) * sizeof(int));
+    size_t running = 0;
+    if (pids == NULL || pidfds == NULL) {
+        free(pids);
+        free(pidfds);
+        for (size_t i = 0; i < count; i++) {
+            commands[i].status = 0;
+            commands[i].error = ENOMEM;
+        }
+        printf("=> BATCH FAILURE (%zu commands)\n", count);
+        return false;
+    }
+
+    int epfd = epoll_create1(EPOLL_CLOEXEC);
+    for (size_t i = 0; i < count; i++) {
+        struct exec_command *cmd = &commands[i];
+        cmd->status = 0;
+        cmd->error = 0;
+        pidfds[i] = -1;
+        pids[i] = spawn_command(cmd->argv, cmd->outputfile, -1, -1);
+        if (pids[i] == -1) {
+            cmd->error = errno;
+            continue;
+        }
+        running++;
+        if (epfd != -1 && (pidfds[i] = pidfd_open(pids[i])) != -1) {
+            struct epoll_event ev = {.events = EPOLLIN, .data.u64 = i};
+            if (epoll_ctl(epfd, EPOLL_CTL_ADD, pidfds[i], &ev) == -1) {
+                close(pidfds[i]);
+                pidfds[i] = -1;
             }
+        }
     }
 
+    // children without a pidfd are waited for in order at the end
+    size_t watched = 0;
+    for (size_t i = 0; i < count; i++) {
+        watched += pidfds[i] != -1;
+    }
+    while (watched > 0) {
+        struct epoll_event events[64];
+        int n = epoll_wait(epfd, events, 64, -1);
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        for (int e = 0; e < n; e++) {
+            size_t i = events[e].data.u64;
+            reap_command(&commands[i], pids[i]);
+            // (closing alone does not remove it while the file is referenced elsewhere)
+            epoll_ctl(epfd, EPOLL_CTL_DEL, pidfds[i], NULL);
+            close(pidfds[i]);
+            pidfds[i] = -1;
+            pids[i] = -1;
+            watched--;
+            running--;
+        }
+    }
+    for (size_t i = 0; i < count && running > 0; i++) {
+        if (pids[i] != -1) {
+            if (pidfds[i] != -1) {
+                close(pidfds[i]);
+            }
+            reap_command(&commands[i], pids[i]);
+            running--;
+        }
+    }
+    if (epfd != -1) {
+        close(epfd);
+    }
+    free(pids);
+    free(pidfds);
 
-    va_end(args);
+    bool success = true;
+    for (size_t i = 0; i < count; i++) {
+        struct exec_command *cmd = &commands[i];
+        if (cmd->error != 0 || !WIFEXITED(cmd->status) || WEXITSTATUS(cmd->status) != 0) {
+            success = false;
+        }
+    }
+    printf("=> BATCH %s (%zu commands)\n", success ? "SUCCESS" : "FAILURE", count);
+    return success;
+}
 
+/* room for at least need more bytes (plus the terminating NUL) in output */
+static bool output_reserve(struct exec_output *output, size_t need)
+{
+    if (output->capacity - output->length > need) {
+        return true;
+    }
+    size_t capacity = output->capacity > 0 ? output->capacity : 4096;
+    while (capacity - output->length <= need) {
+        capacity *= 2;
+    }
+    char *data = realloc(output->data, capacity);
+    if (data == NULL) {
+        return false;
+    }
+    output->data = data;
+    output->capacity = capacity;
     return true;
+}
 
+/* append what can be read from fd without blocking to output; 0 at end of
+ * file, 1 if there may be more, -1 on error */
+static int output_read(struct exec_output *output, int fd)
+{
+    for (;;) {
+        if (!output_reserve(output, 65536)) {
+            return -1;
+        }
+        ssize_t got = read(fd, output->data + output->length, output->capacity - output->length - 1);
+        if (got > 0) {
+            output->length += got;
+            output->data[output->length] = '\0';
+            continue;
+        }
+        if (got == 0) {
+            return 0;
+        }
+        if (errno == EINTR) {
+            continue;
+        }
+        return errno == EAGAIN ? 1 : -1;
+    }
 }
 
 /**
- * @param outputfile - The full path to the file to write with command output.
- *   This file will be closed at completion of the function call.
+ * @param out - buffer the standard out of the command is appended to
+ * @param err - buffer for its standard error: NULL to leave standard error
+ *   alone, the same as out to capture both together (like 2>&1)
  * All other parameters, see do_exec above
+ * @return true if the command was executed and exited with status 0, and all
+ *   of its output was captured
+ *
+ * The output arrives through pipes that are drained with poll as it is
+ * written, so a command writing a lot to both never blocks on a full pipe.
+ * The buffers grow as needed and are kept NUL terminated; they may already
+ * hold data (it is appended to) and are freed by the caller.
  */
-bool do_exec_redirect(const char *outputfile, int count, ...)
+bool do_exec_capture(struct exec_output *out, struct exec_output *err, int count, ...)
 {
     va_list args;
     va_start(args, count);
@@ -129,66 +362,214 @@ bool do_exec_redirect(const char *outputfile, int count, ...)
         command[i] = va_arg(args, char *);
     }
     command[count] = NULL;
-    // this line is to avoid a compile warning before your implementation is complete
-    // and may be removed
-    command[count] = command[count];
-
-    /*
-     * TASK
-     *   Call execv, but first using https://stackoverflow.com/a/13784315/1446624 as a refernce,
-     *   redirect standard out to a file specified by outputfile.
-     *   The rest of the behaviour is same as do_exec()
-     *
-     */
+    va_end(args);
 
-    int status;
-    int rv;
-    pid_t pid;
+    int outpipe[2], errpipe[2] = {-1, -1};
+    if (pipe2(outpipe, O_CLOEXEC) == -1) {
+        printf("CAPTURE PIPE ERROR: %s\n", strerror(errno));
+        return false;
+    }
+    if (err != NULL && err != out && pipe2(errpipe, O_CLOEXEC) == -1) {
+        printf("CAPTURE PIPE ERROR: %s\n", strerror(errno));
+        close(outpipe[0]);
+        close(outpipe[1]);
+        return false;
+    }
+    int errfd = err == NULL ? -1 : err == out ? outpipe[1] : errpipe[1];
+    pid_t pid = spawn_command(command, NULL, outpipe[1], errfd);
+    int spawn_errno = errno;
 
-    int fd = open(outputfile, O_WRONLY|O_TRUNC|O_CREAT, 0644);
-    if (fd <0) {
-        printf("=> REDIR_FD ERROR");
+    // only the child writes, the pipes report end of file when it is done
+    close(outpipe[1]);
+    if (errpipe[1] != -1) {
+        close(errpipe[1]);
+    }
+    if (pid == -1) {
+        printf("CAPTURE EXEC ERROR %s: %s\n", command[0], strerror(spawn_errno));
+        close(outpipe[0]);
+        if (errpipe[0] != -1) {
+            close(errpipe[0]);
+        }
         return false;
     }
 
-    fflush(stdout);
+    struct pollfd fds[2] = {{.fd = outpipe[0], .events = POLLIN}, {.fd = errpipe[0], .events = POLLIN}};
+    struct exec_output *outputs[2] = {out, err};
+    bool ok = true;
+    fcntl(outpipe[0], F_SETFL, O_NONBLOCK);
+    if (errpipe[0] != -1) {
+        fcntl(errpipe[0], F_SETFL, O_NONBLOCK);
+    }
+    while (fds[0].fd != -1 || fds[1].fd != -1) {
+        // poll skips the negative ones
+        if (poll(fds, 2, -1) == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            ok = false;
+            break;
+        }
+        for (int s = 0; s < 2; s++) {
+            if (fds[s].fd == -1 || fds[s].revents == 0) {
+                continue;
+            }
+            int rv = output_read(outputs[s], fds[s].fd);
+            if (rv <= 0) {
+                // end of file, or an error: stop reading, the child gets SIGPIPE
+                ok = ok && rv == 0;
+                close(fds[s].fd);
+                fds[s].fd = -1;
+            }
+        }
+    }
+    for (int s = 0; s < 2; s++) {
+        if (fds[s].fd != -1) {
+            close(fds[s].fd);
+        }
+    }
+    // reap the command whether or not its output was all read
+    bool waited = wait_command(pid, "CAPTURE ");
+    return ok && waited;
+}
 
-    pid = fork();
-    switch(pid) {
-        // error
-        case -1:            
+/* append exactly len bytes from fd to output */
+static bool output_take(struct exec_output *output, int fd, size_t len)
+{
+    if (!output_reserve(output, len)) {
+        return false;
+    }
+    while (len > 0) {
+        ssize_t got = read(fd, output->data + output->length, len);
+        if (got == -1 && errno == EINTR) {
+            continue;
+        }
+        if (got <= 0) {
             return false;
-        // new child process
-        case 0:             
-            if (dup2(fd,1) < 0) {
-                return false;
-            }
-            close(fd);
-            rv = execv(command[0], command);
-            if (rv!=0) {
-                printf("REDIR EXEC ERROR %d\n", rv);
+        }
+        output->length += got;
+        len -= got;
+    }
+    output->data[output->length] = '\0';
+    return true;
+}
+
+/* move up to len bytes from the pipe in to fd: with splice, or read and
+ * write if fd does not take splice; bytes moved, 0 at end of file, -1 on error */
+static ssize_t forward_some(int in, int fd, size_t len, bool *use_splice)
+{
+    for (;;) {
+        ssize_t moved;
+        if (*use_splice) {
+            moved = splice(in, NULL, fd, NULL, len, SPLICE_F_MOVE);
+            if (moved == -1 && errno == EINVAL) {
+                // (a file opened with O_APPEND, some devices)
+                *use_splice = false;
+                continue;
             }
-            exit(EXIT_FAILURE);
-        // parent
-        default:
-            if (waitpid(pid, &status, 0) == -1) {
-                printf("=> REDIR WAIT ERROR: %d\n", status);
-                return false;
-            } else if (WIFEXITED(status)) {
-                if (status == 0) {
-                    printf("=> REDIR WAIT SUCCESS\n");
-                    return true;
-                } else {
-                    printf("=> REDIR WAIT FAILURE\n");
-                    return false;
+        } else {
+            char buf[65536];
+            moved = read(in, buf, len < sizeof(buf) ? len : sizeof(buf));
+            for (ssize_t done = 0; moved > 0 && done < moved;) {
+                ssize_t n = write(fd, buf + done, moved - done);
+                if (n == -1 && errno != EINTR) {
+                    return -1;
                 }
+                done += n > 0 ? n : 0;
             }
-            fsync(fd);
-            close(fd);
+        }
+        if (moved == -1 && errno == EINTR) {
+            continue;
+        }
+        return moved;
     }
+}
 
+/* move everything from the pipe in to fd until the writer is done; with
+ * copy the data is also appended to it, duplicated through tee_pipe with tee */
+static bool forward_pipe(int in, int fd, struct exec_output *copy, const int tee_pipe[2])
+{
+    bool use_splice = true;
+    for (;;) {
+        ssize_t len = 65536;
+        if (copy != NULL) {
+            // duplicate what is in the pipe (waiting for some) and keep the duplicate
+            len = tee(in, tee_pipe[1], len, 0);
+            if (len == -1 && errno == EINTR) {
+                continue;
+            }
+            if (len <= 0) {
+                return len == 0;
+            }
+            if (!output_take(copy, tee_pipe[0], len)) {
+                return false;
+            }
+        }
+        // then move the original on, all of the duplicated part
+        do {
+            ssize_t moved = forward_some(in, fd, len, &use_splice);
+            if (moved <= 0) {
+                return moved == 0 && copy == NULL;
+            }
+            len -= moved;
+        } while (copy != NULL && len > 0);
+    }
+}
 
+/**
+ * @param outfd - descriptor the standard out of the command is written to
+ *   (a file, pipe or socket), it stays open
+ * @param copy - buffer that also gets a copy of the output, NULL for none
+ * All other parameters, see do_exec above
+ * @return true if the command was executed and exited with status 0, and all
+ *   of its output was written to outfd
+ *
+ * The output is moved from the command's pipe to outfd with splice, without
+ * copying it through this process; a copy for the caller is made with tee.
+ * (A file path is better served by do_exec_redirect, which lets the command
+ * write the file itself.)
+ */
+bool do_exec_forward(int outfd, struct exec_output *copy, int count, ...)
+{
+    va_list args;
+    va_start(args, count);
+    char *command[count + 1];
+    int i;
+    for (i = 0; i < count; i++)
+    {
+        command[i] = va_arg(args, char *);
+    }
+    command[count] = NULL;
     va_end(args);
 
-    return true;
+    int outpipe[2], tee_pipe[2] = {-1, -1};
+    if (pipe2(outpipe, O_CLOEXEC) == -1) {
+        printf("FORWARD PIPE ERROR: %s\n", strerror(errno));
+        return false;
+    }
+    if (copy != NULL && pipe2(tee_pipe, O_CLOEXEC) == -1) {
+        printf("FORWARD PIPE ERROR: %s\n", strerror(errno));
+        close(outpipe[0]);
+        close(outpipe[1]);
+        return false;
+    }
+    pid_t pid = spawn_command(command, NULL, outpipe[1], -1);
+    int spawn_errno = errno;
+    close(outpipe[1]);
+
+    bool ok = false;
+    if (pid == -1) {
+        printf("FORWARD EXEC ERROR %s: %s\n", command[0], strerror(spawn_errno));
+    } else {
+        ok = forward_pipe(outpipe[0], outfd, copy, tee_pipe);
+    }
+    close(outpipe[0]);
+    if (tee_pipe[0] != -1) {
+        close(tee_pipe[0]);
+        close(tee_pipe[1]);
+    }
+    if (pid == -1) {
+        return false;
+    }
+    bool waited = wait_command(pid, "FORWARD ");
+    return ok && waited;
 }
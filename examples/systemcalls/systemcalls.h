@@ -1,9 +1,32 @@
 #include <stdio.h>
 #include <stdbool.h>
 #include <stdarg.h>
+#include <stddef.h>
 
 bool do_system(const char *command);
 
 bool do_exec(int count, ...);
 
 bool do_exec_redirect(const char *outputfile, int count, ...);
+
+/* one command of do_exec_batch */
+struct exec_command {
+    char *const *argv;          // NULL terminated, argv[0] is the full path of the program
+    const char *outputfile;     // standard out is redirected to this file, NULL to inherit it
+    int status;                 // out: wait status (see waitpid), valid if error is 0
+    int error;                  // out: errno if the command could not be started or waited for
+};
+
+bool do_exec_batch(struct exec_command *commands, size_t count);
+
+/* growable buffer for the output captured by do_exec_capture / do_exec_forward;
+ * start with all zero (or with data to append to), free data when done */
+struct exec_output {
+    char *data;                 // NUL terminated
+    size_t length;              // bytes of output (without the NUL)
+    size_t capacity;            // bytes allocated
+};
+
+bool do_exec_capture(struct exec_output *out, struct exec_output *err, int count, ...);
+
+bool do_exec_forward(int outfd, struct exec_output *copy, int count, ...);
@@ -0,0 +1,158 @@
+/**
+ * threading-bench - cost of many delayed lock holders, threads against tasks
+ *
+ * Starts a number of requests which each wait up to a second, obtain one of a
+ * few mutexes and hold it for a millisecond, once with a thread per request
+ * (start_thread_obtaining_mutex) and once as tasks on the timer wheel workers
+ * (start_task_obtaining_mutex). With all of them waiting it reports the threads
+ * of the process and its resident set, then joins them all and reports the time
+ * and how many completed with success.
+ *
+ * build: cc -O2 -o threading-bench threading-bench.c threading.c -lpthread
+ * usage: threading-bench [-w max wait ms] [-m mutexes] [counts ...]
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include "threading.h"
+
+static double now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+/* Threads and VmRSS (in kB) from /proc/self/status */
+static void process_status(long *threads, long *rss_kb)
+{
+    char line[256];
+    FILE *status = fopen("/proc/self/status", "r");
+    *threads = *rss_kb = -1;
+    if (status == NULL) {
+        return;
+    }
+    while (fgets(line, sizeof(line), status) != NULL) {
+        if (strncmp(line, "Threads:", 8) == 0) {
+            *threads = strtol(line + 8, NULL, 10);
+        } else if (strncmp(line, "VmRSS:", 6) == 0) {
+            *rss_kb = strtol(line + 6, NULL, 10);
+        }
+    }
+    fclose(status);
+}
+
+struct result {
+    size_t started;
+    size_t succeeded;
+    long threads;
+    long rss_kb;
+    double ms;
+};
+
+static void run_threads(size_t count, pthread_mutex_t *mutexes, int nmutexes, int max_wait, struct result *r)
+{
+    pthread_t *threads = calloc(count, sizeof(pthread_t));
+    double start = now_ms();
+    memset(r, 0, sizeof(*r));
+    for (; r->started < count; r->started++) {
+        size_t i = r->started;
+        if (threads == NULL || !start_thread_obtaining_mutex(&threads[i], &mutexes[i % nmutexes], rand() % max_wait, 1)) {
+            break;
+        }
+    }
+    process_status(&r->threads, &r->rss_kb);
+    for (size_t i = 0; i < r->started; i++) {
+        void *data;
+        if (pthread_join(threads[i], &data) == 0) {
+            r->succeeded += ((struct thread_data *) data)->thread_complete_success;
+            free(data);
+        }
+    }
+    r->ms = now_ms() - start;
+    free(threads);
+}
+
+static void run_tasks(size_t count, pthread_mutex_t *mutexes, int nmutexes, int max_wait, struct result *r)
+{
+    struct thread_data **tasks = calloc(count, sizeof(struct thread_data *));
+    double start = now_ms();
+    memset(r, 0, sizeof(*r));
+    for (; r->started < count; r->started++) {
+        size_t i = r->started;
+        if (tasks == NULL || !start_task_obtaining_mutex(&tasks[i], &mutexes[i % nmutexes], rand() % max_wait, 1)) {
+            break;
+        }
+    }
+    process_status(&r->threads, &r->rss_kb);
+    for (size_t i = 0; i < r->started; i++) {
+        struct thread_data *data = join_task_obtaining_mutex(tasks[i]);
+        r->succeeded += data->thread_complete_success;
+        release_task_data(data);
+    }
+    r->ms = now_ms() - start;
+    free(tasks);
+}
+
+int main(int argc, char *argv[])
+{
+    int max_wait = 1000;
+    int nmutexes = 64;
+    int opt;
+    while ((opt = getopt(argc, argv, "w:m:")) != -1) {
+        switch (opt) {
+            case 'w':
+                max_wait = atoi(optarg);
+                break;
+            case 'm':
+                nmutexes = atoi(optarg);
+                break;
+            default:
+                fprintf(stderr, "usage: threading-bench [-w max wait ms] [-m mutexes] [counts ...]\n");
+                return 1;
+        }
+    }
+    static const size_t default_counts[] = {1000, 10000, 50000};
+    size_t ncounts = argc > optind ? (size_t) (argc - optind) : sizeof(default_counts) / sizeof(default_counts[0]);
+    if (max_wait < 1 || nmutexes < 1) {
+        fprintf(stderr, "max wait and mutexes must be positive\n");
+        return 1;
+    }
+    pthread_mutex_t *mutexes = calloc(nmutexes, sizeof(pthread_mutex_t));
+    if (mutexes == NULL) {
+        perror("calloc");
+        return 1;
+    }
+    for (int i = 0; i < nmutexes; i++) {
+        pthread_mutex_init(&mutexes[i], NULL);
+    }
+
+    // start_thread_obtaining_mutex logs every step, keep the table readable
+    int out = dup(STDOUT_FILENO);
+    int devnull = open("/dev/null", O_WRONLY);
+    if (out == -1 || devnull == -1) {
+        perror("open");
+        return 1;
+    }
+    FILE *report = fdopen(out, "w");
+    dup2(devnull, STDOUT_FILENO);
+    fprintf(report, "%8s %6s %9s %9s %9s %10s %9s\n", "count", "mode", "started", "succeeded", "threads", "rss kB", "ms");
+
+    for (size_t c = 0; c < ncounts; c++) {
+        size_t count = argc > optind ? strtoul(argv[optind + c], NULL, 10) : default_counts[c];
+        struct result r;
+        run_threads(count, mutexes, nmutexes, max_wait, &r);
+        fprintf(report, "%8zu %6s %9zu %9zu %9ld %10ld %9.0f\n", count, "thread", r.started, r.succeeded, r.threads, r.rss_kb, r.ms);
+        fflush(report);
+        run_tasks(count, mutexes, nmutexes, max_wait, &r);
+        fprintf(report, "%8zu %6s %9zu %9zu %9ld %10ld %9.0f\n", count, "task", r.started, r.succeeded, r.threads, r.rss_kb, r.ms);
+        fflush(report);
+    }
+    fclose(report);
+    return 0;
+}
@@ -2,6 +2,10 @@
 #include <unistd.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
 
 // Optional: use these functions to add debug or error prints to your application
 #define DEBUG_LOG(msg,...) printf("threading DEBUG: " msg "\n", ##__VA_ARGS__)
@@ -81,3 +85,323 @@ bool start_thread_obtaining_mutex(pthread_t *thread, pthread_mutex_t *mutex,int
     return true;
 }
 
+
+
+/*
+ * Task backend: the same wait / obtain / hold / release sequence run as a job on
+ * a small pool of worker threads instead of a thread per request. Every worker
+ * owns a hierarchical timer wheel with 1 ms ticks; a task sits in the wheel of
+ * the worker it was given to until its next step is due. A worker never blocks on
+ * the mutex of a task, it tries to lock it and if that fails tries again on the
+ * next tick, and as a task stays with its worker the mutex is unlocked by the
+ * thread that locked it.
+ */
+
+#define TASK_MAX_WORKERS 4
+#define TASK_SLAB 256                   // tasks allocated at once by the pool
+#define WHEEL_BITS 6
+#define WHEEL_SLOTS (1 << WHEEL_BITS)
+#define WHEEL_MASK (WHEEL_SLOTS - 1)
+#define WHEEL_LEVELS 6                  // 2^36 ticks, past the longest int wait in ms
+
+enum task_state {
+    TASK_OBTAIN,                        // waiting to obtain the mutex
+    TASK_HOLD,                          // holding the mutex until it is released
+    TASK_DONE,
+};
+
+struct task_worker;
+
+struct mutex_task {
+    struct thread_data data;            // first, the handle given to the caller
+    struct mutex_task *next;            // in a wheel slot, the incoming or the free list
+    uint64_t expires;                   // tick of the next step
+    enum task_state state;
+    struct task_worker *worker;
+    bool complete;                      // under the lock of the worker
+};
+
+struct task_worker {
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;                // new task or shutdown
+    pthread_cond_t done;                // a task completed
+    struct mutex_task *incoming;        // started, not yet in the wheel
+    // owned by the worker thread
+    uint64_t now;                       // last tick run
+    size_t pending;                     // tasks in the wheel
+    struct mutex_task *slots[WHEEL_LEVELS][WHEEL_SLOTS];
+};
+
+static pthread_once_t tasks_once = PTHREAD_ONCE_INIT;
+static struct task_worker *task_workers;
+static int task_nworkers;
+static unsigned int task_next;
+static pthread_mutex_t task_pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct mutex_task *task_pool;
+
+static uint64_t task_clock(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static struct mutex_task *task_alloc(void)
+{
+    pthread_mutex_lock(&task_pool_lock);
+    if (task_pool == NULL) {
+        struct mutex_task *slab = malloc(TASK_SLAB * sizeof(struct mutex_task));
+        if (slab == NULL) {
+            pthread_mutex_unlock(&task_pool_lock);
+            return NULL;
+        }
+        for (size_t i = 0; i < TASK_SLAB; i++) {
+            slab[i].next = i + 1 < TASK_SLAB ? &slab[i + 1] : NULL;
+        }
+        task_pool = slab;
+    }
+    struct mutex_task *task = task_pool;
+    task_pool = task->next;
+    pthread_mutex_unlock(&task_pool_lock);
+    return task;
+}
+
+static void task_free(struct mutex_task *task)
+{
+    pthread_mutex_lock(&task_pool_lock);
+    task->next = task_pool;
+    task_pool = task;
+    pthread_mutex_unlock(&task_pool_lock);
+}
+
+/* file a task under the level whose slots span its distance from now */
+static void wheel_insert(struct task_worker *w, struct mutex_task *task)
+{
+    uint64_t delta = task->expires - w->now;
+    int level = 0;
+    while (level < WHEEL_LEVELS - 1 && delta >> (WHEEL_BITS * (level + 1)) != 0) {
+        level++;
+    }
+    size_t slot = (task->expires >> (WHEEL_BITS * level)) & WHEEL_MASK;
+    task->next = w->slots[level][slot];
+    w->slots[level][slot] = task;
+}
+
+static void task_schedule(struct task_worker *w, struct mutex_task *task, int wait_ms)
+{
+    // a step is due on a later tick even without a wait, never on the one running
+    task->expires = w->now + (wait_ms > 0 ? (uint64_t) wait_ms : 1);
+    wheel_insert(w, task);
+}
+
+/* run the next step of a task, returns true once it is complete */
+static bool task_step(struct task_worker *w, struct mutex_task *task)
+{
+    struct thread_data *data = &task->data;
+    int rc;
+    switch (task->state) {
+        case TASK_OBTAIN:
+            rc = pthread_mutex_trylock(data->mutex);
+            if (rc == EBUSY) {
+                task_schedule(w, task, 1);
+                return false;
+            }
+            if (rc != 0) {
+                ERROR_LOG("could not obtain mutex for task %p", data);
+                return true;
+            }
+            task->state = TASK_HOLD;
+            task_schedule(w, task, data->wait_to_release_ms);
+            return false;
+        case TASK_HOLD:
+            if (pthread_mutex_unlock(data->mutex) != 0) {
+                ERROR_LOG("could not release mutex for task %p", data);
+                return true;
+            }
+            data->thread_complete_success = true;
+            return true;
+        default:
+            return true;
+    }
+}
+
+/* advance the wheel by one tick, completed tasks are added to *done */
+static void wheel_tick(struct task_worker *w, struct mutex_task **done)
+{
+    w->now++;
+    // at the start of a slot of a higher level move its tasks down, highest first
+    // as they may land in the slot of the level below that starts now as well
+    int top = 0;
+    while (top + 1 < WHEEL_LEVELS && (w->now & ((1ULL << (WHEEL_BITS * (top + 1))) - 1)) == 0) {
+        top++;
+    }
+    for (int level = top; level > 0; level--) {
+        size_t slot = (w->now >> (WHEEL_BITS * level)) & WHEEL_MASK;
+        struct mutex_task *task = w->slots[level][slot];
+        w->slots[level][slot] = NULL;
+        while (task != NULL) {
+            struct mutex_task *next = task->next;
+            wheel_insert(w, task);
+            task = next;
+        }
+    }
+    struct mutex_task *task = w->slots[0][w->now & WHEEL_MASK];
+    w->slots[0][w->now & WHEEL_MASK] = NULL;
+    while (task != NULL) {
+        struct mutex_task *next = task->next;
+        if (task_step(w, task)) {
+            task->state = TASK_DONE;
+            task->next = *done;
+            *done = task;
+            w->pending--;
+        }
+        task = next;
+    }
+}
+
+/* ticks until the next one with work for level 0, or the end of its rotation */
+static uint64_t wheel_idle_ticks(struct task_worker *w)
+{
+    uint64_t ticks = 1;
+    for (; ticks < WHEEL_SLOTS - (w->now & WHEEL_MASK); ticks++) {
+        if (w->slots[0][(w->now + ticks) & WHEEL_MASK] != NULL) {
+            break;
+        }
+    }
+    return ticks;
+}
+
+static void* task_worker_run(void* param)
+{
+    struct task_worker *w = (struct task_worker *) param;
+    pthread_mutex_lock(&w->lock);
+    for (;;) {
+        struct mutex_task *incoming = w->incoming;
+        w->incoming = NULL;
+        pthread_mutex_unlock(&w->lock);
+
+        uint64_t now = task_clock();
+        if (w->pending == 0) {
+            // nothing filed, skip the idle ticks
+            w->now = now;
+        }
+        while (incoming != NULL) {
+            struct mutex_task *next = incoming->next;
+            task_schedule(w, incoming, incoming->data.wait_to_obtain_ms);
+            w->pending++;
+            incoming = next;
+        }
+        struct mutex_task *done = NULL;
+        while (w->now < now) {
+            wheel_tick(w, &done);
+        }
+
+        pthread_mutex_lock(&w->lock);
+        if (done != NULL) {
+            // completion is published under the lock the joiners wait with
+            while (done != NULL) {
+                struct mutex_task *next = done->next;
+                done->complete = true;
+                done = next;
+            }
+            pthread_cond_broadcast(&w->done);
+        }
+        if (w->incoming != NULL) {
+            continue;
+        }
+        if (w->pending == 0) {
+            pthread_cond_wait(&w->wake, &w->lock);
+        } else {
+            uint64_t until = w->now + wheel_idle_ticks(w);
+            struct timespec ts = {
+                .tv_sec = until / 1000,
+                .tv_nsec = (until % 1000) * 1000000,
+            };
+            pthread_cond_timedwait(&w->wake, &w->lock, &ts);
+        }
+    }
+    return NULL;
+}
+
+static void tasks_init(void)
+{
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int n = cpus < 1 ? 1 : cpus > TASK_MAX_WORKERS ? TASK_MAX_WORKERS : (int) cpus;
+    struct task_worker *workers = calloc(n, sizeof(struct task_worker));
+    if (workers == NULL) {
+        ERROR_LOG("could not allocate task workers");
+        return;
+    }
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    int started = 0;
+    for (; started < n; started++) {
+        struct task_worker *w = &workers[started];
+        pthread_mutex_init(&w->lock, NULL);
+        pthread_cond_init(&w->wake, &attr);
+        pthread_cond_init(&w->done, NULL);
+        w->now = task_clock();
+        if (pthread_create(&w->thread, NULL, task_worker_run, w) != 0) {
+            ERROR_LOG("could not create task worker");
+            pthread_mutex_destroy(&w->lock);
+            pthread_cond_destroy(&w->wake);
+            pthread_cond_destroy(&w->done);
+            break;
+        }
+    }
+    pthread_condattr_destroy(&attr);
+    if (started == 0) {
+        free(workers);
+        return;
+    }
+    task_workers = workers;
+    task_nworkers = started;
+}
+
+bool start_task_obtaining_mutex(struct thread_data **task, pthread_mutex_t *mutex,int wait_to_obtain_ms, int wait_to_release_ms)
+{
+    pthread_once(&tasks_once, tasks_init);
+    if (task_nworkers == 0) {
+        return false;
+    }
+    struct mutex_task *t = task_alloc();
+    if (t == NULL) {
+        ERROR_LOG("could not allocate memory for task");
+        return false;
+    }
+    memset(t, 0, sizeof(*t));
+    t->data.mutex = mutex;
+    t->data.wait_to_obtain_ms = wait_to_obtain_ms;
+    t->data.wait_to_release_ms = wait_to_release_ms;
+    t->state = TASK_OBTAIN;
+
+    struct task_worker *w = &task_workers[__atomic_fetch_add(&task_next, 1, __ATOMIC_RELAXED) % task_nworkers];
+    t->worker = w;
+    pthread_mutex_lock(&w->lock);
+    t->next = w->incoming;
+    w->incoming = t;
+    pthread_cond_signal(&w->wake);
+    pthread_mutex_unlock(&w->lock);
+
+    *task = &t->data;
+    return true;
+}
+
+struct thread_data *join_task_obtaining_mutex(struct thread_data *task)
+{
+    struct mutex_task *t = (struct mutex_task *) task;
+    struct task_worker *w = t->worker;
+    pthread_mutex_lock(&w->lock);
+    while (!t->complete) {
+        pthread_cond_wait(&w->done, &w->lock);
+    }
+    pthread_mutex_unlock(&w->lock);
+    return task;
+}
+
+void release_task_data(struct thread_data *task)
+{
+    task_free((struct mutex_task *) task);
+}
@@ -43,3 +43,26 @@ struct thread_data{
 * @return true if the thread could be started, false if a failure occurred.
 */
 bool start_thread_obtaining_mutex(pthread_t *thread, pthread_mutex_t *mutex,int wait_to_obtain_ms, int wait_to_release_ms);
+
+/**
+* Same as start_thread_obtaining_mutex, but run as a task on a small pool of worker threads
+* (one per CPU, at most four) which wait with a timer wheel, instead of on a thread of its own.
+* Tasks and their thread_data come from a pool, so memory and thread count stay flat however many
+* tasks are waiting. A task tries to obtain @param mutex once per millisecond until it succeeds
+* rather than blocking on it, and is released by the worker thread which obtained it.
+* @param task filled with the thread_data of the started task, which is the handle to join it with
+* @return true if the task could be started, false if a failure occurred.
+*/
+bool start_task_obtaining_mutex(struct thread_data **task, pthread_mutex_t *mutex,int wait_to_obtain_ms, int wait_to_release_ms);
+
+/**
+* Wait for a task started with start_task_obtaining_mutex to complete, like pthread_join for a thread.
+* @return the thread_data of the task, with thread_complete_success set, to be given back with
+* release_task_data (not free) once it has been checked.
+*/
+struct thread_data *join_task_obtaining_mutex(struct thread_data *task);
+
+/**
+* Give the thread_data of a joined task back to the pool.
+*/
+void release_task_data(struct thread_data *task);
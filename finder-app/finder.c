@@ -0,0 +1,657 @@
+/**
+ * finder - count the files below a directory and the lines matching a string
+ * Author: Martin Mauersberg
+ * Date: 10/12/2023
+ *
+ * Native replacement for the two passes of finder.sh (find | wc -l and
+ * grep -r | wc -l) with the same output. The tree is walked once:
+ *  - directories are read with openat / getdents64 relative to their parent
+ *  - every subdirectory and every batch of files is a work item; each thread
+ *    works through its own deque newest first (depth first, few directories
+ *    open) and idle threads steal the oldest items (the biggest subtrees)
+ *    from the others
+ *  - files are mapped (small ones read) and searched once, counting the
+ *    files and the matching lines together
+ * Counting follows find -type f and grep -r: regular files only, symbolic
+ * links are not followed below the directory, and a matching file holding a
+ * NUL byte is binary and adds no lines (grep only reports it on stderr).
+ * A search string with regular expression characters is matched as a basic
+ * regular expression, like grep does, line by line.
+ * With -i the walk keeps an index of the tree (finder_index.c) and only
+ * searches the files that may match.
+*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <dirent.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "finder.h"
+
+/* directory entry as returned by getdents64 */
+struct linux_dirent64 {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+/* a subdirectory to read or a batch of files to search */
+struct work {
+    struct dir *dir;            // directory the names are in, NULL for the top directory
+    int is_dir;
+    int count;                  // names
+    size_t used;                // bytes of names
+    char names[];               // NUL separated
+};
+
+/************************************************************************************
+ * ----------------------  searching  ----------------------
+ * **********************************************************************************/
+typedef unsigned char vec16 __attribute__((vector_size(16)));
+
+/* first occurrence of needle (length > 1) in hay: 16 positions at a time, the
+ * first and the last byte of the needle are compared with vector instructions
+ * (SSE2 / NEON) and only positions where both match are compared in full */
+static const char *find_literal(const char *hay, size_t len, const char *needle, size_t length)
+{
+    if (length > len) {
+        return NULL;
+    }
+    vec16 first, last;
+    memset(&first, (unsigned char) needle[0], sizeof(first));
+    memset(&last, (unsigned char) needle[length - 1], sizeof(last));
+
+    size_t i = 0;
+    for (; i + length - 1 + sizeof(vec16) <= len; i += sizeof(vec16)) {
+        vec16 a, b;
+        memcpy(&a, hay + i, sizeof(a));
+        memcpy(&b, hay + i + length - 1, sizeof(b));
+        vec16 hit = (vec16) (a == first) & (vec16) (b == last);
+        uint64_t half[2];
+        memcpy(half, &hit, sizeof(half));
+        if ((half[0] | half[1]) == 0) {
+            continue;
+        }
+        for (size_t k = 0; k < sizeof(vec16); k++) {
+            if (hit[k] && memcmp(hay + i + k + 1, needle + 1, length - 2) == 0) {
+                return hay + i + k;
+            }
+        }
+    }
+    return memmem(hay + i, len - i, needle, length);
+}
+
+/* lines in data (a last line without newline counts too) */
+static size_t count_all_lines(const char *data, size_t size)
+{
+    size_t lines = 0;
+    const char *p = data, *end = data + size;
+    const char *nl;
+    while ((nl = memchr(p, '\n', end - p)) != NULL) {
+        lines++;
+        p = nl + 1;
+    }
+    return lines + (p < end);
+}
+
+/* lines of data matching the search string */
+static size_t count_matches(struct finder *f, const char *data, size_t size)
+{
+    const char *p = data, *end = data + size;
+    size_t lines = 0;
+
+    if (f->use_regex) {
+        while (p < end) {
+            const char *nl = memchr(p, '\n', end - p);
+            const char *eol = nl != NULL ? nl : end;
+            regmatch_t match = {.rm_so = 0, .rm_eo = eol - p};
+            if (regexec(&f->regex, p, 1, &match, REG_STARTEND) == 0) {
+                lines++;
+            }
+            p = eol + 1;
+        }
+        return lines;
+    }
+    if (f->length == 0) {
+        return count_all_lines(data, size);
+    }
+
+    // one hit per line is enough, continue after the end of its line
+    const char *hit;
+    while (p < end) {
+        if (f->length == 1) {
+            hit = memchr(p, f->needle[0], end - p);
+        } else {
+            hit = find_literal(p, end - p, f->needle, f->length);
+        }
+        if (hit == NULL) {
+            break;
+        }
+        lines++;
+        const char *nl = memchr(hit, '\n', end - hit);
+        if (nl == NULL) {
+            break;
+        }
+        p = nl + 1;
+    }
+    return lines;
+}
+
+/* lines of a file matching the search string, binary files match none */
+size_t search_data(struct finder *f, const char *data, size_t size)
+{
+    size_t lines = count_matches(f, data, size);
+    if (lines > 0 && memchr(data, '\0', size) != NULL) {
+        return 0;
+    }
+    return lines;
+}
+
+void report(const char *path, const char *name, int err)
+{
+    const char *sep = path[0] != '\0' && name[0] != '\0' ? "/" : "";
+    fprintf(stderr, "finder: %s%s%s: %s\n", path, sep, name, strerror(err));
+}
+
+/* open the regular file name in dir and read or map it; 0 or -1 (reported) */
+int file_load(struct worker *w, struct dir *dir, const char *name, struct file_data *file)
+{
+    int fd = openat(dir->fd, name, O_RDONLY | O_NOFOLLOW | O_NOCTTY | O_CLOEXEC);
+    if (fd == -1) {
+        report(dir->path, name, errno);
+        return -1;
+    }
+    if (fstat(fd, &file->st) == -1) {
+        report(dir->path, name, errno);
+        close(fd);
+        return -1;
+    }
+
+    int ret = 0;
+    file->mapped = 0;
+    if (file->st.st_size <= FINDER_READ_MAX) {
+        // mapping costs more than reading for small files
+        size_t size = 0;
+        while (size < FINDER_READ_MAX) {
+            ssize_t got = read(fd, w->buf + size, FINDER_READ_MAX - size);
+            if (got == -1 && errno == EINTR) {
+                continue;
+            }
+            if (got == -1) {
+                report(dir->path, name, errno);
+                ret = -1;
+                break;
+            }
+            if (got == 0) {
+                break;
+            }
+            size += got;
+        }
+        file->data = w->buf;
+        file->size = size;
+    } else {
+        // (a file truncated while it is being searched ends the search with SIGBUS)
+        char *data = mmap(NULL, file->st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data == MAP_FAILED) {
+            report(dir->path, name, errno);
+            ret = -1;
+        } else {
+            madvise(data, file->st.st_size, MADV_SEQUENTIAL);
+            file->data = data;
+            file->size = file->st.st_size;
+            file->mapped = 1;
+        }
+    }
+    close(fd);
+    return ret;
+}
+
+void file_unload(struct file_data *file)
+{
+    if (file->mapped) {
+        munmap((void *) file->data, file->size);
+    }
+}
+
+/* search the regular file name in dir */
+void search_file(struct worker *w, struct dir *dir, const char *name)
+{
+    struct file_data file;
+    if (file_load(w, dir, name, &file) == 0) {
+        w->lines += search_data(w->finder, file.data, file.size);
+        file_unload(&file);
+    }
+}
+
+/************************************************************************************
+ * ----------------------  work items  ----------------------
+ * **********************************************************************************/
+static void dir_put(struct dir *dir)
+{
+    if (dir != NULL && atomic_fetch_sub(&dir->refs, 1) == 1) {
+        close(dir->fd);
+        free(dir);
+    }
+}
+
+static struct work *work_new(struct dir *dir, int is_dir, size_t bytes)
+{
+    struct work *work = malloc(sizeof(struct work) + bytes);
+    if (work == NULL) {
+        return NULL;
+    }
+    work->dir = dir;
+    work->is_dir = is_dir;
+    work->count = 0;
+    work->used = 0;
+    if (dir != NULL) {
+        atomic_fetch_add(&dir->refs, 1);
+    }
+    return work;
+}
+
+static void work_free(struct work *work)
+{
+    dir_put(work->dir);
+    free(work);
+}
+
+static int deque_push(struct deque *q, struct work *work)
+{
+    pthread_mutex_lock(&q->lock);
+    if (q->count == q->cap) {
+        size_t cap = q->cap > 0 ? q->cap * 2 : 64;
+        struct work **items = malloc(cap * sizeof(struct work *));
+        if (items == NULL) {
+            pthread_mutex_unlock(&q->lock);
+            return -1;
+        }
+        for (size_t i = 0; i < q->count; i++) {
+            items[i] = q->items[(q->head + i) & (q->cap - 1)];
+        }
+        free(q->items);
+        q->items = items;
+        q->head = 0;
+        q->cap = cap;
+    }
+    q->items[(q->head + q->count) & (q->cap - 1)] = work;
+    q->count++;
+    pthread_mutex_unlock(&q->lock);
+    return 0;
+}
+
+/* newest item, for the owner */
+static struct work *deque_pop(struct deque *q)
+{
+    struct work *work = NULL;
+    pthread_mutex_lock(&q->lock);
+    if (q->count > 0) {
+        q->count--;
+        work = q->items[(q->head + q->count) & (q->cap - 1)];
+    }
+    pthread_mutex_unlock(&q->lock);
+    return work;
+}
+
+/* oldest item, for the other threads */
+static struct work *deque_steal(struct deque *q)
+{
+    struct work *work = NULL;
+    pthread_mutex_lock(&q->lock);
+    if (q->count > 0) {
+        work = q->items[q->head];
+        q->head = (q->head + 1) & (q->cap - 1);
+        q->count--;
+    }
+    pthread_mutex_unlock(&q->lock);
+    return work;
+}
+
+/* queue work on w's deque, or do it right away if that is not possible */
+static void work_done(struct finder *f);
+static void work_run(struct worker *w, struct work *work);
+
+static void work_push(struct worker *w, struct work *work)
+{
+    struct finder *f = w->finder;
+    atomic_fetch_add(&f->pending, 1);
+    if (deque_push(&w->queue, work) == -1) {
+        work_run(w, work);
+        return;
+    }
+    if (atomic_load(&f->idle) > 0) {
+        pthread_mutex_lock(&f->idle_lock);
+        pthread_cond_signal(&f->idle_cond);
+        pthread_mutex_unlock(&f->idle_lock);
+    }
+}
+
+static void work_done(struct finder *f)
+{
+    if (atomic_fetch_sub(&f->pending, 1) == 1) {
+        // the walk is complete, let the waiting threads finish
+        pthread_mutex_lock(&f->idle_lock);
+        pthread_cond_broadcast(&f->idle_cond);
+        pthread_mutex_unlock(&f->idle_lock);
+    }
+}
+
+/************************************************************************************
+ * ----------------------  walking  ----------------------
+ * **********************************************************************************/
+/* read the directory of work: count its regular files, queue them in
+ * batches and queue its subdirectories */
+static void read_dir(struct worker *w, struct work *work)
+{
+    struct dir *parent = work->dir;
+    const char *name = work->names;
+    int fd;
+    if (parent == NULL) {
+        fd = open(name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    } else {
+        fd = openat(parent->fd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    }
+    if (fd == -1) {
+        report(parent != NULL ? parent->path : "", name, errno);
+        return;
+    }
+
+    size_t plen = parent != NULL ? strlen(parent->path) : 0;
+    size_t nlen = strlen(name);
+    struct dir *dir = malloc(sizeof(struct dir) + plen + nlen + 2);
+    if (dir == NULL) {
+        report(parent != NULL ? parent->path : "", name, ENOMEM);
+        close(fd);
+        return;
+    }
+    dir->fd = fd;
+    atomic_init(&dir->refs, 1);
+    if (parent != NULL) {
+        snprintf(dir->path, plen + nlen + 2, "%s%s%s", parent->path,
+                 plen > 0 && parent->path[plen - 1] == '/' ? "" : "/", name);
+    } else {
+        strcpy(dir->path, name);
+    }
+
+    struct work *batch = NULL;
+    for (;;) {
+        long got = syscall(SYS_getdents64, fd, w->dents, FINDER_DENTS);
+        if (got == -1 && errno == EINTR) {
+            continue;
+        }
+        if (got == -1) {
+            report(dir->path, "", errno);
+            break;
+        }
+        if (got == 0) {
+            break;
+        }
+        for (long pos = 0; pos < got;) {
+            struct linux_dirent64 *d = (struct linux_dirent64 *) (w->dents + pos);
+            pos += d->d_reclen;
+            const char *entry = d->d_name;
+            if (entry[0] == '.' && (entry[1] == '\0' || (entry[1] == '.' && entry[2] == '\0'))) {
+                continue;
+            }
+            unsigned char type = d->d_type;
+            if (type == DT_UNKNOWN) {
+                // filesystem without types in its entries
+                struct stat st;
+                if (fstatat(fd, entry, &st, AT_SYMLINK_NOFOLLOW) == -1) {
+                    report(dir->path, entry, errno);
+                    continue;
+                }
+                type = S_ISDIR(st.st_mode) ? DT_DIR : S_ISREG(st.st_mode) ? DT_REG : DT_UNKNOWN;
+            }
+
+            size_t len = strlen(entry) + 1;
+            if (type == DT_DIR) {
+                struct work *sub = work_new(dir, 1, len);
+                if (sub == NULL) {
+                    report(dir->path, entry, ENOMEM);
+                    continue;
+                }
+                memcpy(sub->names, entry, len);
+                sub->count = 1;
+                work_push(w, sub);
+            } else if (type == DT_REG) {
+                w->files++;
+                if (batch != NULL && (batch->count == FINDER_BATCH_FILES ||
+                                      batch->used + len > FINDER_BATCH_BYTES)) {
+                    work_push(w, batch);
+                    batch = NULL;
+                }
+                if (batch == NULL && (batch = work_new(dir, 0, FINDER_BATCH_BYTES)) == NULL) {
+                    report(dir->path, entry, ENOMEM);
+                    continue;
+                }
+                memcpy(batch->names + batch->used, entry, len);
+                batch->used += len;
+                batch->count++;
+            }
+        }
+    }
+    if (batch != NULL) {
+        work_push(w, batch);
+    }
+    dir_put(dir);
+}
+
+/* do work and free it */
+static void work_run(struct worker *w, struct work *work)
+{
+    if (work->is_dir) {
+        read_dir(w, work);
+    } else {
+        const char *name = work->names;
+        for (int i = 0; i < work->count; i++) {
+            if (w->finder->index != NULL) {
+                index_file(w, work->dir, name);
+            } else {
+                search_file(w, work->dir, name);
+            }
+            name += strlen(name) + 1;
+        }
+    }
+    work_free(work);
+    work_done(w->finder);
+}
+
+/* next work item: own newest, else the oldest of another thread; NULL once the walk is complete */
+static struct work *work_next(struct worker *w)
+{
+    struct finder *f = w->finder;
+    for (;;) {
+        struct work *work = deque_pop(&w->queue);
+        for (int i = 1; work == NULL && i < f->nthreads; i++) {
+            work = deque_steal(&f->workers[(w->index + i) % f->nthreads].queue);
+        }
+        if (work != NULL) {
+            return work;
+        }
+
+        pthread_mutex_lock(&f->idle_lock);
+        if (atomic_load(&f->pending) == 0) {
+            pthread_mutex_unlock(&f->idle_lock);
+            return NULL;
+        }
+        // woken by new work, by the end of the walk, or after a while to look again
+        struct timespec until;
+        clock_gettime(CLOCK_REALTIME, &until);
+        until.tv_nsec += FINDER_IDLE_NS;
+        if (until.tv_nsec >= 1000000000) {
+            until.tv_sec++;
+            until.tv_nsec -= 1000000000;
+        }
+        atomic_fetch_add(&f->idle, 1);
+        pthread_cond_timedwait(&f->idle_cond, &f->idle_lock, &until);
+        atomic_fetch_sub(&f->idle, 1);
+        pthread_mutex_unlock(&f->idle_lock);
+    }
+}
+
+static void *worker_thread(void *arg)
+{
+    struct worker *w = arg;
+    struct work *work;
+    while ((work = work_next(w)) != NULL) {
+        work_run(w, work);
+    }
+    return NULL;
+}
+
+/* walk directory with nthreads threads (0 = one per CPU), with the search
+ * index in index_path unless that is NULL */
+static int finder(const char *directory, const char *needle, int nthreads, const char *index_path)
+{
+    struct finder f;
+    memset(&f, 0, sizeof(f));
+    f.needle = needle;
+    f.length = strlen(needle);
+    atomic_init(&f.pending, 0);
+    atomic_init(&f.idle, 0);
+    pthread_mutex_init(&f.idle_lock, NULL);
+    pthread_cond_init(&f.idle_cond, NULL);
+
+    // grep takes the string as a basic regular expression, plain text is searched directly
+    if (strpbrk(needle, "\\.[*^$") != NULL) {
+        int err = regcomp(&f.regex, needle, REG_NOSUB);
+        if (err != 0) {
+            char msg[256];
+            regerror(err, &f.regex, msg, sizeof(msg));
+            fprintf(stderr, "finder: %s\n", msg);
+            return 1;
+        }
+        f.use_regex = 1;
+    }
+
+    if (nthreads <= 0) {
+        nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    if (nthreads < 1) {
+        nthreads = 1;
+    }
+    if (nthreads > FINDER_MAX_THREADS) {
+        nthreads = FINDER_MAX_THREADS;
+    }
+    f.nthreads = nthreads;
+    if (index_path != NULL) {
+        f.index = index_open(index_path, directory, nthreads);
+        if (f.index == NULL) {
+            perror("finder");
+            return 1;
+        }
+        index_query(f.index, needle, f.use_regex);
+    }
+    f.workers = calloc(nthreads, sizeof(struct worker));
+    if (f.workers == NULL) {
+        perror("finder");
+        return 1;
+    }
+    for (int i = 0; i < nthreads; i++) {
+        struct worker *w = &f.workers[i];
+        w->finder = &f;
+        w->index = i;
+        pthread_mutex_init(&w->queue.lock, NULL);
+        w->buf = malloc(FINDER_READ_MAX);
+        w->dents = malloc(FINDER_DENTS);
+        if (w->buf == NULL || w->dents == NULL) {
+            perror("finder");
+            return 1;
+        }
+    }
+
+    // the top directory is the first work item of thread 0
+    size_t len = strlen(directory) + 1;
+    struct work *top = work_new(NULL, 1, len);
+    if (top == NULL) {
+        perror("finder");
+        return 1;
+    }
+    memcpy(top->names, directory, len);
+    top->count = 1;
+    atomic_store(&f.pending, 1);
+    deque_push(&f.workers[0].queue, top);
+
+    for (int i = 1; i < nthreads; i++) {
+        // if a thread cannot be started the others (at least this one) do its share
+        f.workers[i].started = pthread_create(&f.workers[i].thread, NULL, worker_thread, &f.workers[i]) == 0;
+    }
+    worker_thread(&f.workers[0]);
+
+    // all threads are done before any deque goes away, they steal from each other until the end
+    for (int i = 0; i < nthreads; i++) {
+        if (f.workers[i].started) {
+            pthread_join(f.workers[i].thread, NULL);
+        }
+    }
+    size_t files = 0, lines = 0;
+    for (int i = 0; i < nthreads; i++) {
+        struct worker *w = &f.workers[i];
+        files += w->files;
+        lines += w->lines;
+        free(w->queue.items);
+        free(w->buf);
+        free(w->dents);
+        pthread_mutex_destroy(&w->queue.lock);
+    }
+    free(f.workers);
+    if (f.index != NULL) {
+        index_save(f.index);
+        index_close(f.index);
+    }
+    if (f.use_regex) {
+        regfree(&f.regex);
+    }
+
+    printf("The number of files are %zu and the number of matching lines are %zu\n", files, lines);
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    int nthreads = 0;
+    const char *index_path = NULL;
+    int opt;
+    while ((opt = getopt(argc, argv, "j:i:")) != -1) {
+        switch (opt) {
+            case 'j':
+                nthreads = atoi(optarg);
+                break;
+            case 'i':
+                index_path = optarg;
+                break;
+            default:
+                fprintf(stderr, "usage: finder [-j threads] [-i indexfile] directory searchstr\n");
+                return 1;
+        }
+    }
+
+    // same messages as finder.sh
+    if (argc - optind < 2) {
+        printf("this command requires two parameters (directory and search string)\n");
+        return 1;
+    }
+    const char *directory = argv[optind];
+    const char *needle = argv[optind + 1];
+
+    struct stat st;
+    if (stat(directory, &st) == -1 || !S_ISDIR(st.st_mode)) {
+        printf("directory %s does not exist\n", directory);
+        return 1;
+    }
+
+    printf("Path is %s and file is %s\n", directory, needle);
+    fflush(stdout);
+    return finder(directory, needle, nthreads, index_path);
+}
@@ -0,0 +1,90 @@
+/**
+ * finder - shared declarations of the tree walk and the search index
+ * Author: Martin Mauersberg
+ * Date: 10/12/2023
+*/
+
+#ifndef FINDER_H
+#define FINDER_H
+
+#include <stddef.h>
+#include <stdatomic.h>
+#include <regex.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#define FINDER_MAX_THREADS 64
+#define FINDER_DENTS (64 * 1024)        // getdents64 buffer
+#define FINDER_BATCH_FILES 64           // files per work item
+#define FINDER_BATCH_BYTES 4096         // bytes of names per work item
+#define FINDER_READ_MAX (128 * 1024)    // files up to this size are read, larger ones mapped
+#define FINDER_IDLE_NS 1000000          // idle threads look for work again after 1 ms
+
+/* open directory, shared by the work items naming its entries */
+struct dir {
+    int fd;
+    atomic_int refs;
+    char path[];                // as given on the command line plus the names below it
+};
+
+struct work;
+
+/* work items of one thread: the owner takes the newest, thieves the oldest */
+struct deque {
+    pthread_mutex_t lock;
+    struct work **items;        // ring of cap (a power of two) entries
+    size_t head, count, cap;
+};
+
+struct finder;
+
+struct worker {
+    struct finder *finder;
+    pthread_t thread;
+    int started;
+    int index;
+    struct deque queue;
+    size_t files;               // regular files seen
+    size_t lines;               // matching lines
+    char *buf;                  // FINDER_READ_MAX bytes for small files
+    char *dents;                // FINDER_DENTS bytes for getdents64
+};
+
+struct finder {
+    const char *needle;
+    size_t length;
+    int use_regex;
+    regex_t regex;
+    int nthreads;
+    struct worker *workers;
+    struct finder_index *index; // -i: search index or NULL
+    atomic_size_t pending;      // work items queued or running
+    atomic_int idle;            // threads waiting for work
+    pthread_mutex_t idle_lock;
+    pthread_cond_t idle_cond;
+};
+
+/* content of a file opened for searching (read into the worker's buffer or mapped) */
+struct file_data {
+    const char *data;
+    size_t size;
+    int mapped;
+    struct stat st;
+};
+
+/* finder.c */
+void report(const char *path, const char *name, int err);
+int file_load(struct worker *w, struct dir *dir, const char *name, struct file_data *file);
+void file_unload(struct file_data *file);
+size_t search_data(struct finder *f, const char *data, size_t size);
+void search_file(struct worker *w, struct dir *dir, const char *name);
+
+/* finder_index.c: trigram signatures of the files below a directory, kept
+ * in a file and brought up to date (by size and mtime) on every walk */
+struct finder_index *index_open(const char *path, const char *root, int nthreads);
+void index_query(struct finder_index *ix, const char *needle, int use_regex);
+void index_file(struct worker *w, struct dir *dir, const char *name);
+int index_save(struct finder_index *ix);
+void index_close(struct finder_index *ix);
+
+#endif
@@ -17,6 +17,23 @@ then
     exit 1
 fi
 
+# the native finder (next to this script or on the PATH) walks the tree once,
+# without it find and grep walk it twice. With FINDER_INDEX set it keeps a
+# search index of the tree in that file for repeated searches
+FINDER=$(dirname "$0")/finder
+if [ ! -x "${FINDER}" ]
+then
+    FINDER=$(command -v finder || true)
+fi
+if [ -n "${FINDER}" ] && [ -n "${FINDER_INDEX:-}" ]
+then
+    exec "${FINDER}" -i "${FINDER_INDEX}" "${FILESDIR}" "${SEARCHSTR}"
+fi
+if [ -n "${FINDER}" ]
+then
+    exec "${FINDER}" "${FILESDIR}" "${SEARCHSTR}"
+fi
+
 echo "Path is ${FILESDIR} and file is ${SEARCHSTR}"
 
 FILECOUNT=`find ${FILESDIR} -type f | wc -l`
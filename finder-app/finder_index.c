@@ -0,0 +1,541 @@
+/**
+ * finder - persistent search index
+ * Author: Martin Mauersberg
+ * Date: 10/12/2023
+ *
+ * Repeated searches of the same tree should not read every file again. The
+ * index file (-i) holds for every regular file below the directory its
+ * inode, size and mtime and a trigram signature: a bloom filter of all three
+ * byte sequences of the file that do not span a newline (so any string found
+ * on one of its lines has all of its trigrams set). Binary files (holding a
+ * NUL byte) and empty ones never add matching lines and have no signature;
+ * files over 1 MB have none either (it would be all ones) and are always
+ * searched.
+ *
+ * Every walk with the index stats the files instead of reading them:
+ *  - a file with the inode, size and mtime of its entry is current; only if
+ *    all trigrams of the search string are in its signature is it searched
+ *  - a new or changed file is read once for both its new entry and the search
+ *  - entries of files not seen any more are dropped
+ * The index file is rewritten (to a temporary name, then renamed over it)
+ * only when something changed.
+ *
+ * File layout: struct index_header, the root directory, then per file an
+ * index_record, its path and its signature, each padded to 8 bytes. The
+ * root is stored normalized and the paths below it start with it, so "dir",
+ * "./dir/" and the absolute path share one index.
+*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <limits.h>
+#include <sys/mman.h>
+
+#include "finder.h"
+
+#define INDEX_MAGIC "FINDIDX1"
+#define INDEX_BLOOM_MIN 64          // signature bytes of small files
+#define INDEX_BLOOM_MAX 4096        // signature bytes of files from 32 KB on
+#define INDEX_SIGN_MAX (1024 * 1024)    // larger files have too many trigrams for a signature
+#define INDEX_MAX_TRIGRAMS 64       // trigrams of the search string checked
+#define INDEX_BINARY 1              // record flag: holds a NUL byte
+
+#define PAD8(n) (((n) + 7) & ~(size_t) 7)
+
+struct index_header {
+    char magic[8];
+    uint32_t nfiles;
+    uint32_t root_len;
+};
+
+struct index_record {
+    uint64_t ino;
+    uint64_t size;
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+    uint32_t bloom_bytes;       // 0 or a power of two
+    uint16_t path_len;
+    uint16_t flags;
+};
+
+/* file of the index, from the index file or added by this walk */
+struct index_entry {
+    struct index_record rec;
+    const char *path;           // rec.path_len bytes, not terminated
+    const unsigned char *bloom;
+};
+
+/* entries added by one worker */
+struct index_added {
+    struct index_entry *entries;
+    size_t count, cap;
+} __attribute__((aligned(64)));
+
+struct finder_index {
+    char *path;                 // index file
+    char *root;                 // directory it is for, as realpath has it
+    size_t given_len;           // length of the directory as given, which the walk's paths start with
+    char *map;                  // index file as loaded
+    size_t map_size;
+    struct index_entry *entries;
+    size_t count;
+    uint32_t *table;            // path hash: entry + 1, 0 = free
+    size_t mask;
+    atomic_uchar *seen;         // entry found current by this walk
+    struct index_added *added;  // per worker
+    int nthreads;
+    uint32_t trigrams[INDEX_MAX_TRIGRAMS];  // every candidate has all of them
+    int ntrigrams;
+};
+
+/************************************************************************************
+ * ----------------------  signatures  ----------------------
+ * **********************************************************************************/
+/* signature size for size bytes of content: about one bit per byte */
+static size_t bloom_size(size_t size)
+{
+    size_t bytes = INDEX_BLOOM_MIN;
+    while (bytes < INDEX_BLOOM_MAX && bytes * 8 < size) {
+        bytes *= 2;
+    }
+    return bytes;
+}
+
+/* two bits per trigram, from the well mixed upper half of a multiplicative hash */
+static void bloom_add(unsigned char *bloom, size_t bytes, uint32_t trigram)
+{
+    uint64_t h = trigram * 0x9e3779b97f4a7c15ULL;
+    size_t mask = bytes * 8 - 1;
+    size_t a = (h >> 48) & mask, b = (h >> 32) & mask;
+    bloom[a / 8] |= 1 << (a % 8);
+    bloom[b / 8] |= 1 << (b % 8);
+}
+
+static int bloom_has(const unsigned char *bloom, size_t bytes, uint32_t trigram)
+{
+    uint64_t h = trigram * 0x9e3779b97f4a7c15ULL;
+    size_t mask = bytes * 8 - 1;
+    size_t a = (h >> 48) & mask, b = (h >> 32) & mask;
+    return (bloom[a / 8] & (1 << (a % 8))) && (bloom[b / 8] & (1 << (b % 8)));
+}
+
+/* signature of data, NULL if out of memory */
+static unsigned char *bloom_build(const char *data, size_t size, size_t bytes)
+{
+    unsigned char *bloom = calloc(1, bytes);
+    if (bloom == NULL) {
+        return NULL;
+    }
+    const unsigned char *p = (const unsigned char *) data;
+    uint32_t trigram = 0;
+    size_t run = 0;             // bytes since the last newline
+    for (size_t i = 0; i < size; i++) {
+        if (p[i] == '\n') {
+            run = 0;
+            continue;
+        }
+        trigram = ((trigram << 8) | p[i]) & 0xffffff;
+        if (++run >= 3) {
+            bloom_add(bloom, bytes, trigram);
+        }
+    }
+    return bloom;
+}
+
+/************************************************************************************
+ * ----------------------  lookup  ----------------------
+ * **********************************************************************************/
+static uint64_t path_hash(const char *path, size_t len)
+{
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for (size_t i = 0; i < len; i++) {
+        h = (h ^ (unsigned char) path[i]) * 0x100000001b3ULL;
+    }
+    return h;
+}
+
+/* entry of path or -1 */
+static ssize_t index_lookup(struct finder_index *ix, const char *path, size_t len)
+{
+    if (ix->table == NULL) {
+        return -1;
+    }
+    for (size_t slot = path_hash(path, len) & ix->mask;; slot = (slot + 1) & ix->mask) {
+        uint32_t i = ix->table[slot];
+        if (i == 0) {
+            return -1;
+        }
+        const struct index_entry *e = &ix->entries[i - 1];
+        if (e->rec.path_len == len && memcmp(e->path, path, len) == 0) {
+            return i - 1;
+        }
+    }
+}
+
+/* whether the file of a current entry may hold the search string */
+static int index_candidate(struct finder_index *ix, const struct index_entry *e)
+{
+    if ((e->rec.flags & INDEX_BINARY) || e->rec.size == 0) {
+        return 0;
+    }
+    for (int i = 0; i < ix->ntrigrams && e->rec.bloom_bytes > 0; i++) {
+        if (!bloom_has(e->bloom, e->rec.bloom_bytes, ix->trigrams[i])) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/************************************************************************************
+ * ----------------------  loading  ----------------------
+ * **********************************************************************************/
+/* entries of the mapped index file; -1 if it is not a valid index for ix->root */
+static int index_parse(struct finder_index *ix)
+{
+    struct index_header header;
+    if (ix->map_size < sizeof(header)) {
+        return -1;
+    }
+    memcpy(&header, ix->map, sizeof(header));
+    size_t pos = PAD8(sizeof(header) + header.root_len);
+    if (memcmp(header.magic, INDEX_MAGIC, sizeof(header.magic)) != 0 || pos > ix->map_size) {
+        return -1;
+    }
+    if (header.root_len != strlen(ix->root) ||
+        memcmp(ix->map + sizeof(header), ix->root, header.root_len) != 0) {
+        // built for another directory, start over
+        return 0;
+    }
+
+    ix->entries = malloc(header.nfiles * sizeof(struct index_entry));
+    if (ix->entries == NULL && header.nfiles > 0) {
+        return -1;
+    }
+    for (uint32_t n = 0; n < header.nfiles; n++) {
+        struct index_entry *e = &ix->entries[n];
+        if (pos + sizeof(e->rec) > ix->map_size) {
+            return -1;
+        }
+        memcpy(&e->rec, ix->map + pos, sizeof(e->rec));
+        pos += sizeof(e->rec);
+        e->path = ix->map + pos;
+        pos += PAD8(e->rec.path_len);
+        e->bloom = (const unsigned char *) ix->map + pos;
+        pos += e->rec.bloom_bytes;
+        if (pos > ix->map_size || (e->rec.bloom_bytes & (e->rec.bloom_bytes - 1)) != 0) {
+            return -1;
+        }
+    }
+    ix->count = header.nfiles;
+
+    size_t slots = 16;
+    while (slots < ix->count * 2) {
+        slots *= 2;
+    }
+    ix->table = calloc(slots, sizeof(uint32_t));
+    ix->seen = calloc(ix->count + 1, sizeof(atomic_uchar));
+    if (ix->table == NULL || ix->seen == NULL) {
+        return -1;
+    }
+    ix->mask = slots - 1;
+    for (size_t i = 0; i < ix->count; i++) {
+        size_t slot = path_hash(ix->entries[i].path, ix->entries[i].rec.path_len) & ix->mask;
+        while (ix->table[slot] != 0) {
+            slot = (slot + 1) & ix->mask;
+        }
+        ix->table[slot] = i + 1;
+    }
+    return 0;
+}
+
+/* index of the files below root kept in path (empty if it does not exist yet) */
+struct finder_index *index_open(const char *path, const char *root, int nthreads)
+{
+    struct finder_index *ix = calloc(1, sizeof(struct finder_index));
+    if (ix == NULL) {
+        return NULL;
+    }
+    ix->path = strdup(path);
+    // a root that does not resolve fails the walk anyway, keep it as given
+    ix->root = realpath(root, NULL);
+    if (ix->root == NULL) {
+        ix->root = strdup(root);
+    }
+    ix->given_len = strlen(root);
+    ix->nthreads = nthreads;
+    ix->added = aligned_alloc(64, nthreads * sizeof(struct index_added));
+    if (ix->path == NULL || ix->root == NULL || ix->added == NULL) {
+        index_close(ix);
+        return NULL;
+    }
+    memset(ix->added, 0, nthreads * sizeof(struct index_added));
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        if (errno != ENOENT) {
+            report(path, "", errno);
+        }
+        return ix;
+    }
+    struct stat st;
+    if (fstat(fd, &st) == 0 && st.st_size > 0) {
+        ix->map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+        if (ix->map == MAP_FAILED) {
+            ix->map = NULL;
+        } else {
+            ix->map_size = st.st_size;
+        }
+    }
+    close(fd);
+
+    if (ix->map != NULL && index_parse(ix) == -1) {
+        fprintf(stderr, "finder: %s: not a valid index, rebuilding it\n", path);
+        free(ix->entries);
+        free(ix->table);
+        free(ix->seen);
+        ix->entries = NULL;
+        ix->table = NULL;
+        ix->seen = NULL;
+        ix->count = 0;
+    }
+    return ix;
+}
+
+/************************************************************************************
+ * ----------------------  searching  ----------------------
+ * **********************************************************************************/
+/* trigrams every matching line contains: those of the search string, or for
+ * a regular expression those of its runs of plain characters (none if it has
+ * escapes, which include GNU alternation) */
+void index_query(struct finder_index *ix, const char *needle, int use_regex)
+{
+    ix->ntrigrams = 0;
+    if (use_regex && strchr(needle, '\\') != NULL) {
+        return;
+    }
+    uint32_t trigram = 0;
+    size_t run = 0;
+    for (size_t i = 0; needle[i] != '\0' && ix->ntrigrams < INDEX_MAX_TRIGRAMS; i++) {
+        char c = needle[i];
+        if (use_regex && c == '[') {
+            // skip the bracket expression, including [:class:], [.coll.] and [=equiv=]
+            size_t j = i + 1;
+            if (needle[j] == '^') {
+                j++;
+            }
+            if (needle[j] == ']') {
+                j++;
+            }
+            while (needle[j] != '\0' && needle[j] != ']') {
+                if (needle[j] == '[' && needle[j + 1] != '\0' && strchr(":.=", needle[j + 1]) != NULL) {
+                    char delim = needle[j + 1];
+                    j += 2;
+                    while (needle[j] != '\0' && !(needle[j] == delim && needle[j + 1] == ']')) {
+                        j++;
+                    }
+                    j += needle[j] != '\0' ? 2 : 0;
+                } else {
+                    j++;
+                }
+            }
+            i = needle[j] != '\0' ? j : j - 1;
+            run = 0;
+            continue;
+        }
+        if (use_regex && (strchr(".*^$", c) != NULL || needle[i + 1] == '*')) {
+            // not a plain character, or one that may be left out
+            run = 0;
+            continue;
+        }
+        trigram = ((trigram << 8) | (unsigned char) c) & 0xffffff;
+        if (++run >= 3) {
+            ix->trigrams[ix->ntrigrams++] = trigram;
+        }
+    }
+}
+
+static int index_add(struct index_added *added, const struct index_entry *e)
+{
+    if (added->count == added->cap) {
+        size_t cap = added->cap > 0 ? added->cap * 2 : 256;
+        struct index_entry *entries = realloc(added->entries, cap * sizeof(struct index_entry));
+        if (entries == NULL) {
+            return -1;
+        }
+        added->entries = entries;
+        added->cap = cap;
+    }
+    added->entries[added->count++] = *e;
+    return 0;
+}
+
+/* search the regular file name in dir with the index */
+void index_file(struct worker *w, struct dir *dir, const char *name)
+{
+    struct finder_index *ix = w->finder->index;
+    char path[PATH_MAX];
+    // the entry's path below the normalized root instead of the walk's
+    const char *rel = dir->path + ix->given_len;
+    rel += strspn(rel, "/");
+    size_t rlen = strlen(ix->root);
+    const char *sep = rlen > 0 && ix->root[rlen - 1] == '/' ? "" : "/";
+    int len = *rel != '\0' ? snprintf(path, sizeof(path), "%s%s%s/%s", ix->root, sep, rel, name)
+                           : snprintf(path, sizeof(path), "%s%s%s", ix->root, sep, name);
+    if (len < 0 || len >= (int) sizeof(path) || len > UINT16_MAX) {
+        search_file(w, dir, name);
+        return;
+    }
+
+    struct stat st;
+    if (fstatat(dir->fd, name, &st, AT_SYMLINK_NOFOLLOW) == -1) {
+        report(dir->path, name, errno);
+        return;
+    }
+    ssize_t i = index_lookup(ix, path, len);
+    if (i >= 0) {
+        const struct index_entry *e = &ix->entries[i];
+        if (e->rec.ino == (uint64_t) st.st_ino && e->rec.size == (uint64_t) st.st_size &&
+            e->rec.mtime_sec == st.st_mtim.tv_sec && e->rec.mtime_nsec == st.st_mtim.tv_nsec) {
+            atomic_store(&ix->seen[i], 1);
+            if (index_candidate(ix, e)) {
+                search_file(w, dir, name);
+            }
+            return;
+        }
+    }
+
+    // new or changed: read it once for its entry and the search
+    struct file_data file;
+    if (file_load(w, dir, name, &file) == -1) {
+        return;
+    }
+    w->lines += search_data(w->finder, file.data, file.size);
+
+    struct index_entry e;
+    memset(&e, 0, sizeof(e));
+    e.rec.ino = file.st.st_ino;
+    e.rec.size = file.st.st_size;
+    e.rec.mtime_sec = file.st.st_mtim.tv_sec;
+    e.rec.mtime_nsec = file.st.st_mtim.tv_nsec;
+    e.rec.path_len = len;
+    if (memchr(file.data, '\0', file.size) != NULL) {
+        e.rec.flags |= INDEX_BINARY;
+    } else if (file.size > 0 && file.size <= INDEX_SIGN_MAX) {
+        e.rec.bloom_bytes = bloom_size(file.size);
+        e.bloom = bloom_build(file.data, file.size, e.rec.bloom_bytes);
+    }
+    file_unload(&file);
+
+    char *copy = malloc(len);
+    if (copy == NULL || (e.rec.bloom_bytes > 0 && e.bloom == NULL) || index_add(&ix->added[w->index], &e) == -1) {
+        // left out of the index, the next walk reads the file again
+        free(copy);
+        free((void *) e.bloom);
+        return;
+    }
+    memcpy(copy, path, len);
+    ix->added[w->index].entries[ix->added[w->index].count - 1].path = copy;
+}
+
+/************************************************************************************
+ * ----------------------  saving  ----------------------
+ * **********************************************************************************/
+static int write_entry(FILE *out, const struct index_entry *e)
+{
+    static const char zeros[8];
+    return fwrite(&e->rec, sizeof(e->rec), 1, out) == 1 &&
+           fwrite(e->path, 1, e->rec.path_len, out) == e->rec.path_len &&
+           fwrite(zeros, 1, PAD8(e->rec.path_len) - e->rec.path_len, out) == PAD8(e->rec.path_len) - e->rec.path_len &&
+           (e->rec.bloom_bytes == 0 || fwrite(e->bloom, 1, e->rec.bloom_bytes, out) == e->rec.bloom_bytes) ? 0 : -1;
+}
+
+/* write the current entries if anything changed; 0 or -1 (reported) */
+int index_save(struct finder_index *ix)
+{
+    size_t kept = 0, added = 0;
+    for (size_t i = 0; i < ix->count; i++) {
+        kept += atomic_load(&ix->seen[i]);
+    }
+    for (int t = 0; t < ix->nthreads; t++) {
+        added += ix->added[t].count;
+    }
+    if (added == 0 && kept == ix->count && ix->map != NULL) {
+        return 0;
+    }
+    if (kept + added > UINT32_MAX) {
+        report(ix->path, "", EOVERFLOW);
+        return -1;
+    }
+
+    char tmpname[PATH_MAX];
+    snprintf(tmpname, sizeof(tmpname), "%s.%ld.tmp", ix->path, (long) getpid());
+    FILE *out = fopen(tmpname, "w");
+    if (out == NULL) {
+        report(tmpname, "", errno);
+        return -1;
+    }
+
+    struct index_header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, INDEX_MAGIC, sizeof(header.magic));
+    header.nfiles = kept + added;
+    header.root_len = strlen(ix->root);
+    static const char zeros[8];
+    int ok = fwrite(&header, sizeof(header), 1, out) == 1 &&
+             fwrite(ix->root, 1, header.root_len, out) == header.root_len &&
+             fwrite(zeros, 1, PAD8(sizeof(header) + header.root_len) - sizeof(header) - header.root_len, out) ==
+             PAD8(sizeof(header) + header.root_len) - sizeof(header) - header.root_len;
+    for (size_t i = 0; ok && i < ix->count; i++) {
+        if (atomic_load(&ix->seen[i])) {
+            ok = write_entry(out, &ix->entries[i]) == 0;
+        }
+    }
+    for (int t = 0; ok && t < ix->nthreads; t++) {
+        for (size_t i = 0; ok && i < ix->added[t].count; i++) {
+            ok = write_entry(out, &ix->added[t].entries[i]) == 0;
+        }
+    }
+    int err = ok ? 0 : errno;
+    if (fclose(out) != 0 && err == 0) {
+        err = errno;
+    }
+    if (err == 0 && rename(tmpname, ix->path) == -1) {
+        err = errno;
+    }
+    if (err != 0) {
+        report(ix->path, "", err);
+        unlink(tmpname);
+        return -1;
+    }
+    return 0;
+}
+
+void index_close(struct finder_index *ix)
+{
+    if (ix == NULL) {
+        return;
+    }
+    for (int t = 0; ix->added != NULL && t < ix->nthreads; t++) {
+        for (size_t i = 0; i < ix->added[t].count; i++) {
+            free((void *) ix->added[t].entries[i].path);
+            free((void *) ix->added[t].entries[i].bloom);
+        }
+        free(ix->added[t].entries);
+    }
+    free(ix->added);
+    if (ix->map != NULL) {
+        munmap(ix->map, ix->map_size);
+    }
+    free(ix->entries);
+    free(ix->table);
+    free(ix->seen);
+    free(ix->root);
+    free(ix->path);
+    free(ix);
+}
@@ -116,8 +116,8 @@ echo "Making device nodes"
 sudo mknod -m 666 dev/null c 1 3
 sudo mknod -m 666 dev/console c 5 1
 
-# TASK: Clean and build the writer utility
-echo "building the writer utility"
+# TASK: Clean and build the writer and finder utilities
+echo "building the writer and finder utilities"
 cd ${FINDER_APP_DIR}
 make clean
 make CROSS_COMPILE=${CROSS_COMPILE}
@@ -125,6 +125,7 @@ make CROSS_COMPILE=${CROSS_COMPILE}
 # TASK: Copy the finder related scripts and executables to the /home directory
 # on the target rootfs
 mv writer ${OUTDIR}/rootfs/home/
+mv finder ${OUTDIR}/rootfs/home/
 cp finder.sh ${OUTDIR}/rootfs/home/
 cp -r conf/ ${OUTDIR}/rootfs/home
 cp finder-test.sh ${OUTDIR}/rootfs/home/
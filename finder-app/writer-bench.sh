@@ -0,0 +1,59 @@
+#!/bin/sh
+# Compare writing NUMFILES small files with one writer call per file (the
+# finder-test.sh loop) against a single writer batch run over a manifest,
+# and against the same batch written durably (-d)
+# usage: writer-bench.sh [numfiles] [string] [threads]
+
+set -e
+set -u
+
+NUMFILES=${1:-10000}
+WRITESTR=${2:-AELD_IS_FUN}
+THREADS=${3:-0}
+WRITER=${WRITER:-writer}
+BENCHDIR=/tmp/aeld-writer-bench
+
+now() {
+	date +%s.%N
+}
+
+rm -rf "${BENCHDIR}"
+mkdir -p "${BENCHDIR}/loop" "${BENCHDIR}/batch" "${BENCHDIR}/durable"
+
+echo "Writing ${NUMFILES} files containing ${WRITESTR} with ${WRITER}"
+
+START=$(now)
+for i in $(seq 1 $NUMFILES)
+do
+	${WRITER} "${BENCHDIR}/loop/file$i.txt" "${WRITESTR}"
+done
+LOOP_END=$(now)
+
+# manifest lines are path<TAB>text
+manifest() {
+	seq 1 $NUMFILES | awk -v dir="$1" -v text="${WRITESTR}" '{ printf "%s/file%d.txt\t%s\n", dir, $1, text }'
+}
+
+manifest "${BENCHDIR}/batch" | ${WRITER} -m - -j ${THREADS}
+BATCH_END=$(now)
+
+manifest "${BENCHDIR}/durable" | ${WRITER} -d -m - -j ${THREADS}
+DURABLE_END=$(now)
+
+LOOPCOUNT=$(grep -rl "${WRITESTR}" "${BENCHDIR}/loop" | wc -l)
+BATCHCOUNT=$(grep -rl "${WRITESTR}" "${BENCHDIR}/batch" | wc -l)
+DURABLECOUNT=$(grep -rl "${WRITESTR}" "${BENCHDIR}/durable" | wc -l)
+rm -rf "${BENCHDIR}"
+
+echo "${START} ${LOOP_END} ${BATCH_END} ${DURABLE_END}" | awk -v n=${NUMFILES} '{
+	loop = $2 - $1; batch = $3 - $2; durable = $4 - $3
+	printf "loop:    %.3f s (%.0f files/s)\n", loop, n / loop
+	printf "batch:   %.3f s (%.0f files/s), %.1fx faster\n", batch, n / batch, loop / batch
+	printf "durable: %.3f s (%.0f files/s), %.1fx faster\n", durable, n / durable, loop / durable
+}'
+
+if [ ${LOOPCOUNT} -ne ${NUMFILES} ] || [ ${BATCHCOUNT} -ne ${NUMFILES} ] || [ ${DURABLECOUNT} -ne ${NUMFILES} ]
+then
+	echo "failed: expected ${NUMFILES} files, loop wrote ${LOOPCOUNT}, batch ${BATCHCOUNT} and durable ${DURABLECOUNT}"
+	exit 1
+fi
@@ -1,7 +1,19 @@
+#define _GNU_SOURCE
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <errno.h>
 #include <syslog.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <limits.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/stat.h>
+
+#define BATCH_MAX_THREADS 16    // files are small, a few threads hide the open/close latency
+#define BATCH_MAX_DEVS 16       // filesystems synced by name, beyond that all of them with sync()
 
 int writer(char* filename, char* text)
 {
@@ -33,11 +45,501 @@ int writer(char* filename, char* text)
     return 0;
 }
 
+/* one file of a manifest */
+struct batch_entry {
+    char *path;
+    char *text;
+    size_t length;
+    dev_t dev;                  // durable: filesystem of the staged file
+    int staged;                 // durable: written under its temporary name
+};
+
+/* what the batch threads do with each entry */
+enum batch_phase {
+    BATCH_WRITE,                // write it in place
+    BATCH_STAGE,                // durable: write it under a temporary name
+    BATCH_PUBLISH,              // durable: rename the staged file into place
+};
+
+/* a manifest being written by the batch threads */
+struct batch {
+    struct batch_entry *entries;
+    size_t count;
+    enum batch_phase phase;
+    atomic_size_t next;         // next entry to take
+    atomic_size_t written;      // files written
+    atomic_size_t bytes;        // bytes written
+    atomic_size_t failed;       // files that could not be written
+    pthread_mutex_t lock;       // first failure, reported in the summary
+    size_t error_index;
+    int error;
+};
+
+/* write all of text to fd; returns 0 or the errno */
+static int write_all(int fd, const char *text, size_t length)
+{
+    while (length > 0) {
+        ssize_t written = write(fd, text, length);
+        if (written == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return errno;
+        }
+        text += written;
+        length -= written;
+    }
+    return 0;
+}
+
+/* write text to filename with plain open / write; returns 0 or the errno */
+static int write_file(const char *filename, const char *text, size_t length)
+{
+    int fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd == -1) {
+        return errno;
+    }
+    int err = write_all(fd, text, length);
+    if (close(fd) == -1 && err == 0) {
+        err = errno;
+    }
+    return err;
+}
+
+/************************************************************************************
+ * durable writes: the new content is written under a temporary name next to
+ * the file and renamed over it, so a crash leaves either the old or the new
+ * file, never an empty or torn one
+ * **********************************************************************************/
+static atomic_int use_tmpfile = 1;  // cleared once O_TMPFILE (or /proc for linking it) is missing
+
+/* temporary name of entry i next to filename */
+static void temp_name(char *buf, size_t size, const char *filename, size_t i)
+{
+    snprintf(buf, size, "%s.%ld.%zu.tmp", filename, (long) getpid(), i);
+}
+
+/* unnamed file in the directory of filename, -1 if that is not possible */
+static int open_tmpfile(const char *filename)
+{
+    char dir[PATH_MAX];
+    const char *slash = strrchr(filename, '/');
+    if (slash == NULL) {
+        strcpy(dir, ".");
+    } else if (slash == filename) {
+        strcpy(dir, "/");
+    } else {
+        snprintf(dir, sizeof(dir), "%.*s", (int)(slash - filename), filename);
+    }
+    int fd = open(dir, O_WRONLY | O_TMPFILE | O_CLOEXEC, 0644);
+    if (fd == -1 && (errno == EOPNOTSUPP || errno == EISDIR || errno == EINVAL)) {
+        // kernel or filesystem without O_TMPFILE
+        atomic_store(&use_tmpfile, 0);
+    }
+    return fd;
+}
+
+/* write text to tmpname, next to filename: with O_TMPFILE it only gets that
+ * name once complete, otherwise it is created right away. With sync the data
+ * is fsynced. Returns 0 or the errno, *dev is the file's filesystem */
+static int stage_file(const char *filename, const char *tmpname, const char *text, size_t length, int sync, dev_t *dev)
+{
+    int named = 0;
+    int fd = atomic_load(&use_tmpfile) ? open_tmpfile(filename) : -1;
+    if (fd == -1) {
+        fd = open(tmpname, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+        if (fd == -1) {
+            return errno;
+        }
+        named = 1;
+    }
+
+    struct stat st;
+    int err = write_all(fd, text, length);
+    if (err == 0 && sync && fsync(fd) == -1) {
+        err = errno;
+    }
+    if (err == 0 && fstat(fd, &st) == -1) {
+        err = errno;
+    }
+    if (err == 0 && !named) {
+        char proc[32];
+        snprintf(proc, sizeof(proc), "/proc/self/fd/%d", fd);
+        if (linkat(AT_FDCWD, proc, AT_FDCWD, tmpname, AT_SYMLINK_FOLLOW) == 0) {
+            named = 1;
+        } else if (errno == ENOENT) {
+            // no /proc to link it from, write it under its name instead
+            atomic_store(&use_tmpfile, 0);
+            close(fd);
+            return stage_file(filename, tmpname, text, length, sync, dev);
+        } else {
+            err = errno;
+        }
+    }
+    if (close(fd) == -1 && err == 0) {
+        err = errno;
+    }
+    if (err != 0) {
+        if (named) {
+            unlink(tmpname);
+        }
+        return err;
+    }
+    *dev = st.st_dev;
+    return 0;
+}
+
+/* durable write of a single file: fsync the data, rename, fsync the directory */
+static int writer_durable(char *filename, char *text)
+{
+    char tmpname[PATH_MAX];
+    dev_t dev;
+    temp_name(tmpname, sizeof(tmpname), filename, 0);
+    int err = stage_file(filename, tmpname, text, strlen(text), 1, &dev);
+    if (err == 0 && rename(tmpname, filename) == -1) {
+        err = errno;
+        unlink(tmpname);
+    }
+    if (err == 0) {
+        char *slash = strrchr(filename, '/');
+        int dirfd;
+        if (slash == NULL) {
+            dirfd = open(".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        } else {
+            *slash = '\0';
+            dirfd = open(slash == filename ? "/" : filename, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+            *slash = '/';
+        }
+        if (dirfd == -1 || fsync(dirfd) == -1) {
+            err = errno;
+        }
+        if (dirfd != -1) {
+            close(dirfd);
+        }
+    }
+    if (err != 0) {
+        syslog(LOG_ERR,"Error writing %s durably [%d]: %s", filename, err, strerror(err));
+        return 1;
+    }
+    syslog(LOG_INFO,"Writing '%s' to %s (durable)", text, filename);
+    return 0;
+}
+
+/************************************************************************************
+ * batch mode
+ * **********************************************************************************/
+static void *batch_thread(void *arg)
+{
+    struct batch *batch = arg;
+    char tmpname[PATH_MAX];
+    size_t i;
+
+    while ((i = atomic_fetch_add(&batch->next, 1)) < batch->count) {
+        struct batch_entry *entry = &batch->entries[i];
+        int err = 0;
+        switch (batch->phase) {
+            case BATCH_WRITE:
+                err = write_file(entry->path, entry->text, entry->length);
+                break;
+            case BATCH_STAGE:
+                temp_name(tmpname, sizeof(tmpname), entry->path, i);
+                err = stage_file(entry->path, tmpname, entry->text, entry->length, 0, &entry->dev);
+                entry->staged = (err == 0);
+                break;
+            case BATCH_PUBLISH:
+                if (!entry->staged) {
+                    continue;
+                }
+                temp_name(tmpname, sizeof(tmpname), entry->path, i);
+                if (rename(tmpname, entry->path) == -1) {
+                    err = errno;
+                    unlink(tmpname);
+                }
+                break;
+        }
+        if (batch->phase == BATCH_STAGE && err == 0) {
+            // counted once it is in place
+            continue;
+        }
+        if (err != 0) {
+            atomic_fetch_add(&batch->failed, 1);
+            pthread_mutex_lock(&batch->lock);
+            if (batch->error == 0 || i < batch->error_index) {
+                batch->error = err;
+                batch->error_index = i;
+            }
+            pthread_mutex_unlock(&batch->lock);
+            continue;
+        }
+        atomic_fetch_add(&batch->written, 1);
+        atomic_fetch_add(&batch->bytes, entry->length);
+    }
+    return NULL;
+}
+
+/* undo the \n, \t and \\ escapes of a manifest text in place; returns its length */
+static size_t unescape(char *text)
+{
+    char *out = text;
+    for (char *in = text; *in != '\0'; in++) {
+        if (*in == '\\' && in[1] != '\0') {
+            in++;
+            *out++ = (*in == 'n') ? '\n' : (*in == 't') ? '\t' : *in;
+        } else {
+            *out++ = *in;
+        }
+    }
+    *out = '\0';
+    return out - text;
+}
+
+/* read "path<TAB>text" lines (empty lines are skipped); returns the number of
+ * entries or -1, *entries holds them and owns their strings */
+static ssize_t read_manifest(FILE *manifest, struct batch_entry **entries)
+{
+    size_t count = 0, capacity = 0, lineno = 0;
+    char *line = NULL;
+    size_t size = 0;
+    ssize_t length;
+
+    *entries = NULL;
+    while ((length = getline(&line, &size, manifest)) != -1) {
+        lineno++;
+        if (length > 0 && line[length - 1] == '\n') {
+            line[--length] = '\0';
+        }
+        if (length == 0) {
+            continue;
+        }
+        char *tab = strchr(line, '\t');
+        if (tab == NULL || tab == line) {
+            syslog(LOG_ERR,"manifest line %zu: expected path<TAB>text", lineno);
+            goto fail;
+        }
+        if (count == capacity) {
+            capacity = capacity > 0 ? capacity * 2 : 1024;
+            struct batch_entry *grown = realloc(*entries, capacity * sizeof(struct batch_entry));
+            if (grown == NULL) {
+                syslog(LOG_ERR,"out of memory reading the manifest");
+                goto fail;
+            }
+            *entries = grown;
+        }
+        // the entry keeps the line buffer: path and text are split at the tab
+        *tab = '\0';
+        (*entries)[count].path = line;
+        (*entries)[count].text = tab + 1;
+        (*entries)[count].length = unescape(tab + 1);
+        (*entries)[count].dev = 0;
+        (*entries)[count].staged = 0;
+        count++;
+        line = NULL;
+        size = 0;
+    }
+    if (ferror(manifest)) {
+        syslog(LOG_ERR,"Error reading the manifest: %s", strerror(errno));
+        goto fail;
+    }
+    free(line);
+    return count;
+
+fail:
+    free(line);
+    for (size_t i = 0; i < count; i++) {
+        free((*entries)[i].path);
+    }
+    free(*entries);
+    *entries = NULL;
+    return -1;
+}
+
+/* run phase over all entries with up to nthreads threads; returns the threads used */
+static int batch_run(struct batch *batch, enum batch_phase phase, int nthreads)
+{
+    pthread_t threads[BATCH_MAX_THREADS];
+    int started = 0;
+
+    batch->phase = phase;
+    atomic_store(&batch->next, 0);
+    while (started < nthreads && pthread_create(&threads[started], NULL, batch_thread, batch) == 0) {
+        started++;
+    }
+    if (started == 0) {
+        // no thread to spare, do it here
+        batch_thread(batch);
+        return 1;
+    }
+    for (int i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    return started;
+}
+
+/* make the staged files (or their renames) durable: one syncfs per filesystem
+ * instead of an fsync per file; returns the number of syncs or -1 */
+static int batch_sync(struct batch *batch)
+{
+    dev_t devs[BATCH_MAX_DEVS];
+    char tmpname[PATH_MAX];
+    int ndevs = 0;
+
+    for (size_t i = 0; i < batch->count; i++) {
+        struct batch_entry *entry = &batch->entries[i];
+        int seen = 0;
+        for (int d = 0; entry->staged && d < ndevs && !seen; d++) {
+            seen = (devs[d] == entry->dev);
+        }
+        if (!entry->staged || seen) {
+            continue;
+        }
+        if (ndevs == BATCH_MAX_DEVS) {
+            // spread over more filesystems than we keep track of
+            sync();
+            return ndevs + 1;
+        }
+        // either name works to reach the filesystem, whichever exists right now
+        temp_name(tmpname, sizeof(tmpname), entry->path, i);
+        int fd = open(tmpname, O_RDONLY | O_CLOEXEC);
+        if (fd == -1) {
+            fd = open(entry->path, O_RDONLY | O_CLOEXEC);
+        }
+        if (fd == -1 || syncfs(fd) == -1) {
+            int err = errno;
+            syslog(LOG_ERR,"Error syncing the filesystem of %s [%d]: %s", entry->path, err, strerror(err));
+            if (fd != -1) {
+                close(fd);
+            }
+            return -1;
+        }
+        close(fd);
+        devs[ndevs++] = entry->dev;
+    }
+    return ndevs;
+}
+
+/* write every file of the manifest (a path, or - for stdin) with nthreads
+ * threads (0 = one per core), logging a single summary. durable: stage every
+ * file under a temporary name, sync, rename them all into place, sync again */
+static int writer_batch(const char *name, int nthreads, int durable)
+{
+    FILE *manifest = strcmp(name, "-") == 0 ? stdin : fopen(name, "r");
+    if (manifest == NULL) {
+        int err = errno;
+        syslog(LOG_ERR,"Error opening manifest %s [%d]: %s", name, err, strerror(err));
+        return 1;
+    }
+    struct batch batch = { .error = 0 };
+    ssize_t count = read_manifest(manifest, &batch.entries);
+    if (manifest != stdin) {
+        fclose(manifest);
+    }
+    if (count == -1) {
+        return 1;
+    }
+    batch.count = count;
+    pthread_mutex_init(&batch.lock, NULL);
+
+    if (nthreads <= 0) {
+        long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+        nthreads = ncpus > 0 ? ncpus : 1;
+    }
+    if (nthreads > BATCH_MAX_THREADS) {
+        nthreads = BATCH_MAX_THREADS;
+    }
+    if ((size_t) nthreads > batch.count) {
+        nthreads = batch.count > 0 ? batch.count : 1;
+    }
+
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    int started, syncs = 0;
+    if (!durable) {
+        started = batch_run(&batch, BATCH_WRITE, nthreads);
+    } else {
+        // the renames must not reach the disk before the data they point to
+        started = batch_run(&batch, BATCH_STAGE, nthreads);
+        int staged = batch_sync(&batch);
+        if (staged == -1) {
+            char tmpname[PATH_MAX];
+            for (size_t i = 0; i < batch.count; i++) {
+                temp_name(tmpname, sizeof(tmpname), batch.entries[i].path, i);
+                if (batch.entries[i].staged) {
+                    unlink(tmpname);
+                }
+            }
+            atomic_store(&batch.failed, batch.count);
+        } else {
+            batch_run(&batch, BATCH_PUBLISH, nthreads);
+            int published = batch_sync(&batch);
+            syncs = staged + (published > 0 ? published : 0);
+            if (published == -1) {
+                atomic_store(&batch.failed, batch.count);
+            }
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    double elapsed = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+
+    // one summary instead of a line per file
+    size_t failed = atomic_load(&batch.failed);
+    char mode[64] = "";
+    if (durable) {
+        snprintf(mode, sizeof(mode), ", durable with %d filesystem sync(s)", syncs);
+    }
+    syslog(failed > 0 ? LOG_ERR : LOG_INFO,"Wrote %zu of %zu files (%zu bytes) from %s in %.3f s with %d thread(s)%s",
+           atomic_load(&batch.written), batch.count, atomic_load(&batch.bytes),
+           strcmp(name, "-") == 0 ? "stdin" : name, elapsed, started, mode);
+    if (failed > 0 && batch.error != 0) {
+        syslog(LOG_ERR,"Error writing %zu file(s), first %s [%d]: %s", failed,
+               batch.entries[batch.error_index].path, batch.error, strerror(batch.error));
+    }
+
+    for (size_t i = 0; i < batch.count; i++) {
+        free(batch.entries[i].path);
+    }
+    free(batch.entries);
+    pthread_mutex_destroy(&batch.lock);
+    return failed > 0 ? 1 : 0;
+}
+
 int main(int argc, char* argv[])
 {
     // open user log
     openlog(NULL,0,LOG_USER);
 
+    // batch mode: writer [-d] -m manifest [-j threads], durable single file: writer -d file text
+    if (argc > 1 && argv[1][0] == '-') {
+        const char *manifest = NULL;
+        int nthreads = 0;
+        int durable = 0;
+        int bad = 0;
+        int opt;
+        while ((opt = getopt(argc, argv, "m:j:d")) != -1) {
+            switch (opt) {
+                case 'm':
+                    manifest = optarg;
+                    break;
+                case 'j':
+                    nthreads = atoi(optarg);
+                    break;
+                case 'd':
+                    durable = 1;
+                    break;
+                default:
+                    bad = 1;
+                    break;
+            }
+        }
+        if (!bad && manifest == NULL && durable && argc - optind == 2) {
+            return writer_durable(argv[optind], argv[optind + 1]);
+        }
+        if (bad || manifest == NULL || optind != argc) {
+            syslog(LOG_ERR,"usage: writer [-d] file text | writer [-d] -m manifest|- [-j threads]");
+            return 1;
+        }
+        return writer_batch(manifest, nthreads, durable);
+    }
+
     // check that we have two parameters in addition to command (argc=3)
     if (argc != 3) {
         syslog(LOG_ERR,"writer needs two parameters");
@@ -46,4 +548,4 @@ int main(int argc, char* argv[])
 
     // call writer with arguments 1 and 2 and return status
     return writer(argv[1],argv[2]);
-}
\ No newline at end of file
+}
@@ -0,0 +1,835 @@
+/**
+ * Socket server - block compressed store
+ * Author: Martin Mauersberg
+ * Date: 10/12/2023
+ *
+ * OUTFILE as a sequence of compressed blocks. Packets are collected in an
+ * open block in memory until it holds block_size bytes, then the block is
+ * compressed with a small LZ77 codec (an LZ4 style token stream, so no
+ * library is needed) and appended behind a header with its lengths and the
+ * CRC-32 of its raw bytes. A block that does not shrink is stored as is.
+ *
+ * Replay finds the block holding a logical offset with a binary search over
+ * the block index, decompresses it and checks the CRC. The most recently
+ * used blocks stay in a small cache, so replays of the tail share one copy
+ * instead of each going to disk. Like ring packets, blocks are reference
+ * counted and a replay sends from one without holding the lock.
+ *
+ * The open block is kept on disk as an uncompressed record behind the last
+ * block: every append writes its new bytes there and then rewrites the
+ * record's header, and sealing the block overwrites the record with the
+ * compressed block. A crash so loses nothing the page cache got. An open with
+ * persist indexes the blocks a previous run left behind, continues its open
+ * record and cuts off a torn last block.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <stdatomic.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+
+#include <syslog.h>
+#include <pthread.h>
+
+#include "aesdsocket.h"
+#include "aesd_store.h"
+
+#define BLOCK_MAGIC 0x5a534541      // "AESZ"
+#define BLOCK_RAW 0x1               // payload stored uncompressed
+#define BLOCK_OPEN 0x2              // the open block's record, always the last one
+#define BLOCK_INDEX_MIN 256         // initial block index entries
+#define BLOCK_CACHE_BLOCKS 16       // decompressed blocks kept in memory
+
+#define LZ_MIN_MATCH 4
+#define LZ_HASH_BITS 12
+#define LZ_MAX_OFFSET 65535
+
+/* header in front of every block on disk */
+struct block_hdr {
+    uint32_t magic;
+    uint32_t raw_len;           // bytes after decompression
+    uint32_t stored_len;        // payload bytes following the header
+    uint32_t flags;
+    uint32_t raw_crc;           // CRC-32 of the raw bytes
+    uint32_t hdr_crc;           // CRC-32 of the fields above
+};
+
+/* one written block */
+struct block_entry {
+    off_t base;                 // logical offset of its first byte
+    off_t pos;                  // file offset of its header
+    uint32_t raw_len;
+    uint32_t stored_len;
+    uint32_t flags;
+    uint32_t raw_crc;
+};
+
+/* raw contents of a block, shared by the cache and the replays sending from it */
+struct block_buf {
+    atomic_int refs;
+    size_t len;
+    size_t cap;
+    char data[];
+};
+
+struct block_slot {
+    size_t block;               // index entry of the cached block
+    struct block_buf *buf;      // NULL if unused
+    unsigned long used;         // LRU clock
+};
+
+struct block_store {
+    struct aesd_store base;
+    pthread_mutex_t lock;
+    int fd;
+    char *path;
+    struct block_entry *index;  // oldest first
+    size_t nblocks;
+    size_t index_cap;
+    off_t file_size;            // end of the last written block
+    off_t total;                // running total of bytes appended
+    size_t block_size;
+    struct block_buf *open;     // block being filled, NULL before the first append
+    size_t open_written;        // bytes of it in its record at file_size
+    uint32_t open_crc;          // CRC-32 of those bytes
+    struct block_slot cache[BLOCK_CACHE_BLOCKS];
+    unsigned long clock;
+};
+
+/************************************************************************************
+ * ----------------------  CRC-32 and codec  ----------------------
+ * **********************************************************************************/
+static uint32_t crc_table[256];
+static pthread_once_t crc_once = PTHREAD_ONCE_INIT;
+
+static void crc_init(void)
+{
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t c = i;
+        for (int k = 0; k < 8; k++) {
+            c = c & 1 ? 0xedb88320 ^ (c >> 1) : c >> 1;
+        }
+        crc_table[i] = c;
+    }
+}
+
+/* CRC-32 of data following bytes whose CRC-32 is crc (0 for none) */
+static uint32_t crc32_update(uint32_t crc, const void *data, size_t len)
+{
+    const uint8_t *p = data;
+    uint32_t c = crc ^ 0xffffffff;
+    pthread_once(&crc_once, crc_init);
+    while (len-- > 0) {
+        c = crc_table[(c ^ *p++) & 0xff] ^ (c >> 8);
+    }
+    return c ^ 0xffffffff;
+}
+
+static uint32_t crc32(const void *data, size_t len)
+{
+    return crc32_update(0, data, len);
+}
+
+/* worst case compressed size of len bytes */
+static size_t lz_bound(size_t len)
+{
+    return len + len / 255 + 16;
+}
+
+static uint32_t lz_hash(const uint8_t *p)
+{
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+/* lengths of 15 and up continue in extra bytes, 255 meaning more follows */
+static void lz_put_len(uint8_t **op, size_t len)
+{
+    while (len >= 255) {
+        *(*op)++ = 255;
+        len -= 255;
+    }
+    *(*op)++ = (uint8_t) len;
+}
+
+static int lz_get_len(const uint8_t **ip, const uint8_t *end, size_t *len)
+{
+    uint8_t b;
+    do {
+        if (*ip >= end) {
+            return -1;
+        }
+        b = *(*ip)++;
+        *len += b;
+    } while (b == 255);
+    return 0;
+}
+
+static void lz_put_sequence(uint8_t **op, const uint8_t *lit, size_t nlit, size_t off, size_t mlen)
+{
+    uint8_t *token = (*op)++;
+    *token = (nlit >= 15 ? 15 : nlit) << 4;
+    if (nlit >= 15) {
+        lz_put_len(op, nlit - 15);
+    }
+    memcpy(*op, lit, nlit);
+    *op += nlit;
+    if (mlen == 0) {
+        return;     // the last sequence is literals only
+    }
+    *token |= mlen - LZ_MIN_MATCH >= 15 ? 15 : mlen - LZ_MIN_MATCH;
+    *(*op)++ = off & 0xff;
+    *(*op)++ = off >> 8;
+    if (mlen - LZ_MIN_MATCH >= 15) {
+        lz_put_len(op, mlen - LZ_MIN_MATCH - 15);
+    }
+}
+
+/* compress src into dst (lz_bound(len) bytes), returns the compressed size.
+ * Each sequence is a token (literal count, match length), the literals, a
+ * 16 bit match offset and the match length extension */
+static size_t lz_compress(const char *src, size_t len, char *dst)
+{
+    const uint8_t *in = (const uint8_t*) src, *end = in + len;
+    const uint8_t *ip = in, *anchor = in;
+    uint8_t *op = (uint8_t*) dst;
+    uint32_t table[1 << LZ_HASH_BITS] = { 0 };   // last position of each hashed 4 byte sequence
+
+    while (ip + LZ_MIN_MATCH <= end) {
+        uint32_t h = lz_hash(ip);
+        const uint8_t *ref = in + table[h];
+        table[h] = ip - in;
+        if (ref >= ip || ip - ref > LZ_MAX_OFFSET || memcmp(ref, ip, LZ_MIN_MATCH) != 0) {
+            ip++;
+            continue;
+        }
+        size_t mlen = LZ_MIN_MATCH;
+        while (ip + mlen < end && ref[mlen] == ip[mlen]) {
+            mlen++;
+        }
+        lz_put_sequence(&op, anchor, ip - anchor, ip - ref, mlen);
+        ip += mlen;
+        anchor = ip;
+    }
+    lz_put_sequence(&op, anchor, end - anchor, 0, 0);
+    return op - (uint8_t*) dst;
+}
+
+/* decompress src, which must decode to exactly len bytes, into dst */
+static int lz_decompress(const char *src, size_t slen, char *dst, size_t len)
+{
+    const uint8_t *ip = (const uint8_t*) src, *iend = ip + slen;
+    uint8_t *out = (uint8_t*) dst, *op = out, *oend = out + len;
+
+    while (ip < iend) {
+        uint8_t token = *ip++;
+        size_t nlit = token >> 4;
+        if (nlit == 15 && lz_get_len(&ip, iend, &nlit) == -1) {
+            return -1;
+        }
+        if ((size_t)(iend - ip) < nlit || (size_t)(oend - op) < nlit) {
+            return -1;
+        }
+        memcpy(op, ip, nlit);
+        ip += nlit;
+        op += nlit;
+        if (ip == iend) {
+            break;
+        }
+
+        if (iend - ip < 2) {
+            return -1;
+        }
+        size_t off = ip[0] | (size_t) ip[1] << 8;
+        ip += 2;
+        size_t mlen = token & 15;
+        if (mlen == 15 && lz_get_len(&ip, iend, &mlen) == -1) {
+            return -1;
+        }
+        mlen += LZ_MIN_MATCH;
+        if (off == 0 || off > (size_t)(op - out) || (size_t)(oend - op) < mlen) {
+            return -1;
+        }
+        const uint8_t *ref = op - off;
+        if (off >= mlen) {
+            memcpy(op, ref, mlen);
+            op += mlen;
+        } else {
+            // overlapping match repeats the last off bytes
+            while (mlen-- > 0) {
+                *op++ = *ref++;
+            }
+        }
+    }
+    return op == oend ? 0 : -1;
+}
+
+/************************************************************************************
+ * ----------------------  blocks  ----------------------
+ * **********************************************************************************/
+static struct block_buf *block_buf_new(size_t cap)
+{
+    struct block_buf *buf = malloc(sizeof(struct block_buf) + cap);
+    if (buf == NULL) {
+        return NULL;
+    }
+    atomic_init(&buf->refs, 1);
+    buf->len = 0;
+    buf->cap = cap;
+    return buf;
+}
+
+static void block_buf_put(struct block_buf *buf)
+{
+    if (buf != NULL && atomic_fetch_sub(&buf->refs, 1) == 1) {
+        free(buf);
+    }
+}
+
+static uint32_t block_hdr_crc(const struct block_hdr *hdr)
+{
+    return crc32(hdr, offsetof(struct block_hdr, hdr_crc));
+}
+
+static int pread_all(int fd, void *buf, size_t len, off_t pos)
+{
+    char *p = buf;
+    while (len > 0) {
+        ssize_t got = pread(fd, p, len, pos);
+        if (got == -1 && errno == EINTR) {
+            continue;
+        }
+        if (got <= 0) {
+            if (got == 0) {
+                errno = EIO;
+            }
+            return -1;
+        }
+        p += got;
+        pos += got;
+        len -= got;
+    }
+    return 0;
+}
+
+static int pwrite_all(int fd, const void *buf, size_t len, off_t pos)
+{
+    const char *p = buf;
+    while (len > 0) {
+        ssize_t written = pwrite(fd, p, len, pos);
+        if (written == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        p += written;
+        pos += written;
+        len -= written;
+    }
+    return 0;
+}
+
+/* make room for one more index entry */
+static int block_index_reserve(struct block_store *bs)
+{
+    if (bs->nblocks == bs->index_cap) {
+        size_t cap = bs->index_cap > 0 ? bs->index_cap * 2 : BLOCK_INDEX_MIN;
+        struct block_entry *grown = realloc(bs->index, cap * sizeof(struct block_entry));
+        if (grown == NULL) {
+            return -1;
+        }
+        bs->index = grown;
+        bs->index_cap = cap;
+    }
+    return 0;
+}
+
+/* index entry holding logical offset (which must be written), binary search */
+static size_t block_find(struct block_store *bs, off_t offset)
+{
+    size_t lo = 0, hi = bs->nblocks;
+    while (hi - lo > 1) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (bs->index[mid].base <= offset) {
+            lo = mid;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+/* cached block with a reference for the caller, NULL if not cached (lock held) */
+static struct block_buf *block_cache_get(struct block_store *bs, size_t block)
+{
+    for (size_t i = 0; i < BLOCK_CACHE_BLOCKS; i++) {
+        struct block_slot *slot = &bs->cache[i];
+        if (slot->buf != NULL && slot->block == block) {
+            slot->used = ++bs->clock;
+            atomic_fetch_add(&slot->buf->refs, 1);
+            return slot->buf;
+        }
+    }
+    return NULL;
+}
+
+/* cache a block in place of the least recently used one (lock held) */
+static void block_cache_add(struct block_store *bs, size_t block, struct block_buf *buf)
+{
+    struct block_slot *victim = &bs->cache[0];
+    for (size_t i = 0; i < BLOCK_CACHE_BLOCKS; i++) {
+        struct block_slot *slot = &bs->cache[i];
+        if (slot->buf == NULL) {
+            victim = slot;
+            break;
+        }
+        if (slot->used < victim->used) {
+            victim = slot;
+        }
+    }
+    block_buf_put(victim->buf);
+    atomic_fetch_add(&buf->refs, 1);
+    victim->block = block;
+    victim->buf = buf;
+    victim->used = ++bs->clock;
+}
+
+/* read, decompress and check a written block, without the lock */
+static struct block_buf *block_read(struct block_store *bs, const struct block_entry *e)
+{
+    struct block_buf *buf = block_buf_new(e->raw_len);
+    if (buf == NULL) {
+        return NULL;
+    }
+    buf->len = e->raw_len;
+
+    int rc;
+    off_t pos = e->pos + sizeof(struct block_hdr);
+    if (e->flags & BLOCK_RAW) {
+        rc = pread_all(bs->fd, buf->data, e->raw_len, pos);
+    } else {
+        char *stored = malloc(e->stored_len);
+        rc = stored == NULL ? -1 : pread_all(bs->fd, stored, e->stored_len, pos);
+        if (rc == 0 && lz_decompress(stored, e->stored_len, buf->data, e->raw_len) == -1) {
+            errno = EIO;
+            rc = -1;
+        }
+        free(stored);
+    }
+    if (rc == 0 && crc32(buf->data, buf->len) != e->raw_crc) {
+        errno = EIO;
+        rc = -1;
+    }
+    if (rc == -1) {
+        int err = errno;
+        syslog(LOG_ERR, "could not read block at %lld of %s: %s\n", (long long) e->pos, bs->path, strerror(err));
+        block_buf_put(buf);
+        errno = err;
+        return NULL;
+    }
+    return buf;
+}
+
+/* compress the open block and append it to the file (lock held) */
+static int block_seal(struct block_store *bs)
+{
+    struct block_buf *raw = bs->open;
+    if (block_index_reserve(bs) == -1) {
+        return -1;
+    }
+    char *out = malloc(sizeof(struct block_hdr) + lz_bound(raw->len));
+    if (out == NULL) {
+        return -1;
+    }
+
+    struct block_entry e = { .base = bs->total - raw->len, .pos = bs->file_size,
+                             .raw_len = raw->len, .raw_crc = crc32(raw->data, raw->len) };
+    char *payload = out + sizeof(struct block_hdr);
+    e.stored_len = lz_compress(raw->data, raw->len, payload);
+    if (e.stored_len >= raw->len) {
+        memcpy(payload, raw->data, raw->len);
+        e.stored_len = raw->len;
+        e.flags = BLOCK_RAW;
+    }
+    struct block_hdr hdr = { .magic = BLOCK_MAGIC, .raw_len = e.raw_len, .stored_len = e.stored_len,
+                             .flags = e.flags, .raw_crc = e.raw_crc };
+    hdr.hdr_crc = block_hdr_crc(&hdr);
+    memcpy(out, &hdr, sizeof(hdr));
+
+    // header and payload in one write over the open block's record, which
+    // it does not outgrow; the rest of the record is cut off behind it
+    off_t end = bs->file_size + sizeof(hdr) + e.stored_len;
+    int rc = pwrite_all(bs->fd, out, sizeof(hdr) + e.stored_len, bs->file_size);
+    free(out);
+    if (rc == -1 || ftruncate(bs->fd, end) == -1) {
+        // cut off a partly written block, the open one stays in memory and
+        // its record is written again with the next append
+        syslog(LOG_ERR, "block write to %s failed: %s\n", bs->path, strerror(errno));
+        if (ftruncate(bs->fd, bs->file_size) == -1) {
+            syslog(LOG_ERR, "could not truncate %s: %s\n", bs->path, strerror(errno));
+        }
+        bs->open_written = 0;
+        return -1;
+    }
+
+    bs->index[bs->nblocks++] = e;
+    bs->file_size = end;
+    // the tail is what replays ask for next, so the raw block goes straight to the cache
+    block_cache_add(bs, bs->nblocks - 1, raw);
+    block_buf_put(raw);
+    bs->open = NULL;
+    bs->open_written = 0;
+    return 0;
+}
+
+/* write the bytes appended to the open block to its record, then the
+ * header that covers them (lock held) */
+static int block_write_open(struct block_store *bs)
+{
+    struct block_buf *raw = bs->open;
+    if (bs->open_written == 0) {
+        bs->open_crc = 0;
+    }
+    size_t len = raw->len - bs->open_written;
+    if (pwrite_all(bs->fd, raw->data + bs->open_written, len,
+                   bs->file_size + sizeof(struct block_hdr) + bs->open_written) == -1) {
+        syslog(LOG_ERR, "open block write to %s failed: %s\n", bs->path, strerror(errno));
+        return -1;
+    }
+    uint32_t crc = crc32_update(bs->open_crc, raw->data + bs->open_written, len);
+    struct block_hdr hdr = { .magic = BLOCK_MAGIC, .raw_len = raw->len, .stored_len = raw->len,
+                             .flags = BLOCK_RAW | BLOCK_OPEN, .raw_crc = crc };
+    hdr.hdr_crc = block_hdr_crc(&hdr);
+    if (pwrite_all(bs->fd, &hdr, sizeof(hdr), bs->file_size) == -1) {
+        syslog(LOG_ERR, "open block write to %s failed: %s\n", bs->path, strerror(errno));
+        return -1;
+    }
+    bs->open_written = raw->len;
+    bs->open_crc = crc;
+    return 0;
+}
+
+/* hold the block containing offset: *base receives its logical start, *stop
+ * where it (or end) stops. Returns 0 with *buf NULL if nothing is left */
+static int block_get(struct block_store *bs, off_t offset, off_t end, struct block_buf **buf, off_t *base, off_t *stop)
+{
+    *buf = NULL;
+    pthread_mutex_lock(&bs->lock);
+    if (end > bs->total) {
+        end = bs->total;
+    }
+    off_t open_base = bs->total - (bs->open != NULL ? (off_t) bs->open->len : 0);
+    if (offset >= end) {
+        pthread_mutex_unlock(&bs->lock);
+        return 0;
+    }
+    if (offset >= open_base) {
+        // bytes already in the open block do not change any more
+        *buf = bs->open;
+        atomic_fetch_add(&bs->open->refs, 1);
+        *base = open_base;
+        *stop = end;
+        pthread_mutex_unlock(&bs->lock);
+        return 0;
+    }
+    size_t i = block_find(bs, offset);
+    struct block_entry e = bs->index[i];
+    *buf = block_cache_get(bs, i);
+    pthread_mutex_unlock(&bs->lock);
+
+    if (*buf != NULL) {
+        stats_add(STAT_BLOCK_HITS, 1);
+    } else {
+        stats_add(STAT_BLOCK_MISSES, 1);
+        struct block_buf *loaded = block_read(bs, &e);
+        if (loaded == NULL) {
+            return -1;
+        }
+        // another replay may have loaded it meanwhile
+        pthread_mutex_lock(&bs->lock);
+        *buf = block_cache_get(bs, i);
+        if (*buf == NULL) {
+            block_cache_add(bs, i, loaded);
+            *buf = loaded;
+        } else {
+            block_buf_put(loaded);
+        }
+        pthread_mutex_unlock(&bs->lock);
+    }
+    *base = e.base;
+    *stop = e.base + (off_t) e.raw_len < end ? e.base + (off_t) e.raw_len : end;
+    return 0;
+}
+
+/************************************************************************************
+ * ----------------------  store operations  ----------------------
+ * **********************************************************************************/
+static int blk_append(struct aesd_store *st, const char *data, size_t len)
+{
+    struct block_store *bs = (struct block_store*) st;
+    int rc = 0;
+
+    pthread_mutex_lock(&bs->lock);
+    while (len > 0) {
+        // packets are not split between blocks
+        const char *nl = memchr(data, '\n', len);
+        size_t size = nl ? (size_t)(nl - data) + 1 : len;
+
+        if (bs->open != NULL && bs->open->len > 0 && bs->open->len + size > bs->block_size &&
+            block_seal(bs) == -1) {
+            rc = -1;
+            break;
+        }
+        if (bs->open == NULL || bs->open->len + size > bs->open->cap) {
+            // a packet larger than block_size gets a block of its own
+            struct block_buf *buf = block_buf_new(size > bs->block_size ? size : bs->block_size);
+            if (buf == NULL) {
+                rc = -1;
+                break;
+            }
+            block_buf_put(bs->open);
+            bs->open = buf;
+        }
+        memcpy(bs->open->data + bs->open->len, data, size);
+        bs->open->len += size;
+        bs->total += size;
+        data += size;
+        len -= size;
+    }
+    // the packets stay in memory even if their record could not be written
+    if (rc == 0 && bs->open != NULL && bs->open->len > bs->open_written && block_write_open(bs) == -1) {
+        rc = -1;
+    }
+    pthread_mutex_unlock(&bs->lock);
+
+    return rc;
+}
+
+static off_t blk_start(struct aesd_store *st)
+{
+    return 0;
+}
+
+static off_t blk_end(struct aesd_store *st)
+{
+    struct block_store *bs = (struct block_store*) st;
+    pthread_mutex_lock(&bs->lock);
+    off_t end = bs->total;
+    pthread_mutex_unlock(&bs->lock);
+    return end;
+}
+
+static int blk_send(struct aesd_store *st, int sock, off_t *offset, off_t end)
+{
+    struct block_store *bs = (struct block_store*) st;
+    struct block_buf *buf;
+    off_t base, stop;
+
+    while (*offset < end) {
+        if (block_get(bs, *offset, end, &buf, &base, &stop) == -1) {
+            return -1;
+        }
+        if (buf == NULL) {
+            break;
+        }
+        ssize_t sent = send(sock, buf->data + (*offset - base), stop - *offset, MSG_NOSIGNAL);
+        int err = errno;
+        block_buf_put(buf);
+        if (sent == -1) {
+            if (err == EINTR) {
+                continue;
+            }
+            errno = err;
+            return -1;
+        }
+        *offset += sent;
+    }
+    return 0;
+}
+
+static ssize_t blk_read(struct aesd_store *st, char *buf, size_t len, off_t *offset)
+{
+    struct block_store *bs = (struct block_store*) st;
+    off_t pos = *offset;
+    size_t copied = 0;
+    struct block_buf *blk;
+    off_t base, stop;
+
+    while (copied < len) {
+        if (block_get(bs, pos, pos + (len - copied), &blk, &base, &stop) == -1) {
+            return copied > 0 ? (ssize_t) copied : -1;
+        }
+        if (blk == NULL) {
+            break;
+        }
+        memcpy(buf + copied, blk->data + (pos - base), stop - pos);
+        block_buf_put(blk);
+        copied += stop - pos;
+        pos = stop;
+    }
+    return copied;
+}
+
+static void blk_close(struct aesd_store *st, int keep)
+{
+    struct block_store *bs = (struct block_store*) st;
+    // only a successor reads the file again, otherwise it is removed like OUTFILE
+    if (keep && bs->open != NULL && bs->open->len > 0 && block_seal(bs) == -1) {
+        syslog(LOG_ERR, "could not write the last block of %s\n", bs->path);
+    }
+    if (bs->nblocks > 0) {
+        syslog(LOG_USER, "block store %s: %zu blocks, %lld bytes in %lld on disk\n", bs->path, bs->nblocks,
+               (long long) bs->index[bs->nblocks - 1].base + bs->index[bs->nblocks - 1].raw_len,
+               (long long) bs->file_size);
+    }
+    for (size_t i = 0; i < BLOCK_CACHE_BLOCKS; i++) {
+        block_buf_put(bs->cache[i].buf);
+    }
+    block_buf_put(bs->open);
+    if (bs->fd != -1) {
+        close(bs->fd);
+    }
+    pthread_mutex_destroy(&bs->lock);
+    free(bs->index);
+    free(bs->path);
+    free(bs);
+}
+
+/* persist: take up the open block's record of a previous run at pos as the
+ * open block; 0 without it if its bytes do not match its CRC */
+static int block_load_open(struct block_store *bs, const struct block_hdr *hdr, off_t pos)
+{
+    if (hdr->stored_len != hdr->raw_len) {
+        return 0;
+    }
+    struct block_buf *buf = block_buf_new(hdr->raw_len > bs->block_size ? hdr->raw_len : bs->block_size);
+    if (buf == NULL || pread_all(bs->fd, buf->data, hdr->raw_len, pos + sizeof(*hdr)) == -1) {
+        block_buf_put(buf);
+        return -1;
+    }
+    buf->len = hdr->raw_len;
+    if (crc32(buf->data, buf->len) != hdr->raw_crc) {
+        block_buf_put(buf);
+        return 0;
+    }
+    bs->open = buf;
+    bs->open_written = buf->len;
+    bs->open_crc = hdr->raw_crc;
+    bs->total += buf->len;
+    return 0;
+}
+
+/* persist: index the blocks of a previous run, cutting off a torn last one */
+static int block_load(struct block_store *bs)
+{
+    struct stat st;
+    if (fstat(bs->fd, &st) == -1) {
+        return -1;
+    }
+
+    off_t pos = 0;
+    int open_record = 0;        // the last record is an open block, torn or not
+    while (pos + (off_t) sizeof(struct block_hdr) <= st.st_size) {
+        struct block_hdr hdr;
+        if (pread_all(bs->fd, &hdr, sizeof(hdr), pos) == -1) {
+            return -1;
+        }
+        off_t next = pos + sizeof(hdr) + hdr.stored_len;
+        if (hdr.magic != BLOCK_MAGIC || hdr.hdr_crc != block_hdr_crc(&hdr) || next > st.st_size) {
+            break;
+        }
+        if (hdr.flags & BLOCK_OPEN) {
+            // appends go on in its record, sealing overwrites it
+            open_record = 1;
+            if (block_load_open(bs, &hdr, pos) == -1) {
+                return -1;
+            }
+            break;
+        }
+        if (block_index_reserve(bs) == -1) {
+            return -1;
+        }
+        struct block_entry e = { .base = bs->total, .pos = pos, .raw_len = hdr.raw_len,
+                                 .stored_len = hdr.stored_len, .flags = hdr.flags, .raw_crc = hdr.raw_crc };
+        bs->index[bs->nblocks++] = e;
+        bs->total += hdr.raw_len;
+        pos = next;
+    }
+
+    bs->file_size = pos;
+    off_t end = bs->open != NULL ? pos + (off_t)(sizeof(struct block_hdr) + bs->open->len) : pos;
+    if (end < st.st_size) {
+        if (end == 0 && !open_record) {
+            // not written by this store (a plain OUTFILE), leave it alone
+            syslog(LOG_ERR, "%s is not a block store file\n", bs->path);
+            errno = EINVAL;
+            return -1;
+        }
+        syslog(LOG_ERR, "dropping %lld bytes after the last complete block of %s\n",
+               (long long)(st.st_size - end), bs->path);
+        if (ftruncate(bs->fd, end) == -1) {
+            return -1;
+        }
+    }
+    if (bs->nblocks > 0 || bs->open != NULL) {
+        syslog(LOG_USER, "reloaded %zu blocks and %zu open bytes, %lld bytes\n", bs->nblocks,
+               bs->open != NULL ? bs->open->len : 0, (long long) bs->total);
+    }
+    return 0;
+}
+
+static const struct store_ops block_ops = {
+    .append = blk_append,
+    .start = blk_start,
+    .end = blk_end,
+    .send = blk_send,
+    .read = blk_read,
+    .close = blk_close,
+};
+
+struct aesd_store *block_open(const struct store_config *cfg)
+{
+    struct block_store *bs = calloc(1, sizeof(struct block_store));
+    if (bs == NULL) {
+        return NULL;
+    }
+    bs->base.ops = &block_ops;
+    bs->fd = -1;
+    pthread_mutex_init(&bs->lock, NULL);
+    bs->path = strdup(cfg->path);
+    if (bs->path == NULL) {
+        blk_close(&bs->base, 0);
+        return NULL;
+    }
+    bs->block_size = cfg->block_size > 0 ? cfg->block_size : BLOCK_DEFAULT_SIZE;
+    if (bs->block_size > UINT32_MAX) {
+        bs->block_size = UINT32_MAX;
+    }
+
+    // blocks cannot be appended to a file in another format, start over unless picking up a restart
+    bs->fd = open(cfg->path, O_RDWR | O_CREAT | O_CLOEXEC | (cfg->persist ? 0 : O_TRUNC), 0644);
+    if (bs->fd == -1) {
+        syslog(LOG_ERR, "could not open %s: %s\n", cfg->path, strerror(errno));
+        blk_close(&bs->base, 0);
+        return NULL;
+    }
+    if (cfg->persist && block_load(bs) == -1) {
+        syslog(LOG_ERR, "could not reload block store %s\n", cfg->path);
+        blk_close(&bs->base, 0);
+        return NULL;
+    }
+
+    syslog(LOG_USER, "block store %s, %zu byte blocks\n", bs->path, bs->block_size);
+    return &bs->base;
+}
@@ -0,0 +1,669 @@
+/**
+ * Socket server - epoll event loop
+ * Author: Martin Mauersberg
+ * Date: 10/12/2023
+ *
+ * Alternative to the thread-per-connection model in aesdsocket.c: every
+ * connection is a small state machine driven by one (or one per core)
+ * epoll loop on nonblocking sockets, so memory stays flat no matter how many
+ * clients are connected.
+ *
+ * The loops either share one listening socket (EPOLLEXCLUSIVE wakes one of
+ * them per connection) or, sharded, each accept on their own SO_REUSEPORT
+ * listener so connection setup is spread over cores by the kernel as well.
+ * A unix domain listener for local clients (-U) is shared by all loops.
+ *
+ * Replays are queued per connection as ranges of the shared store (no copies)
+ * and sent as the socket becomes writable, a bounded number of bytes per
+ * wakeup. A connection keeps reading while its replays are queued until the
+ * queue is full or over out_limits.queue_bytes; then its input is paused
+ * until the queue drains. One whose queue does not move for
+ * out_limits.stall_sec is dropped.
+ *
+ * On hot restart each loop passes its connections, queued replays included,
+ * to the new process when it stops.
+*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <sys/resource.h>
+
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <syslog.h>
+#include <signal.h>
+#include <pthread.h>
+
+#include "aesdsocket.h"
+#include "aesd_store.h"
+
+#define MAX_EVENTS 64
+#define LOOP_BUF_SIZE 65536
+#define MAX_RECV_PER_EVENT 16   // recv calls per wakeup before yielding to other connections
+#define MAX_SEND_PER_EVENT (256 * 1024) // replay bytes per wakeup before yielding to other connections
+#define OUT_QUEUE_SLOTS 4       // replays queued per connection
+
+/* one queued replay: a range of the shared store, sent straight from it */
+struct out_range {
+    off_t off;                      // next store offset to send
+    off_t end;                      // store end when the replay was queued
+    uint64_t received;              // stats: when the packet that asked for it came in
+};
+
+/* per connection state (kept small, there may be tens of thousands of these) */
+struct ev_conn {
+    int fd;                         // socket file descriptor
+    uint32_t events;                // events currently registered with epoll
+    struct ev_conn *prev, *next;    // loop's list of connections
+    struct out_range out[OUT_QUEUE_SLOTS];  // queued replays, oldest first
+    unsigned char nout;             // number of queued replays
+    unsigned char paused;           // input paused until the output queue drains
+    unsigned char eof;              // peer done sending, close once the queue is sent
+    unsigned char negotiating;      // first line may still be a command
+    unsigned char tail;             // TAIL_COMMAND: replay only new data
+    off_t cursor;                   // tail: where the next replay starts
+    uint64_t progress;              // when the output queue last moved
+    struct frame_buf packet;        // incomplete packet carried across reads
+    char addr[INET6_ADDRSTRLEN];    // socket peer address
+};
+
+/* per event loop state */
+struct ev_loop {
+    pthread_t thread;
+    int epfd;                       // epoll instance of this loop
+    int sockfd;                     // listening socket (shared, or this loop's shard)
+    int unix_fd;                    // unix domain listener shared by all loops, or -1
+    int timer_fd;                   // ticks once a second to check for stalled replays
+    struct aesd_store *store;       // shared packet store
+    struct ev_conn *conns;          // open connections
+    struct handoff_conn *adopted;   // connections taken over, added when the loop starts
+    char buf[LOOP_BUF_SIZE];        // scratch buffer for recv
+};
+
+/* eventfd used to wake all loops on shutdown */
+static int wake_fd = -1;
+
+/************************************************************************************
+ * ----------------------  connection helpers  ----------------------
+ * **********************************************************************************/
+static int conn_set_events(struct ev_loop *loop, struct ev_conn *conn, uint32_t events)
+{
+    if (conn->events == events) {
+        return 0;
+    }
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = events;
+    ev.data.ptr = conn;
+    conn->events = events;
+    return epoll_ctl(loop->epfd, EPOLL_CTL_MOD, conn->fd, &ev);
+}
+
+/* read while input is not paused, write while output is queued */
+static int conn_update_events(struct ev_loop *loop, struct ev_conn *conn)
+{
+    return conn_set_events(loop, conn, (conn->paused ? 0 : EPOLLIN) | (conn->nout > 0 ? EPOLLOUT : 0));
+}
+
+static void conn_link(struct ev_loop *loop, struct ev_conn *conn)
+{
+    conn->prev = NULL;
+    conn->next = loop->conns;
+    if (loop->conns != NULL) {
+        loop->conns->prev = conn;
+    }
+    loop->conns = conn;
+}
+
+static void conn_free(struct ev_loop *loop, struct ev_conn *conn)
+{
+    if (conn->prev != NULL) {
+        conn->prev->next = conn->next;
+    } else {
+        loop->conns = conn->next;
+    }
+    if (conn->next != NULL) {
+        conn->next->prev = conn->prev;
+    }
+    // closing the socket also removes it from the epoll set
+    close(conn->fd);
+    frame_release(&conn->packet);
+    free(conn);
+}
+
+static void conn_close(struct ev_loop *loop, struct ev_conn *conn)
+{
+    stats_add(STAT_CLOSED, 1);
+    syslog(LOG_USER, "closed connection from %s\n", conn->addr);
+    conn_free(loop, conn);
+}
+
+/* hot restart: pass the connection to the new process if one is taking over, close it otherwise */
+static void conn_shutdown(struct ev_loop *loop, struct ev_conn *conn)
+{
+    struct handoff_conn state = { .fd = conn->fd, .negotiating = conn->negotiating, .tail = conn->tail,
+                                  .cursor = conn->cursor, .nout = conn->nout,
+                                  .pending = conn->packet.data, .pending_len = conn->packet.len };
+    for (int i = 0; i < conn->nout; i++) {
+        state.out[i][0] = conn->out[i].off;
+        state.out[i][1] = conn->out[i].end;
+    }
+    memcpy(state.addr, conn->addr, sizeof(state.addr));
+    if (conn->eof || handoff_pass(&state) == -1) {
+        conn_close(loop, conn);
+    } else {
+        conn_free(loop, conn);
+    }
+}
+
+/* replay bytes still owed to the connection */
+static off_t conn_queued(struct ev_conn *conn)
+{
+    off_t queued = 0;
+    for (int i = 0; i < conn->nout; i++) {
+        queued += conn->out[i].end > conn->out[i].off ? conn->out[i].end - conn->out[i].off : 0;
+    }
+    return queued;
+}
+
+/* queue a replay of [off, end); pauses input once the queue is full or over budget */
+static void conn_queue(struct ev_loop *loop, struct ev_conn *conn, off_t off, off_t end, uint64_t received)
+{
+    struct out_range *last = conn->nout > 0 ? &conn->out[conn->nout - 1] : NULL;
+    if (last != NULL && last->end == off) {
+        // tail replays follow each other, extend the last one
+        last->end = end;
+    } else {
+        if (conn->nout == 0) {
+            conn->progress = received;
+        }
+        conn->out[conn->nout++] = (struct out_range) { .off = off, .end = end, .received = received };
+    }
+
+    if (!conn->paused && (conn->nout == OUT_QUEUE_SLOTS || (size_t) conn_queued(conn) > out_limits.queue_bytes)) {
+        conn->paused = 1;
+        stats_add(STAT_THROTTLED, 1);
+    }
+}
+
+/* send queued replays, at most MAX_SEND_PER_EVENT bytes; returns -1 if the connection must be closed */
+static int conn_send(struct ev_loop *loop, struct ev_conn *conn)
+{
+    off_t budget = MAX_SEND_PER_EVENT;
+    while (conn->nout > 0 && budget > 0) {
+        struct out_range *r = &conn->out[0];
+        off_t end = r->end - r->off > budget ? r->off + budget : r->end;
+        off_t from = r->off;
+        int rc = store_send(loop->store, conn->fd, &r->off, end);
+        if (r->off > from) {
+            stats_add(STAT_BYTES_OUT, r->off - from);
+            budget -= r->off - from;
+            conn->progress = stats_now();
+        }
+        if (rc == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                // socket buffer full, continue when it becomes writable
+                break;
+            }
+            return -1;
+        }
+        if (r->off < r->end) {
+            // budget used up; level triggered EPOLLOUT brings us back after the others
+            break;
+        }
+
+        // replay complete
+        conn->cursor = r->off;
+        stats_add(STAT_REPLAYS, 1);
+        stats_record(HIST_REPLAY, stats_now() - r->received);
+        memmove(&conn->out[0], &conn->out[1], (conn->nout - 1) * sizeof(struct out_range));
+        if (--conn->nout == 0 && conn->eof) {
+            return -1;
+        }
+    }
+
+    // resume reading once the queue has drained below its limits
+    if (conn->paused && !conn->eof && conn->nout < OUT_QUEUE_SLOTS && (size_t) conn_queued(conn) <= out_limits.queue_bytes / 2) {
+        conn->paused = 0;
+    }
+    return conn_update_events(loop, conn);
+}
+
+/* receive data, append complete packets to the store and queue a replay on newline */
+static int conn_recv(struct ev_loop *loop, struct ev_conn *conn)
+{
+    for (int i = 0; i < MAX_RECV_PER_EVENT && !conn->paused; i++) {
+        ssize_t sockRead = recv(conn->fd, loop->buf, sizeof(loop->buf), 0);
+        if (sockRead == 0) {
+            if (conn->nout == 0) {
+                return -1;
+            }
+            // half closed: still send what was asked for
+            conn->eof = 1;
+            conn->paused = 1;
+            break;
+        }
+        if (sockRead == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                break;
+            }
+            return -1;
+        }
+
+        uint64_t received = stats_now();
+        stats_add(STAT_BYTES_IN, sockRead);
+        const char *data = loop->buf;
+        size_t len = sockRead;
+        if (conn->negotiating) {
+            enum frame_cmd cmd = frame_first_line(&conn->packet, &data, &len);
+            conn->negotiating = (cmd == FRAME_CMD_PENDING);
+            if (cmd == FRAME_CMD_TAIL) {
+                conn->tail = 1;
+                conn->cursor = store_end(loop->store);
+                syslog(LOG_USER, "tail replay for %s\n", conn->addr);
+            }
+        }
+
+        struct frame_seek seek;
+        int stored = frame_input(&conn->packet, loop->store, data, len, &seek);
+        if (stored == -1) {
+            syslog(LOG_ERR, "failed to store data from %s\n", conn->addr);
+            return -1;
+        }
+        off_t offset = -1;
+        if (stored > 0) {
+            offset = frame_replay_from(loop->store, stored, &seek, conn->tail ? conn->cursor : store_start(loop->store));
+        }
+        if (offset != -1) {
+            off_t end = store_end(loop->store);
+            conn_queue(loop, conn, offset, end, received);
+            conn->cursor = end;
+        }
+    }
+
+    // send right away what was queued, more input may be pending and level
+    // triggered epoll will report it again
+    return conn->nout > 0 ? conn_send(loop, conn) : conn_update_events(loop, conn);
+}
+
+/* drop connections whose queued output has not moved for out_limits.stall_sec */
+static void drop_stalled(struct ev_loop *loop)
+{
+    uint64_t now = stats_now();
+    uint64_t limit = (uint64_t) out_limits.stall_sec * 1000000000;
+    struct ev_conn *next;
+    for (struct ev_conn *conn = loop->conns; conn != NULL; conn = next) {
+        next = conn->next;
+        if (conn->nout > 0 && now - conn->progress > limit) {
+            syslog(LOG_ERR, "dropping %s: replay stalled for %d s\n", conn->addr, out_limits.stall_sec);
+            stats_add(STAT_DROPPED, 1);
+            conn_close(loop, conn);
+        }
+    }
+}
+
+/* add a new connection to the loop, with conn->events */
+static void conn_register(struct ev_loop *loop, struct ev_conn *conn)
+{
+    conn_link(loop, conn);
+
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = conn->events;
+    ev.data.ptr = conn;
+    if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, conn->fd, &ev) == -1) {
+        syslog(LOG_ERR, "server: failed to register connection from %s\n", conn->addr);
+        conn_close(loop, conn);
+    }
+}
+
+/* accept all pending connections on listening socket sockfd */
+static void accept_connections(struct ev_loop *loop, int sockfd)
+{
+    while (done == 0) {
+        struct sockaddr_storage sin_addr;
+        socklen_t sin_size = sizeof(sin_addr);
+
+        int new_fd = accept4(sockfd, (struct sockaddr*)&sin_addr, &sin_size, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (new_fd == -1) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                syslog(LOG_ERR, "server: failed to accept connection\n");
+            }
+            return;
+        }
+
+        stats_add(STAT_ACCEPTED, 1);
+
+        struct ev_conn *conn = calloc(1, sizeof(struct ev_conn));
+        if (conn == NULL) {
+            syslog(LOG_ERR, "server: out of memory for connection\n");
+            close(new_fd);
+            stats_add(STAT_CLOSED, 1);
+            continue;
+        }
+        conn->fd = new_fd;
+        conn->events = EPOLLIN;
+        conn->negotiating = 1;
+        peer_name((struct sockaddr*)&sin_addr, conn->addr, sizeof(conn->addr));
+        syslog(LOG_USER, "accepted connection from %s\n", conn->addr);
+        conn_register(loop, conn);
+    }
+}
+
+/* carry on with a connection taken over from the previous process */
+static void adopt_connection(struct ev_loop *loop, struct handoff_conn *state)
+{
+    stats_add(STAT_ACCEPTED, 1);
+    struct ev_conn *conn = calloc(1, sizeof(struct ev_conn));
+    int flags = fcntl(state->fd, F_GETFL, 0);
+    if (conn == NULL || flags == -1 || fcntl(state->fd, F_SETFL, flags | O_NONBLOCK) == -1 ||
+        frame_restore(&conn->packet, state->pending, state->pending_len) == -1) {
+        syslog(LOG_ERR, "server: could not take over connection from %s\n", state->addr);
+        close(state->fd);
+        if (conn != NULL) {
+            frame_release(&conn->packet);
+            free(conn);
+        }
+        stats_add(STAT_CLOSED, 1);
+        return;
+    }
+    handoff_fit(state, store_start(loop->store), store_end(loop->store));
+    conn->fd = state->fd;
+    conn->negotiating = state->negotiating;
+    conn->tail = state->tail;
+    conn->cursor = state->cursor;
+    memcpy(conn->addr, state->addr, sizeof(conn->addr));
+    uint64_t now = stats_now();
+    for (int i = 0; i < state->nout; i++) {
+        conn_queue(loop, conn, state->out[i][0], state->out[i][1], now);
+    }
+    conn->events = (conn->paused ? 0 : EPOLLIN) | (conn->nout > 0 ? EPOLLOUT : 0);
+    conn_register(loop, conn);
+}
+
+/************************************************************************************
+ * ----------------------  event loop thread  ----------------------
+ * **********************************************************************************/
+static void *event_loop(void *loop_info)
+{
+    struct ev_loop *loop = (struct ev_loop*) loop_info;
+    struct epoll_event events[MAX_EVENTS];
+
+    while (loop->adopted != NULL) {
+        struct handoff_conn *state = loop->adopted;
+        loop->adopted = state->next;
+        adopt_connection(loop, state);
+        handoff_free(state);
+    }
+
+    while (done == 0) {
+        int n = epoll_wait(loop->epfd, events, MAX_EVENTS, -1);
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            syslog(LOG_ERR, "epoll_wait: %s\n", strerror(errno));
+            break;
+        }
+
+        int tick = 0;
+        for (int i = 0; i < n; i++) {
+            if (events[i].data.ptr == &wake_fd) {
+                continue;
+            }
+            if (events[i].data.ptr == &loop->timer_fd) {
+                uint64_t expirations;
+                if (read(loop->timer_fd, &expirations, sizeof(expirations)) > 0) {
+                    tick = 1;
+                }
+                continue;
+            }
+            if (events[i].data.ptr == NULL) {
+                accept_connections(loop, loop->sockfd);
+                continue;
+            }
+            if (events[i].data.ptr == &loop->unix_fd) {
+                accept_connections(loop, loop->unix_fd);
+                continue;
+            }
+
+            // errors and hangups surface through the recv or send below;
+            // conn_recv also sends whatever is queued
+            struct ev_conn *conn = events[i].data.ptr;
+            int rc = 0;
+            if (!conn->paused && (events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP))) {
+                rc = conn_recv(loop, conn);
+            } else if (conn->nout > 0) {
+                rc = conn_send(loop, conn);
+            }
+            if (rc == -1) {
+                conn_close(loop, conn);
+            }
+        }
+
+        // after the batch, so no event above refers to a connection dropped here
+        if (tick) {
+            drop_stalled(loop);
+        }
+    }
+
+    while (loop->conns != NULL) {
+        conn_shutdown(loop, loop->conns);
+    }
+    return 0;
+}
+
+/* raise the open file limit so the loops are not capped at 1024 connections */
+static void raise_nofile_limit(void)
+{
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+}
+
+/************************************************************************************
+ * ----------------------  run event loops  ----------------------
+ * **********************************************************************************/
+/* close connections taken over that no loop is going to serve */
+static void drop_adopted(struct handoff_conn *list)
+{
+    while (list != NULL) {
+        struct handoff_conn *state = list;
+        list = state->next;
+        syslog(LOG_ERR, "server: no event loop for connection from %s\n", state->addr);
+        close(state->fd);
+        handoff_free(state);
+    }
+}
+
+/* bind loop i to CPU i (wrapping around) */
+static void pin_loop(struct ev_loop *loop, int i)
+{
+    long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (ncpus <= 0) {
+        return;
+    }
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(i % ncpus, &cpus);
+    if (pthread_setaffinity_np(loop->thread, sizeof(cpus), &cpus) != 0) {
+        syslog(LOG_ERR, "could not pin event loop %d to cpu %ld\n", i, i % ncpus);
+    }
+}
+
+int run_event_loops(int sockfd, const int *listen_fds, int nloops, int unix_fd, int pin, struct aesd_store *store,
+                    struct handoff_conn *adopted)
+{
+    if (nloops <= 0) {
+        nloops = sysconf(_SC_NPROCESSORS_ONLN);
+        if (nloops <= 0) {
+            nloops = 1;
+        }
+    }
+
+    raise_nofile_limit();
+
+    // listening sockets are drained by accept4 until EAGAIN and must not block
+    int nlisten = listen_fds != NULL ? nloops : 1;
+    for (int i = 0; i <= nlisten; i++) {
+        int fd = i == nlisten ? unix_fd : listen_fds != NULL ? listen_fds[i] : sockfd;
+        if (fd == -1) {
+            continue;
+        }
+        int flags = fcntl(fd, F_GETFL, 0);
+        if (flags == -1 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1) {
+            syslog(LOG_ERR, "server: failed to make listening socket nonblocking\n");
+            drop_adopted(adopted);
+            return -1;
+        }
+    }
+
+    wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (wake_fd == -1) {
+        drop_adopted(adopted);
+        return -1;
+    }
+
+    struct ev_loop *loops = calloc(nloops, sizeof(struct ev_loop));
+    if (loops == NULL) {
+        drop_adopted(adopted);
+        close(wake_fd);
+        return -1;
+    }
+
+    // spread the connections taken over on hot restart across the loops
+    for (int i = 0; adopted != NULL; i = (i + 1) % nloops) {
+        struct handoff_conn *state = adopted;
+        adopted = state->next;
+        state->next = loops[i].adopted;
+        loops[i].adopted = state;
+    }
+
+    // block SIGINT/SIGTERM in the loop threads so they are delivered to this thread
+    sigset_t sigs, oldsigs;
+    sigemptyset(&sigs);
+    sigaddset(&sigs, SIGINT);
+    sigaddset(&sigs, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &sigs, &oldsigs);
+
+    int started = 0;
+    for (int i = 0; i < nloops; i++) {
+        struct ev_loop *loop = &loops[i];
+        loop->sockfd = listen_fds != NULL ? listen_fds[i] : sockfd;
+        loop->unix_fd = unix_fd;
+        loop->store = store;
+        loop->epfd = epoll_create1(EPOLL_CLOEXEC);
+        if (loop->epfd == -1) {
+            break;
+        }
+
+        // EPOLLEXCLUSIVE: wake only one loop per incoming connection on a shared listener
+        struct epoll_event ev;
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLIN | EPOLLEXCLUSIVE;
+        ev.data.ptr = NULL;
+        if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, loop->sockfd, &ev) == -1) {
+            close(loop->epfd);
+            break;
+        }
+        ev.data.ptr = &loop->unix_fd;
+        if (unix_fd != -1 && epoll_ctl(loop->epfd, EPOLL_CTL_ADD, unix_fd, &ev) == -1) {
+            close(loop->epfd);
+            break;
+        }
+        ev.events = EPOLLIN;
+        ev.data.ptr = &wake_fd;
+        if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, wake_fd, &ev) == -1) {
+            close(loop->epfd);
+            break;
+        }
+
+        // once a second: drop connections whose replay stalled
+        loop->timer_fd = -1;
+        if (out_limits.stall_sec > 0) {
+            struct itimerspec tick = { .it_interval = { .tv_sec = 1 }, .it_value = { .tv_sec = 1 } };
+            loop->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+            ev.data.ptr = &loop->timer_fd;
+            if (loop->timer_fd == -1 || timerfd_settime(loop->timer_fd, 0, &tick, NULL) == -1 ||
+                epoll_ctl(loop->epfd, EPOLL_CTL_ADD, loop->timer_fd, &ev) == -1) {
+                syslog(LOG_ERR, "could not start stall timer of event loop %d\n", i);
+                if (loop->timer_fd != -1) {
+                    close(loop->timer_fd);
+                }
+                close(loop->epfd);
+                break;
+            }
+        }
+
+        if (pthread_create(&loop->thread, NULL, event_loop, loop)) {
+            syslog(LOG_ERR, "could not create event loop thread %d\n", i);
+            if (loop->timer_fd != -1) {
+                close(loop->timer_fd);
+            }
+            close(loop->epfd);
+            break;
+        }
+        if (pin) {
+            pin_loop(loop, i);
+        }
+        started++;
+    }
+    for (int i = started; i < nloops; i++) {
+        drop_adopted(loops[i].adopted);
+    }
+    // the kernel spreads connections over every SO_REUSEPORT listener, those of
+    // loops that did not start would never be accepted: stop the others as well
+    int failed = listen_fds != NULL && started > 0 && started < nloops;
+    if (failed) {
+        syslog(LOG_ERR, "server: started only %d of %d sharded event loops\n", started, nloops);
+        done = 1;
+    }
+
+    if (started > 0) {
+        if (!failed) {
+            syslog(LOG_USER, "running %d event loop(s)%s%s\n", started,
+                   listen_fds != NULL ? " with SO_REUSEPORT listeners" : "", pin ? ", pinned" : "");
+        }
+
+        // wait for SIGINT or SIGTERM
+        while (done == 0) {
+            sigsuspend(&oldsigs);
+        }
+
+        // wake and join all loops
+        uint64_t one = 1;
+        if (write(wake_fd, &one, sizeof(one)) != sizeof(one)) {
+            syslog(LOG_ERR, "failed to wake event loops\n");
+        }
+        for (int i = 0; i < started; i++) {
+            pthread_join(loops[i].thread, NULL);
+            if (loops[i].timer_fd != -1) {
+                close(loops[i].timer_fd);
+            }
+            close(loops[i].epfd);
+        }
+    }
+    pthread_sigmask(SIG_SETMASK, &oldsigs, NULL);
+
+    free(loops);
+    close(wake_fd);
+
+    return started > 0 && !failed ? 0 : -1;
+}
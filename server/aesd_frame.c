@@ -0,0 +1,385 @@
+/**
+ * Socket server - packet framing
+ * Author: Martin Mauersberg
+ * Date: 10/12/2023
+ *
+ * Splits received data into newline terminated packets. Delimiters are found
+ * with memrchr (vectorized in libc) instead of a byte loop, complete packets
+ * go to the store straight from the receive buffer and only an incomplete
+ * tail is copied into the connection's assembly buffer. Assembly buffers come
+ * from a small slab allocator with power of two size classes so connections
+ * that come and go do not keep hitting malloc.
+ *
+ * A connection may open with a command line (TAIL_COMMAND) instead of a
+ * packet; frame_first_line recognizes and consumes it.
+*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include <syslog.h>
+#include <pthread.h>
+
+#include "aesdsocket.h"
+#include "aesd_store.h"
+
+#define SLAB_MIN_SHIFT 9                            // smallest class: 512 bytes (BUF_SIZE)
+#define SLAB_CLASSES 8                              // 512 bytes .. 64 KB
+#define SLAB_MAX_SIZE ((size_t) 1 << (SLAB_MIN_SHIFT + SLAB_CLASSES - 1))
+#define SLAB_CACHE_MAX 256                          // free blocks kept per class
+
+/* free blocks of one size class, linked through their first bytes */
+struct slab_class {
+    pthread_mutex_t lock;
+    void *free_list;
+    size_t nfree;
+};
+
+static struct slab_class slab[SLAB_CLASSES] = {
+    [0 ... SLAB_CLASSES - 1] = { .lock = PTHREAD_MUTEX_INITIALIZER, .free_list = NULL, .nfree = 0 }
+};
+
+/************************************************************************************
+ * ----------------------  slab allocator  ----------------------
+ * **********************************************************************************/
+
+/* size class for size, or -1 if larger than the biggest class */
+static int slab_class_of(size_t size)
+{
+    int cls = 0;
+    while (cls < SLAB_CLASSES && ((size_t) 1 << (SLAB_MIN_SHIFT + cls)) < size) {
+        cls++;
+    }
+    return cls < SLAB_CLASSES ? cls : -1;
+}
+
+/* allocate at least size bytes, *cap receives the usable size */
+static void *slab_alloc(size_t size, size_t *cap)
+{
+    int cls = slab_class_of(size);
+    if (cls == -1) {
+        // oversized packets fall back to malloc (rounded up to 64 KB steps)
+        *cap = (size + SLAB_MAX_SIZE - 1) & ~(SLAB_MAX_SIZE - 1);
+        return malloc(*cap);
+    }
+
+    *cap = (size_t) 1 << (SLAB_MIN_SHIFT + cls);
+    void *block = NULL;
+    pthread_mutex_lock(&slab[cls].lock);
+    if (slab[cls].free_list != NULL) {
+        block = slab[cls].free_list;
+        slab[cls].free_list = *(void**) block;
+        slab[cls].nfree--;
+    }
+    pthread_mutex_unlock(&slab[cls].lock);
+
+    return block != NULL ? block : malloc(*cap);
+}
+
+static void slab_free(void *block, size_t cap)
+{
+    if (block == NULL) {
+        return;
+    }
+    int cls = slab_class_of(cap);
+    if (cls != -1) {
+        pthread_mutex_lock(&slab[cls].lock);
+        if (slab[cls].nfree < SLAB_CACHE_MAX) {
+            *(void**) block = slab[cls].free_list;
+            slab[cls].free_list = block;
+            slab[cls].nfree++;
+            block = NULL;
+        }
+        pthread_mutex_unlock(&slab[cls].lock);
+    }
+    free(block);
+}
+
+/************************************************************************************
+ * ----------------------  assembly buffer  ----------------------
+ * **********************************************************************************/
+
+/* append n bytes to the assembly buffer, growing it to the next size class */
+static int frame_keep(struct frame_buf *fb, const char *data, size_t n)
+{
+    if (fb->len + n > FRAME_MAX_PACKET) {
+        errno = EMSGSIZE;
+        return -1;
+    }
+    if (fb->len + n > fb->cap) {
+        // past the slab classes grow by doubling, a long packet is copied O(1) times per byte
+        size_t want = fb->len + n;
+        if (want > SLAB_MAX_SIZE && want < fb->cap * 2) {
+            want = fb->cap * 2 < FRAME_MAX_PACKET ? fb->cap * 2 : FRAME_MAX_PACKET;
+        }
+        size_t cap;
+        char *grown = slab_alloc(want, &cap);
+        if (grown == NULL) {
+            return -1;
+        }
+        if (fb->len > 0) {
+            memcpy(grown, fb->data, fb->len);
+        }
+        slab_free(fb->data, fb->cap);
+        fb->data = grown;
+        fb->cap = cap;
+    }
+    memcpy(fb->data + fb->len, data, n);
+    fb->len += n;
+    return 0;
+}
+
+/* number of newline terminated packets in a run of complete packets */
+static size_t frame_count(const char *data, size_t n)
+{
+    size_t count = 0;
+    const char *end = data + n;
+    while (data < end && (data = memchr(data, '\n', end - data)) != NULL) {
+        data++;
+        count++;
+    }
+    return count;
+}
+
+/* store a run of complete packets, recording count and append latency */
+static int frame_store(struct aesd_store *store, const char *data, size_t n)
+{
+    uint64_t start = stats_now();
+    int rc = store_append(store, data, n);
+    stats_record(HIST_APPEND, stats_now() - start);
+    if (rc == 0) {
+        stats_add(STAT_PACKETS, frame_count(data, n));
+    }
+    return rc;
+}
+
+/* store all complete packets in data (plus carried bytes), keep the rest */
+static int frame_input_run(struct frame_buf *fb, struct aesd_store *store, const char *data, size_t n)
+{
+    const char *nl = memrchr(data, '\n', n);
+    if (nl == NULL) {
+        // no delimiter in this batch, just keep collecting
+        return frame_keep(fb, data, n) == -1 ? -1 : 0;
+    }
+
+    // everything up to the last newline is a run of complete packets
+    size_t complete = (nl - data) + 1;
+    int rc;
+    if (fb->len > 0) {
+        if (frame_keep(fb, data, complete) == -1) {
+            return -1;
+        }
+        rc = frame_store(store, fb->data, fb->len);
+        fb->len = 0;
+    } else {
+        rc = frame_store(store, data, complete);
+    }
+    if (rc == -1) {
+        return -1;
+    }
+
+    if (complete < n && frame_keep(fb, data + complete, n - complete) == -1) {
+        return -1;
+    }
+
+    // release big buffers once the packet that needed them is stored
+    if (fb->len == 0 && fb->cap > BUF_SIZE) {
+        frame_release(fb);
+    }
+    return FRAME_STORED;
+}
+
+/* move all complete packets in data (plus carried bytes) to out, keep the rest */
+static int frame_collect_run(struct frame_buf *fb, struct frame_buf *out, const char *data, size_t n)
+{
+    const char *nl = memrchr(data, '\n', n);
+    if (nl == NULL) {
+        return frame_keep(fb, data, n) == -1 ? -1 : 0;
+    }
+
+    size_t complete = (nl - data) + 1;
+    if (fb->len > 0) {
+        if (frame_keep(out, fb->data, fb->len) == -1) {
+            return -1;
+        }
+        fb->len = 0;
+    }
+    if (frame_keep(out, data, complete) == -1) {
+        return -1;
+    }
+    // the caller appends out itself, count the packets here
+    stats_add(STAT_PACKETS, frame_count(data, complete));
+    if (complete < n && frame_keep(fb, data + complete, n - complete) == -1) {
+        return -1;
+    }
+    return FRAME_STORED;
+}
+
+/************************************************************************************
+ * ----------------------  seek command  ----------------------
+ * **********************************************************************************/
+
+/* if the packet starting with the carried bytes followed by data is a complete
+ * seek command, copy it to line and return its length within data, else 0 */
+static size_t frame_seek_line(struct frame_buf *fb, const char *data, size_t n, char *line)
+{
+    const size_t cmdlen = sizeof(SEEK_COMMAND) - 1;
+    size_t carried = fb->len < cmdlen ? fb->len : cmdlen;
+    if (fb->len >= SEEK_LINE_MAX || (carried > 0 && memcmp(fb->data, SEEK_COMMAND, carried) != 0)) {
+        return 0;
+    }
+    size_t rest = cmdlen - carried;
+    if (n < rest || memcmp(data, SEEK_COMMAND + carried, rest) != 0) {
+        return 0;
+    }
+    size_t span = SEEK_LINE_MAX - fb->len;
+    const char *nl = memchr(data, '\n', n < span ? n : span);
+    if (nl == NULL) {
+        return 0;
+    }
+    size_t len = (nl - data) + 1;
+    memcpy(line, fb->data, fb->len);
+    memcpy(line + fb->len, data, len);
+    line[fb->len + len] = '\0';
+    return len;
+}
+
+/* parse "AESDCHAR_IOCSEEKTO:X,Y\n" */
+static int frame_parse_seek(const char *line, struct frame_seek *seek)
+{
+    char *end;
+    const char *arg = line + sizeof(SEEK_COMMAND) - 1;
+    errno = 0;
+    unsigned long long packet = strtoull(arg, &end, 10);
+    if (end == arg || *end != ',' || errno != 0) {
+        return -1;
+    }
+    arg = end + 1;
+    unsigned long long byte = strtoull(arg, &end, 10);
+    if (end == arg || *end != '\n' || errno != 0) {
+        return -1;
+    }
+    seek->packet = packet;
+    seek->byte = byte;
+    return 0;
+}
+
+/* split data at seek commands: packets in between go to the store (or out),
+ * each command sets *seek; a command never reaches the store */
+static int frame_process(struct frame_buf *fb, struct aesd_store *store, struct frame_buf *out,
+                         const char *data, size_t n, struct frame_seek *seek)
+{
+    int result = 0;
+    char line[SEEK_LINE_MAX + 1];
+
+    while (n > 0) {
+        // the packet already being assembled, or a command further down in data
+        size_t len = frame_seek_line(fb, data, n, line);
+        if (len == 0) {
+            const char *p = data, *end = data + n, *cmd;
+            while ((cmd = memmem(p, end - p, SEEK_COMMAND, sizeof(SEEK_COMMAND) - 1)) != NULL &&
+                   (cmd == data || cmd[-1] != '\n')) {
+                p = cmd + 1;
+            }
+            if (cmd == NULL) {
+                break;
+            }
+            // everything before the command ends with a newline, store it first
+            int rc = out != NULL ? frame_collect_run(fb, out, data, cmd - data)
+                                 : frame_input_run(fb, store, data, cmd - data);
+            if (rc == -1) {
+                return -1;
+            }
+            result |= rc;
+            n -= cmd - data;
+            data = cmd;
+            len = frame_seek_line(fb, data, n, line);
+            if (len == 0) {
+                // incomplete (or too long to be a command): plain framing keeps it
+                break;
+            }
+        }
+
+        if (frame_parse_seek(line, seek) == -1) {
+            syslog(LOG_ERR, "ignoring invalid seek %.*s\n", (int) strcspn(line, "\n"), line);
+        } else {
+            result |= FRAME_SEEK;
+        }
+        fb->len = 0;
+        data += len;
+        n -= len;
+    }
+
+    int rc = out != NULL ? frame_collect_run(fb, out, data, n) : frame_input_run(fb, store, data, n);
+    if (rc == -1) {
+        return -1;
+    }
+    return result | rc;
+}
+
+int frame_input(struct frame_buf *fb, struct aesd_store *store, const char *data, size_t n, struct frame_seek *seek)
+{
+    return frame_process(fb, store, NULL, data, n, seek);
+}
+
+int frame_collect(struct frame_buf *fb, const char *data, size_t n, struct frame_buf *out, struct frame_seek *seek)
+{
+    return frame_process(fb, NULL, out, data, n, seek);
+}
+
+off_t frame_replay_from(struct aesd_store *store, int stored, const struct frame_seek *seek, off_t from)
+{
+    if (stored & FRAME_SEEK) {
+        off_t offset = store_seek(store, seek->packet, seek->byte);
+        if (offset != -1) {
+            return offset;
+        }
+        syslog(LOG_ERR, "seek to packet %zu byte %zu is out of range\n", seek->packet, seek->byte);
+    }
+    // a failed seek alone replays nothing
+    return (stored & FRAME_STORED) ? from : -1;
+}
+
+/************************************************************************************
+ * ----------------------  first line commands  ----------------------
+ * **********************************************************************************/
+enum frame_cmd frame_first_line(struct frame_buf *fb, const char **data, size_t *n)
+{
+    static const char cmd[] = TAIL_COMMAND;
+    const size_t cmdlen = sizeof(cmd) - 1;
+
+    // the assembly buffer only holds a prefix of the command while we are pending
+    if (fb->len >= cmdlen || (fb->len > 0 && memcmp(fb->data, cmd, fb->len) != 0)) {
+        return FRAME_CMD_NONE;
+    }
+    size_t rest = cmdlen - fb->len;
+    size_t cmp = *n < rest ? *n : rest;
+    if (memcmp(*data, cmd + fb->len, cmp) != 0) {
+        return FRAME_CMD_NONE;
+    }
+    if (*n < rest) {
+        // a prefix without the newline, frame_input keeps it for the next call
+        return FRAME_CMD_PENDING;
+    }
+
+    fb->len = 0;
+    *data += rest;
+    *n -= rest;
+    return FRAME_CMD_TAIL;
+}
+
+int frame_restore(struct frame_buf *fb, const char *data, size_t n)
+{
+    return frame_keep(fb, data, n);
+}
+
+void frame_release(struct frame_buf *fb)
+{
+    slab_free(fb->data, fb->cap);
+    fb->data = NULL;
+    fb->len = 0;
+    fb->cap = 0;
+}
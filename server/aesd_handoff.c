@@ -0,0 +1,404 @@
+/**
+ * Socket server - hot restart
+ * Author: Martin Mauersberg
+ * Date: 10/12/2023
+ *
+ * A server started with -H PATH listens on the unix socket PATH. A new
+ * process started with the same -H connects to it and takes over:
+ *  - the running server sends its listening sockets (SCM_RIGHTS) and stops
+ *    accepting, the kernel keeps queueing connections on the shared sockets
+ *  - while it shuts down every serving mode passes its open connections on
+ *    (socket plus the little state a connection has: tail cursor, replays
+ *    still owed, the incomplete packet) instead of closing them
+ *  - it closes the store and then the handoff socket; only then does the new
+ *    process open the store (picking up the data left behind) and start
+ *    serving, so the two never write to the store at the same time
+ * Messages are SOCK_SEQPACKET, so each header arrives whole with its socket.
+*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include <syslog.h>
+#include <signal.h>
+#include <pthread.h>
+
+#include "aesdsocket.h"
+
+#define HANDOFF_MAGIC 0x41455344    // "AESD"
+#define HANDOFF_VERSION 1
+#define HANDOFF_CHUNK (64 * 1024)   // bytes of an incomplete packet per message
+
+enum handoff_type {
+    HANDOFF_LISTENERS = 1,          // the listening sockets, sent first
+    HANDOFF_CONN,                   // one connection
+};
+
+/* message header; a connection's pending_len bytes follow in HANDOFF_CHUNK messages */
+struct handoff_msg {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t type;
+    uint32_t nfds;                  // sockets attached
+    int32_t negotiating;
+    int32_t tail;
+    int32_t nout;
+    int64_t cursor;
+    int64_t out[HANDOFF_RANGES][2];
+    uint64_t pending_len;
+    char addr[INET6_ADDRSTRLEN];
+};
+
+/* handoff listener of this process and the successor taking over from it */
+static int handoff_fd = -1;
+static int successor_fd = -1;
+static volatile int taken_over = 0;     // set for good once a successor got the listeners
+static char *handoff_path = NULL;
+static pthread_t handoff_thread;
+static pthread_mutex_t successor_lock = PTHREAD_MUTEX_INITIALIZER;  // one connection's messages at a time
+static const int *listen_fds;
+static int nlisten_fds;
+
+/************************************************************************************
+ * ----------------------  messages  ----------------------
+ * **********************************************************************************/
+static int handoff_send_msg(int sock, const void *data, size_t len, const int *fds, int nfds)
+{
+    struct iovec iov = { .iov_base = (void*) data, .iov_len = len };
+    char control[CMSG_SPACE(sizeof(int) * HANDOFF_MAX_LISTENERS)];
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    if (nfds > 0) {
+        memset(control, 0, sizeof(control));
+        msg.msg_control = control;
+        msg.msg_controllen = CMSG_SPACE(sizeof(int) * nfds);
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int) * nfds);
+        memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * nfds);
+    }
+
+    ssize_t sent;
+    do {
+        sent = sendmsg(sock, &msg, MSG_NOSIGNAL);
+    } while (sent == -1 && errno == EINTR);
+    return sent == (ssize_t) len ? 0 : -1;
+}
+
+/* receive one message and up to max sockets; returns its length, 0 at the end */
+static ssize_t handoff_recv_msg(int sock, void *data, size_t len, int *fds, int max, int *nfds)
+{
+    struct iovec iov = { .iov_base = data, .iov_len = len };
+    char control[CMSG_SPACE(sizeof(int) * HANDOFF_MAX_LISTENERS)];
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    ssize_t got;
+    do {
+        got = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+    } while (got == -1 && errno == EINTR);
+
+    *nfds = 0;
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); got > 0 && cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+            continue;
+        }
+        int n = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        int *received = (int*) CMSG_DATA(cmsg);
+        for (int i = 0; i < n; i++) {
+            if (*nfds < max) {
+                fds[(*nfds)++] = received[i];
+            } else {
+                close(received[i]);
+            }
+        }
+    }
+    if (got > 0 && (msg.msg_flags & (MSG_TRUNC | MSG_CTRUNC))) {
+        errno = EMSGSIZE;
+        return -1;
+    }
+    return got;
+}
+
+static int handoff_msg_valid(const struct handoff_msg *msg, ssize_t len, enum handoff_type type)
+{
+    return len == (ssize_t) sizeof(*msg) && msg->magic == HANDOFF_MAGIC &&
+           msg->version == HANDOFF_VERSION && msg->type == type;
+}
+
+/************************************************************************************
+ * ----------------------  taking over  ----------------------
+ * **********************************************************************************/
+static struct handoff_conn *handoff_recv_conn(int sock, const struct handoff_msg *msg, int fd)
+{
+    struct handoff_conn *conn = calloc(1, sizeof(struct handoff_conn));
+    if (conn == NULL) {
+        return NULL;
+    }
+    conn->fd = fd;
+    conn->negotiating = msg->negotiating;
+    conn->tail = msg->tail;
+    conn->cursor = msg->cursor;
+    conn->nout = msg->nout >= 0 && msg->nout <= HANDOFF_RANGES ? msg->nout : 0;
+    memcpy(conn->out, msg->out, sizeof(conn->out));
+    memcpy(conn->addr, msg->addr, sizeof(conn->addr));
+    conn->addr[sizeof(conn->addr) - 1] = '\0';
+
+    if (msg->pending_len > FRAME_MAX_PACKET || (conn->pending = malloc(msg->pending_len + 1)) == NULL) {
+        free(conn);
+        return NULL;
+    }
+    while (conn->pending_len < msg->pending_len) {
+        int nfds;
+        ssize_t got = handoff_recv_msg(sock, conn->pending + conn->pending_len,
+                                       msg->pending_len - conn->pending_len, NULL, 0, &nfds);
+        if (got <= 0) {
+            handoff_free(conn);
+            return NULL;
+        }
+        conn->pending_len += got;
+    }
+    return conn;
+}
+
+int handoff_takeover(const char *path, int *fds, int max, struct handoff_conn **conns)
+{
+    *conns = NULL;
+
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        syslog(LOG_ERR, "handoff socket path %s too long\n", path);
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+
+    int sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (sock == -1) {
+        return -1;
+    }
+    if (connect(sock, (struct sockaddr*) &addr, sizeof(addr)) == -1) {
+        int err = errno;
+        close(sock);
+        if (err == ENOENT || err == ECONNREFUSED) {
+            // nobody to take over from (or a socket left behind by a crash)
+            return 0;
+        }
+        syslog(LOG_ERR, "could not connect to handoff socket %s: %s\n", path, strerror(err));
+        return -1;
+    }
+
+    struct handoff_msg msg;
+    int nfds;
+    ssize_t got = handoff_recv_msg(sock, &msg, sizeof(msg), fds, max, &nfds);
+    if (!handoff_msg_valid(&msg, got, HANDOFF_LISTENERS) || nfds == 0) {
+        syslog(LOG_ERR, "no listening sockets from the server on %s\n", path);
+        for (int i = 0; i < nfds; i++) {
+            close(fds[i]);
+        }
+        close(sock);
+        return -1;
+    }
+    syslog(LOG_USER, "took over %d listening socket(s) from %s, waiting for connections\n", nfds, path);
+
+    // the connections follow while the old server shuts down, it closes the socket when done
+    int nconns = 0;
+    struct handoff_conn **last = conns;
+    for (;;) {
+        int fd, nconnfds;
+        got = handoff_recv_msg(sock, &msg, sizeof(msg), &fd, 1, &nconnfds);
+        if (got <= 0) {
+            break;
+        }
+        if (!handoff_msg_valid(&msg, got, HANDOFF_CONN) || nconnfds != 1) {
+            syslog(LOG_ERR, "bad handoff message from %s\n", path);
+            if (nconnfds == 1) {
+                close(fd);
+            }
+            break;
+        }
+        struct handoff_conn *conn = handoff_recv_conn(sock, &msg, fd);
+        if (conn == NULL) {
+            syslog(LOG_ERR, "could not take over connection from %s\n", msg.addr);
+            close(fd);
+            continue;
+        }
+        *last = conn;
+        last = &conn->next;
+        nconns++;
+    }
+    close(sock);
+
+    syslog(LOG_USER, "took over %d connection(s)\n", nconns);
+    return nfds;
+}
+
+void handoff_free(struct handoff_conn *conn)
+{
+    free(conn->pending);
+    free(conn);
+}
+
+void handoff_fit(struct handoff_conn *conn, off_t start, off_t end)
+{
+    conn->cursor = conn->cursor < start ? start : conn->cursor > end ? end : conn->cursor;
+    int n = 0;
+    for (int i = 0; i < conn->nout; i++) {
+        off_t from = conn->out[i][0] > start ? conn->out[i][0] : start;
+        off_t to = conn->out[i][1] < end ? conn->out[i][1] : end;
+        if (from < to) {
+            conn->out[n][0] = from;
+            conn->out[n][1] = to;
+            n++;
+        }
+    }
+    conn->nout = n;
+}
+
+/************************************************************************************
+ * ----------------------  handing over  ----------------------
+ * **********************************************************************************/
+static void *handoff_loop(void *unused)
+{
+    while (done == 0) {
+        // wake up every RECV_TIMEOUT_SEC to check done
+        struct pollfd pfd = { .fd = handoff_fd, .events = POLLIN };
+        if (poll(&pfd, 1, RECV_TIMEOUT_SEC * 1000) <= 0) {
+            continue;
+        }
+        int fd = accept4(handoff_fd, NULL, NULL, SOCK_CLOEXEC);
+        if (fd == -1) {
+            continue;
+        }
+
+        struct handoff_msg msg = { .magic = HANDOFF_MAGIC, .version = HANDOFF_VERSION,
+                                   .type = HANDOFF_LISTENERS, .nfds = nlisten_fds };
+        if (handoff_send_msg(fd, &msg, sizeof(msg), listen_fds, nlisten_fds) == -1) {
+            syslog(LOG_ERR, "could not hand over listening sockets: %s\n", strerror(errno));
+            close(fd);
+            continue;
+        }
+
+        // the new process accepts from now on; shut down, passing connections on
+        syslog(LOG_USER, "new process took over, handing over connections\n");
+        pthread_mutex_lock(&successor_lock);
+        successor_fd = fd;
+        taken_over = 1;
+        pthread_mutex_unlock(&successor_lock);
+        done = 1;
+        kill(getpid(), SIGTERM);
+        break;
+    }
+    return 0;
+}
+
+int handoff_listen(const char *path, const int *fds, int nfds)
+{
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        syslog(LOG_ERR, "handoff socket path %s too long\n", path);
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+
+    int fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (fd == -1) {
+        return -1;
+    }
+    // a socket left behind by the previous process (or a crash) is ours now
+    unlink(path);
+    if (bind(fd, (struct sockaddr*) &addr, sizeof(addr)) == -1 || listen(fd, 1) == -1) {
+        syslog(LOG_ERR, "could not open handoff socket %s: %s\n", path, strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    handoff_fd = fd;
+    listen_fds = fds;
+    nlisten_fds = nfds < HANDOFF_MAX_LISTENERS ? nfds : HANDOFF_MAX_LISTENERS;
+    handoff_path = strdup(path);
+    if (handoff_path == NULL || create_worker_thread(&handoff_thread, handoff_loop, NULL)) {
+        syslog(LOG_ERR, "could not create handoff thread\n");
+        unlink(path);
+        free(handoff_path);
+        handoff_path = NULL;
+        close(fd);
+        handoff_fd = -1;
+        return -1;
+    }
+    syslog(LOG_USER, "hot restart handoff on %s\n", path);
+    return 0;
+}
+
+int handoff_pass(const struct handoff_conn *conn)
+{
+    struct handoff_msg msg = { .magic = HANDOFF_MAGIC, .version = HANDOFF_VERSION, .type = HANDOFF_CONN,
+                               .nfds = 1, .negotiating = conn->negotiating, .tail = conn->tail,
+                               .nout = conn->nout, .cursor = conn->cursor, .pending_len = conn->pending_len };
+    memcpy(msg.out, conn->out, sizeof(msg.out));
+    snprintf(msg.addr, sizeof(msg.addr), "%s", conn->addr);
+
+    int rc = -1;
+    pthread_mutex_lock(&successor_lock);
+    if (successor_fd != -1 && handoff_send_msg(successor_fd, &msg, sizeof(msg), &conn->fd, 1) == 0) {
+        rc = 0;
+        for (size_t sent = 0; sent < conn->pending_len && rc == 0; sent += HANDOFF_CHUNK) {
+            size_t len = conn->pending_len - sent < HANDOFF_CHUNK ? conn->pending_len - sent : HANDOFF_CHUNK;
+            rc = handoff_send_msg(successor_fd, conn->pending + sent, len, NULL, 0);
+        }
+        if (rc == -1) {
+            // the successor cannot make sense of the rest, stop handing over
+            syslog(LOG_ERR, "handoff of %s failed: %s\n", conn->addr, strerror(errno));
+            close(successor_fd);
+            successor_fd = -1;
+        }
+    }
+    pthread_mutex_unlock(&successor_lock);
+
+    if (rc == 0) {
+        stats_add(STAT_HANDED_OVER, 1);
+        syslog(LOG_USER, "handed over connection from %s\n", conn->addr);
+    }
+    return rc;
+}
+
+int handoff_taken_over(void)
+{
+    return taken_over;
+}
+
+void handoff_close(void)
+{
+    if (handoff_fd != -1) {
+        pthread_join(handoff_thread, NULL);
+        close(handoff_fd);
+        handoff_fd = -1;
+        if (!taken_over) {
+            // nobody took over; otherwise the path already belongs to the successor
+            unlink(handoff_path);
+        }
+    }
+    if (successor_fd != -1) {
+        // the successor starts serving once this is closed
+        close(successor_fd);
+        successor_fd = -1;
+    }
+    free(handoff_path);
+    handoff_path = NULL;
+}
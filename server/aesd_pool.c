@@ -0,0 +1,260 @@
+/**
+ * Socket server - bounded worker thread pool
+ * Author: Martin Mauersberg
+ * Date: 10/12/2023
+ *
+ * Fixed number of worker threads, each with its own job deque. Jobs are
+ * handed out round robin; a worker takes the oldest job from its own deque
+ * and, when that is empty, steals the newest job from another worker.
+ * The total number of queued jobs is capped so a burst of connections is
+ * rejected instead of growing without bound.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdatomic.h>
+
+#include <syslog.h>
+#include <pthread.h>
+
+#include "aesdsocket.h"
+
+/* one queued job */
+struct pool_job {
+    void *(*fn)(void *);
+    void *arg;
+};
+
+/* per worker deque (ring buffer, owner pops head, thieves pop tail) */
+struct pool_worker {
+    pthread_t thread;
+    struct aesd_pool *pool;
+    int index;
+    pthread_mutex_t lock;
+    struct pool_job *jobs;      // ring buffer of capacity pool->deque_size
+    size_t head;                // oldest job
+    size_t count;               // number of queued jobs
+};
+
+struct aesd_pool {
+    struct pool_worker *workers;
+    int nworkers;
+    int nstarted;               // number of running worker threads
+    size_t deque_size;          // capacity of each deque
+    size_t queue_limit;         // max number of queued jobs over all deques
+    atomic_size_t pending;      // queued jobs over all deques
+    atomic_uint next_worker;    // round robin submit index
+
+    pthread_mutex_t idle_lock;  // protects idle and stop, used with idle_cond
+    pthread_cond_t idle_cond;
+    int idle;                   // number of sleeping workers
+    int stop;
+};
+
+/************************************************************************************
+ * ----------------------  deque operations  ----------------------
+ * **********************************************************************************/
+static int deque_push(struct pool_worker *w, struct pool_job job)
+{
+    int rc = -1;
+    pthread_mutex_lock(&w->lock);
+    if (w->count < w->pool->deque_size) {
+        w->jobs[(w->head + w->count) % w->pool->deque_size] = job;
+        w->count++;
+        rc = 0;
+    }
+    pthread_mutex_unlock(&w->lock);
+    return rc;
+}
+
+/* take the oldest job (owner side) */
+static int deque_pop_head(struct pool_worker *w, struct pool_job *job)
+{
+    int rc = -1;
+    pthread_mutex_lock(&w->lock);
+    if (w->count > 0) {
+        *job = w->jobs[w->head];
+        w->head = (w->head + 1) % w->pool->deque_size;
+        w->count--;
+        rc = 0;
+    }
+    pthread_mutex_unlock(&w->lock);
+    return rc;
+}
+
+/* take the newest job (thief side) */
+static int deque_pop_tail(struct pool_worker *w, struct pool_job *job)
+{
+    int rc = -1;
+    // trylock: never wait on a busy victim, just move on to the next one
+    if (pthread_mutex_trylock(&w->lock) != 0) {
+        return -1;
+    }
+    if (w->count > 0) {
+        w->count--;
+        *job = w->jobs[(w->head + w->count) % w->pool->deque_size];
+        rc = 0;
+    }
+    pthread_mutex_unlock(&w->lock);
+    return rc;
+}
+
+/* get a job from our own deque or steal one from the other workers */
+static int pool_take(struct pool_worker *w, struct pool_job *job)
+{
+    struct aesd_pool *pool = w->pool;
+
+    if (deque_pop_head(w, job) == 0) {
+        return 0;
+    }
+    for (int i = 1; i < pool->nworkers; i++) {
+        struct pool_worker *victim = &pool->workers[(w->index + i) % pool->nworkers];
+        if (deque_pop_tail(victim, job) == 0) {
+            return 0;
+        }
+    }
+    return -1;
+}
+
+/************************************************************************************
+ * ----------------------  worker thread  ----------------------
+ * **********************************************************************************/
+static void *pool_worker_thread(void *worker_info)
+{
+    struct pool_worker *w = (struct pool_worker*) worker_info;
+    struct aesd_pool *pool = w->pool;
+    struct pool_job job;
+
+    while (1) {
+        if (pool_take(w, &job) == 0) {
+            atomic_fetch_sub(&pool->pending, 1);
+            job.fn(job.arg);
+            continue;
+        }
+
+        // nothing to do: sleep until a job is submitted or the pool stops
+        pthread_mutex_lock(&pool->idle_lock);
+        pool->idle++;
+        while (atomic_load(&pool->pending) == 0 && pool->stop == 0) {
+            pthread_cond_wait(&pool->idle_cond, &pool->idle_lock);
+        }
+        pool->idle--;
+        int stop = pool->stop && atomic_load(&pool->pending) == 0;
+        pthread_mutex_unlock(&pool->idle_lock);
+        if (stop) {
+            break;
+        }
+    }
+
+    return 0;
+}
+
+/************************************************************************************
+ * ----------------------  pool API  ----------------------
+ * **********************************************************************************/
+struct aesd_pool *pool_create(int nworkers, size_t queue_limit)
+{
+    if (nworkers <= 0) {
+        long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+        nworkers = (ncpu > 0 ? ncpu : 1) * POOL_THREADS_PER_CPU;
+    }
+    if (queue_limit == 0) {
+        queue_limit = POOL_QUEUE_LIMIT;
+    }
+
+    struct aesd_pool *pool = calloc(1, sizeof(struct aesd_pool));
+    if (pool == NULL) {
+        return NULL;
+    }
+    pool->nworkers = nworkers;
+    pool->queue_limit = queue_limit;
+    // any single deque may have to hold every queued job
+    pool->deque_size = queue_limit;
+    atomic_init(&pool->pending, 0);
+    atomic_init(&pool->next_worker, 0);
+    pthread_mutex_init(&pool->idle_lock, NULL);
+    pthread_cond_init(&pool->idle_cond, NULL);
+
+    pool->workers = calloc(nworkers, sizeof(struct pool_worker));
+    if (pool->workers == NULL) {
+        free(pool);
+        return NULL;
+    }
+    for (int i = 0; i < nworkers; i++) {
+        struct pool_worker *w = &pool->workers[i];
+        w->pool = pool;
+        w->index = i;
+        pthread_mutex_init(&w->lock, NULL);
+        w->jobs = calloc(pool->deque_size, sizeof(struct pool_job));
+        if (w->jobs == NULL) {
+            syslog(LOG_ERR, "could not allocate job queue for worker %d\n", i);
+            pool_destroy(pool);
+            return NULL;
+        }
+    }
+
+    for (pool->nstarted = 0; pool->nstarted < nworkers; pool->nstarted++) {
+        struct pool_worker *w = &pool->workers[pool->nstarted];
+        if (create_worker_thread(&w->thread, pool_worker_thread, w)) {
+            syslog(LOG_ERR, "could not create worker thread %d\n", pool->nstarted);
+            break;
+        }
+    }
+
+    if (pool->nstarted < nworkers) {
+        pool_destroy(pool);
+        return NULL;
+    }
+
+    syslog(LOG_USER, "started %d worker threads, queue limit %zu\n", nworkers, queue_limit);
+    return pool;
+}
+
+int pool_submit(struct aesd_pool *pool, void *(*fn)(void *), void *arg)
+{
+    // reserve a queue slot, reject when the limit is reached
+    if (atomic_fetch_add(&pool->pending, 1) >= pool->queue_limit) {
+        atomic_fetch_sub(&pool->pending, 1);
+        return -1;
+    }
+
+    struct pool_job job = { .fn = fn, .arg = arg };
+    unsigned int start = atomic_fetch_add(&pool->next_worker, 1);
+    int queued = -1;
+    for (int i = 0; i < pool->nworkers && queued != 0; i++) {
+        queued = deque_push(&pool->workers[(start + i) % pool->nworkers], job);
+    }
+    if (queued != 0) {
+        atomic_fetch_sub(&pool->pending, 1);
+        return -1;
+    }
+
+    pthread_mutex_lock(&pool->idle_lock);
+    if (pool->idle > 0) {
+        pthread_cond_signal(&pool->idle_cond);
+    }
+    pthread_mutex_unlock(&pool->idle_lock);
+    return 0;
+}
+
+void pool_destroy(struct aesd_pool *pool)
+{
+    pthread_mutex_lock(&pool->idle_lock);
+    pool->stop = 1;
+    pthread_cond_broadcast(&pool->idle_cond);
+    pthread_mutex_unlock(&pool->idle_lock);
+
+    for (int i = 0; i < pool->nstarted; i++) {
+        pthread_join(pool->workers[i].thread, NULL);
+    }
+    for (int i = 0; i < pool->nworkers; i++) {
+        pthread_mutex_destroy(&pool->workers[i].lock);
+        free(pool->workers[i].jobs);
+    }
+    pthread_cond_destroy(&pool->idle_cond);
+    pthread_mutex_destroy(&pool->idle_lock);
+    free(pool->workers);
+    free(pool);
+}
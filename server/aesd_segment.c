@@ -0,0 +1,556 @@
+/**
+ * Socket server - segmented log store
+ * Author: Martin Mauersberg
+ * Date: 10/12/2023
+ *
+ * The data file is split into segment files "<path>.<first offset>" of at
+ * most segment_size bytes (a packet is never split, so a single packet may
+ * make a segment larger). Next to each segment we keep a compact index of
+ * where its packets start, so a packet number resolves to (segment, offset)
+ * with two binary searches instead of a scan, and logical byte offsets map
+ * to a segment and file position directly. Old segments are dropped whole
+ * when the log grows beyond retain_bytes or a segment has not been written
+ * for retain_sec (checked on append, and by a thread as segments expire so
+ * an idle log is trimmed as well). Like the ring store, segments are reference counted so a
+ * replay can sendfile from one without holding the lock. Segments closed
+ * with keep stay on disk and an open with persist indexes them again.
+*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <glob.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <syslog.h>
+#include <pthread.h>
+
+#include "aesdsocket.h"
+#include "aesd_store.h"
+
+#define SEGMENT_INDEX_MIN 1024      // initial index entries per segment
+#define SEGMENT_MAX_SIZE UINT32_MAX // index entries are 32 bit segment offsets
+
+/* one segment file and the start of each of its packets */
+struct segment {
+    atomic_int refs;
+    int fd;
+    char *path;
+    off_t base;                 // logical offset of the first byte
+    size_t size;                // bytes written
+    size_t first_packet;        // number of the first packet (counted from the oldest segment at open)
+    uint32_t *index;            // offset of each packet within the segment
+    size_t npackets;
+    size_t index_cap;
+    time_t last_write;
+};
+
+struct segment_store {
+    struct aesd_store base;
+    pthread_mutex_t lock;
+    struct segment **seg;       // oldest first, the last one is written to
+    size_t nsegs;
+    size_t seg_cap;
+    off_t total;                // running total of bytes appended
+    size_t total_packets;       // running total of packets appended
+    char *path;
+    size_t segment_size;
+    size_t retain_bytes;
+    int retain_sec;
+    pthread_t retainer;         // retires expired segments between appends
+    int retaining;              // retainer started
+    int stop;                   // retainer: store closing
+    pthread_cond_t retain_cond; // wakes the retainer to stop
+};
+
+/************************************************************************************
+ * ----------------------  segments  ----------------------
+ * **********************************************************************************/
+static void segment_put(struct segment *seg)
+{
+    if (atomic_fetch_sub(&seg->refs, 1) == 1) {
+        close(seg->fd);
+        free(seg->index);
+        free(seg->path);
+        free(seg);
+    }
+}
+
+static int segment_index_add(struct segment *seg, uint32_t offset)
+{
+    if (seg->npackets == seg->index_cap) {
+        size_t cap = seg->index_cap > 0 ? seg->index_cap * 2 : SEGMENT_INDEX_MIN;
+        uint32_t *grown = realloc(seg->index, cap * sizeof(uint32_t));
+        if (grown == NULL) {
+            return -1;
+        }
+        seg->index = grown;
+        seg->index_cap = cap;
+    }
+    seg->index[seg->npackets++] = offset;
+    return 0;
+}
+
+/* rebuild the packet index of a segment left behind by a previous run */
+static int segment_reindex(struct segment *seg)
+{
+    char buf[BUF_SIZE * 16];
+    int at_start = 1;   // the next byte starts a packet
+    size_t pos = 0;
+    while (pos < seg->size) {
+        ssize_t got = pread(seg->fd, buf, sizeof(buf), pos);
+        if (got == -1 && errno == EINTR) {
+            continue;
+        }
+        if (got <= 0) {
+            return -1;
+        }
+        const char *p = buf, *end = buf + got;
+        while (p < end) {
+            if (at_start && segment_index_add(seg, pos + (p - buf)) == -1) {
+                return -1;
+            }
+            const char *nl = memchr(p, '\n', end - p);
+            at_start = (nl != NULL);
+            p = nl != NULL ? nl + 1 : end;
+        }
+        pos += got;
+    }
+    return 0;
+}
+
+/* start a new segment at the current end of the log, or with reopen pick up
+ * the one a previous run left there */
+static struct segment *segment_create(struct segment_store *ss, int reopen)
+{
+    if (ss->nsegs == ss->seg_cap) {
+        size_t cap = ss->seg_cap > 0 ? ss->seg_cap * 2 : 16;
+        struct segment **grown = realloc(ss->seg, cap * sizeof(struct segment*));
+        if (grown == NULL) {
+            return NULL;
+        }
+        ss->seg = grown;
+        ss->seg_cap = cap;
+    }
+
+    struct segment *seg = calloc(1, sizeof(struct segment));
+    if (seg == NULL) {
+        return NULL;
+    }
+    atomic_init(&seg->refs, 1);
+    seg->base = ss->total;
+    seg->first_packet = ss->total_packets;
+    seg->last_write = time(NULL);
+    if (asprintf(&seg->path, "%s.%020lld", ss->path, (long long) seg->base) == -1) {
+        free(seg);
+        return NULL;
+    }
+    seg->fd = open(seg->path, O_RDWR | O_CREAT | (reopen ? 0 : O_TRUNC) | O_APPEND | O_CLOEXEC, 0644);
+    if (seg->fd == -1) {
+        syslog(LOG_ERR, "could not open segment %s: %s\n", seg->path, strerror(errno));
+        free(seg->path);
+        free(seg);
+        return NULL;
+    }
+    if (reopen) {
+        struct stat st;
+        int rc = fstat(seg->fd, &st);
+        if (rc == 0) {
+            seg->size = st.st_size;
+            seg->last_write = st.st_mtime;
+            rc = segment_reindex(seg);
+        }
+        if (rc == -1) {
+            syslog(LOG_ERR, "could not index segment %s: %s\n", seg->path, strerror(errno));
+            segment_put(seg);
+            return NULL;
+        }
+    }
+
+    ss->seg[ss->nsegs++] = seg;
+    return seg;
+}
+
+/* drop the oldest segment; replays still sending from it keep it open */
+static void segment_drop_oldest(struct segment_store *ss)
+{
+    struct segment *seg = ss->seg[0];
+    syslog(LOG_USER, "retiring segment %s\n", seg->path);
+    unlink(seg->path);
+    memmove(ss->seg, ss->seg + 1, (ss->nsegs - 1) * sizeof(struct segment*));
+    ss->nsegs--;
+    segment_put(seg);
+}
+
+/* apply the retention policy, the segment being written is always kept */
+static void segment_retain(struct segment_store *ss)
+{
+    time_t now = time(NULL);
+    while (ss->nsegs > 1) {
+        struct segment *oldest = ss->seg[0];
+        int too_big = ss->retain_bytes > 0 && (size_t)(ss->total - ss->seg[1]->base) >= ss->retain_bytes;
+        int too_old = ss->retain_sec > 0 && now - oldest->last_write > ss->retain_sec;
+        if (!too_big && !too_old) {
+            break;
+        }
+        segment_drop_oldest(ss);
+    }
+}
+
+/* retain_sec: retire segments as they expire, also without appends */
+static void *segment_retainer(void *arg)
+{
+    struct segment_store *ss = arg;
+    pthread_mutex_lock(&ss->lock);
+    while (!ss->stop) {
+        segment_retain(ss);
+        // the oldest segment expires next, the one being written is never dropped
+        struct timespec until = { .tv_sec = time(NULL) + ss->retain_sec };
+        if (ss->nsegs > 1) {
+            until.tv_sec = ss->seg[0]->last_write + ss->retain_sec + 1;
+        }
+        pthread_cond_timedwait(&ss->retain_cond, &ss->lock, &until);
+    }
+    pthread_mutex_unlock(&ss->lock);
+    return NULL;
+}
+
+/* segment holding logical offset (which must be held), binary search */
+static struct segment *segment_find(struct segment_store *ss, off_t offset)
+{
+    size_t lo = 0, hi = ss->nsegs;
+    while (hi - lo > 1) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (ss->seg[mid]->base <= offset) {
+            lo = mid;
+        } else {
+            hi = mid;
+        }
+    }
+    return ss->seg[lo];
+}
+
+static off_t segment_start_locked(struct segment_store *ss)
+{
+    return ss->nsegs > 0 ? ss->seg[0]->base : ss->total;
+}
+
+/************************************************************************************
+ * ----------------------  store operations  ----------------------
+ * **********************************************************************************/
+static int seg_append(struct aesd_store *st, const char *data, size_t len)
+{
+    struct segment_store *ss = (struct segment_store*) st;
+    int rc = 0;
+
+    pthread_mutex_lock(&ss->lock);
+    while (len > 0) {
+        struct segment *seg = ss->nsegs > 0 ? ss->seg[ss->nsegs - 1] : NULL;
+
+        // take as many whole packets as fit into the current segment
+        size_t take = 0;
+        size_t indexed = seg != NULL ? seg->npackets : 0;
+        while (seg != NULL && take < len) {
+            const char *nl = memchr(data + take, '\n', len - take);
+            size_t size = nl ? (size_t)(nl - data - take) + 1 : len - take;
+            size_t used = seg->size + take;
+            if (used > 0 && (used + size > ss->segment_size || used + size > SEGMENT_MAX_SIZE)) {
+                break;
+            }
+            if (segment_index_add(seg, used) == -1) {
+                rc = -1;
+                break;
+            }
+            take += size;
+        }
+        if (rc == -1) {
+            seg->npackets = indexed;
+            break;
+        }
+
+        if (take == 0) {
+            // segment full (or none yet): roll over to a new one
+            if (segment_create(ss, 0) == NULL) {
+                rc = -1;
+                break;
+            }
+            continue;
+        }
+
+        // one write for the whole run, like the file store
+        const char *p = data;
+        size_t left = take;
+        while (left > 0) {
+            ssize_t written = write(seg->fd, p, left);
+            if (written == -1) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                break;
+            }
+            p += written;
+            left -= written;
+        }
+        if (left > 0) {
+            // keep the index in line with what made it to the file
+            syslog(LOG_ERR, "segment write failed: %s\n", strerror(errno));
+            seg->npackets = indexed;
+            rc = -1;
+            break;
+        }
+        seg->size += take;
+        seg->last_write = time(NULL);
+        ss->total += take;
+        ss->total_packets += seg->npackets - indexed;
+        data += take;
+        len -= take;
+    }
+    segment_retain(ss);
+    pthread_mutex_unlock(&ss->lock);
+
+    return rc;
+}
+
+static off_t seg_start(struct aesd_store *st)
+{
+    struct segment_store *ss = (struct segment_store*) st;
+    pthread_mutex_lock(&ss->lock);
+    off_t start = segment_start_locked(ss);
+    pthread_mutex_unlock(&ss->lock);
+    return start;
+}
+
+static off_t seg_end(struct aesd_store *st)
+{
+    struct segment_store *ss = (struct segment_store*) st;
+    pthread_mutex_lock(&ss->lock);
+    off_t end = ss->total;
+    pthread_mutex_unlock(&ss->lock);
+    return end;
+}
+
+/* hold the segment containing *offset (moved up to the start if dropped);
+ * *seg_end receives where that segment (or end) stops; NULL if nothing left */
+static struct segment *segment_get(struct segment_store *ss, off_t *offset, off_t end, off_t *seg_end)
+{
+    struct segment *seg = NULL;
+
+    pthread_mutex_lock(&ss->lock);
+    off_t start = segment_start_locked(ss);
+    if (*offset < start) {
+        *offset = start;
+    }
+    if (end > ss->total) {
+        end = ss->total;
+    }
+    if (*offset < end) {
+        seg = segment_find(ss, *offset);
+        atomic_fetch_add(&seg->refs, 1);
+        *seg_end = seg->base + (off_t) seg->size < end ? seg->base + (off_t) seg->size : end;
+    }
+    pthread_mutex_unlock(&ss->lock);
+
+    return seg;
+}
+
+static int seg_send(struct aesd_store *st, int sock, off_t *offset, off_t end)
+{
+    struct segment_store *ss = (struct segment_store*) st;
+    off_t seg_end;
+    struct segment *seg;
+
+    while ((seg = segment_get(ss, offset, end, &seg_end)) != NULL) {
+        off_t pos = *offset - seg->base;
+        int rc = send_file_range(sock, seg->fd, &pos, seg_end - seg->base);
+        *offset = seg->base + pos;
+        segment_put(seg);
+        if (rc == -1) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static ssize_t seg_read(struct aesd_store *st, char *buf, size_t len, off_t *offset)
+{
+    struct segment_store *ss = (struct segment_store*) st;
+    off_t pos = *offset;
+    size_t copied = 0;
+    off_t seg_end;
+    struct segment *seg;
+
+    while (copied < len && (seg = segment_get(ss, &pos, pos + (len - copied), &seg_end)) != NULL) {
+        if (copied == 0) {
+            // report a dropped offset moving up, but not past the bytes copied
+            *offset = pos;
+        }
+        ssize_t got;
+        do {
+            got = pread(seg->fd, buf + copied, seg_end - pos, pos - seg->base);
+        } while (got == -1 && errno == EINTR);
+        segment_put(seg);
+        if (got <= 0) {
+            if (copied == 0 && got == -1) {
+                return -1;
+            }
+            break;
+        }
+        copied += got;
+        pos += got;
+    }
+    return copied;
+}
+
+static off_t seg_seek(struct aesd_store *st, size_t packet, size_t byte)
+{
+    struct segment_store *ss = (struct segment_store*) st;
+    off_t offset = -1;
+
+    pthread_mutex_lock(&ss->lock);
+    if (ss->nsegs > 0 && packet < ss->total_packets - ss->seg[0]->first_packet) {
+        size_t number = ss->seg[0]->first_packet + packet;
+
+        // segment by first packet number, then the packet inside it
+        size_t lo = 0, hi = ss->nsegs;
+        while (hi - lo > 1) {
+            size_t mid = lo + (hi - lo) / 2;
+            if (ss->seg[mid]->first_packet <= number) {
+                lo = mid;
+            } else {
+                hi = mid;
+            }
+        }
+        struct segment *seg = ss->seg[lo];
+        size_t i = number - seg->first_packet;
+        size_t pkt_end = i + 1 < seg->npackets ? seg->index[i + 1] : seg->size;
+        if (byte < pkt_end - seg->index[i]) {
+            offset = seg->base + seg->index[i] + byte;
+        }
+    }
+    pthread_mutex_unlock(&ss->lock);
+
+    if (offset == -1) {
+        errno = EINVAL;
+    }
+    return offset;
+}
+
+static void seg_close(struct aesd_store *st, int keep)
+{
+    struct segment_store *ss = (struct segment_store*) st;
+    if (ss->retaining) {
+        pthread_mutex_lock(&ss->lock);
+        ss->stop = 1;
+        pthread_cond_signal(&ss->retain_cond);
+        pthread_mutex_unlock(&ss->lock);
+        pthread_join(ss->retainer, NULL);
+    }
+    // the segments are the data file, removed on exit like OUTFILE unless a successor uses them
+    while (ss->nsegs > 0) {
+        if (keep) {
+            segment_put(ss->seg[--ss->nsegs]);
+        } else {
+            segment_drop_oldest(ss);
+        }
+    }
+    pthread_cond_destroy(&ss->retain_cond);
+    pthread_mutex_destroy(&ss->lock);
+    free(ss->seg);
+    free(ss->path);
+    free(ss);
+}
+
+/* persist: index the segment files of a previous run, oldest first */
+static int segment_load(struct segment_store *ss)
+{
+    char *pattern;
+    if (asprintf(&pattern, "%s.*", ss->path) == -1) {
+        return -1;
+    }
+    glob_t found;
+    int rc = glob(pattern, 0, NULL, &found);
+    free(pattern);
+    if (rc == GLOB_NOMATCH) {
+        return 0;
+    }
+    if (rc != 0) {
+        return -1;
+    }
+
+    // names carry the zero padded base offset, so glob's sort order is log order
+    for (size_t i = 0; i < found.gl_pathc && rc == 0; i++) {
+        const char *suffix = found.gl_pathv[i] + strlen(ss->path) + 1;
+        char *end;
+        long long base = strtoll(suffix, &end, 10);
+        if (strlen(suffix) != 20 || *end != '\0' || base < ss->total) {
+            continue;
+        }
+        ss->total = base;
+        struct segment *seg = segment_create(ss, 1);
+        if (seg == NULL) {
+            rc = -1;
+            break;
+        }
+        ss->total += seg->size;
+        ss->total_packets += seg->npackets;
+    }
+    globfree(&found);
+    if (rc == 0 && ss->nsegs > 0) {
+        syslog(LOG_USER, "reloaded %zu segments, %zu packets\n", ss->nsegs, ss->total_packets);
+        segment_retain(ss);
+    }
+    return rc;
+}
+
+static const struct store_ops segment_ops = {
+    .append = seg_append,
+    .start = seg_start,
+    .end = seg_end,
+    .send = seg_send,
+    .read = seg_read,
+    .seek = seg_seek,
+    .close = seg_close,
+};
+
+struct aesd_store *segment_open(const struct store_config *cfg)
+{
+    struct segment_store *ss = calloc(1, sizeof(struct segment_store));
+    if (ss == NULL) {
+        return NULL;
+    }
+    ss->base.ops = &segment_ops;
+    ss->path = strdup(cfg->path);
+    if (ss->path == NULL) {
+        free(ss);
+        return NULL;
+    }
+    ss->segment_size = cfg->segment_size > 0 ? cfg->segment_size : SEGMENT_DEFAULT_SIZE;
+    ss->retain_bytes = cfg->retain_bytes;
+    ss->retain_sec = cfg->retain_sec;
+    pthread_mutex_init(&ss->lock, NULL);
+    pthread_cond_init(&ss->retain_cond, NULL);
+
+    if (cfg->persist && segment_load(ss) == -1) {
+        syslog(LOG_ERR, "could not reload segmented log %s.*\n", ss->path);
+        seg_close(&ss->base, 1);
+        return NULL;
+    }
+    if (ss->retain_sec > 0) {
+        ss->retaining = create_worker_thread(&ss->retainer, segment_retainer, ss) == 0;
+        if (!ss->retaining) {
+            syslog(LOG_ERR, "could not start segment retention, segments expire on append only\n");
+        }
+    }
+
+    syslog(LOG_USER, "segmented log %s.*, %zu byte segments\n", ss->path, ss->segment_size);
+    return &ss->base;
+}
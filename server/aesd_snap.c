@@ -0,0 +1,323 @@
+/**
+ * Socket server - shared replay snapshots
+ * Author: Martin Mauersberg
+ * Date: 10/12/2023
+ *
+ * With many clients replaying, every replay would read the same store bytes
+ * again (pread, decompression, or a lock per packet). Instead the newest
+ * bytes of the store (up to max_bytes) are kept as an immutable snapshot in
+ * memory, shared by all replays:
+ *  - every append moves the store to a new generation (a counter)
+ *  - the first replay at a new generation builds its snapshot, reading only
+ *    the bytes appended since the previous one; replays at that generation
+ *    and any still running on an older one share their snapshot by reference
+ *  - a snapshot is a list of reference counted chunks; the chunks of the
+ *    previous snapshot are carried over, the last one may be filled further
+ *    (a snapshot only ever looks at its own length of it)
+ *  - a replay gather-sends the chunks with sendmsg without holding the lock
+ * So the store is read once per appended byte, however many replays there
+ * are. Bytes older than the snapshot are sent by the store as before.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <errno.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include <syslog.h>
+#include <pthread.h>
+
+#include "aesdsocket.h"
+#include "aesd_store.h"
+
+#define SNAP_CHUNK (256 * 1024) // bytes per chunk
+#define SNAP_IOV_MAX 64         // chunks gathered per sendmsg
+
+/* piece of the store content, shared by every snapshot holding it */
+struct snap_chunk {
+    atomic_int refs;
+    off_t offset;               // logical offset of data[0]
+    size_t fill;                // bytes read so far (only changed while building)
+    char data[SNAP_CHUNK];
+};
+
+struct snap_ref {
+    struct snap_chunk *chunk;
+    size_t len;                 // bytes of the chunk in this snapshot
+};
+
+/* store content [start, end) at one generation */
+struct snapshot {
+    atomic_int refs;
+    uint64_t generation;
+    off_t start, end;
+    int nchunks;
+    struct snap_ref chunks[];
+};
+
+struct snap_cache {
+    pthread_mutex_t lock;       // builds the next snapshot, swaps current
+    atomic_uint_fast64_t generation;    // bumped by every append
+    struct snapshot *current;   // newest snapshot, NULL before the first replay
+    size_t max_bytes;
+};
+
+/************************************************************************************
+ * ----------------------  references  ----------------------
+ * **********************************************************************************/
+static void chunk_put(struct snap_chunk *chunk)
+{
+    if (atomic_fetch_sub(&chunk->refs, 1) == 1) {
+        free(chunk);
+    }
+}
+
+static void snap_put(struct snapshot *snap)
+{
+    if (snap == NULL || atomic_fetch_sub(&snap->refs, 1) != 1) {
+        return;
+    }
+    for (int i = 0; i < snap->nchunks; i++) {
+        chunk_put(snap->chunks[i].chunk);
+    }
+    free(snap);
+}
+
+/************************************************************************************
+ * ----------------------  building  ----------------------
+ * **********************************************************************************/
+/* snapshot of the store at generation, carrying over what prev holds
+ * (called with the lock held, reads the backend directly); NULL if out of memory */
+static struct snapshot *snap_build(struct snap_cache *sc, struct aesd_store *st, struct snapshot *prev,
+                                   uint64_t generation)
+{
+    off_t end = store_end(st);
+    off_t from = store_start(st);
+    if (end - from > (off_t) sc->max_bytes) {
+        from = end - sc->max_bytes;
+    }
+
+    // chunks of prev that are still inside the window, plus the new ones
+    int keep = 0, first = 0;
+    if (prev != NULL && prev->end > from) {
+        while (first < prev->nchunks &&
+               prev->chunks[first].chunk->offset + (off_t) prev->chunks[first].len <= from) {
+            first++;
+        }
+        keep = prev->nchunks - first;
+    }
+    off_t pos = keep > 0 ? prev->end : from;
+    int max = keep + (end - pos + SNAP_CHUNK - 1) / SNAP_CHUNK + 1;
+    struct snapshot *snap = malloc(sizeof(struct snapshot) + max * sizeof(struct snap_ref));
+    if (snap == NULL) {
+        return NULL;
+    }
+    atomic_init(&snap->refs, 1);
+    snap->generation = generation;
+    snap->nchunks = 0;
+    for (int i = first; keep > 0 && i < prev->nchunks; i++) {
+        snap->chunks[snap->nchunks] = prev->chunks[i];
+        atomic_fetch_add(&prev->chunks[i].chunk->refs, 1);
+        snap->nchunks++;
+    }
+    snap->start = snap->nchunks > 0 ? snap->chunks[0].chunk->offset : pos;
+
+    // read what was appended since prev: into the rest of its last chunk, then new ones
+    off_t loaded = 0;
+    while (pos < end) {
+        struct snap_ref *last = snap->nchunks > 0 ? &snap->chunks[snap->nchunks - 1] : NULL;
+        if (last == NULL || last->len == SNAP_CHUNK || last->len != last->chunk->fill ||
+            last->chunk->offset + (off_t) last->len != pos) {
+            if (snap->nchunks == max) {
+                break;
+            }
+            struct snap_chunk *chunk = malloc(sizeof(struct snap_chunk));
+            if (chunk == NULL) {
+                break;
+            }
+            atomic_init(&chunk->refs, 1);
+            chunk->offset = pos;
+            chunk->fill = 0;
+            last = &snap->chunks[snap->nchunks++];
+            last->chunk = chunk;
+            last->len = 0;
+        }
+
+        size_t len = SNAP_CHUNK - last->len;
+        if ((off_t) len > end - pos) {
+            len = end - pos;
+        }
+        off_t at = pos;
+        ssize_t got = st->ops->read(st, last->chunk->data + last->len, len, &at);
+        if (got <= 0 || at != pos) {
+            // the store dropped these bytes meanwhile (or failed), keep what we have
+            break;
+        }
+        last->len += got;
+        last->chunk->fill = last->len;
+        pos += got;
+        loaded += got;
+    }
+    snap->end = pos;
+    if (snap->nchunks > 0 && snap->chunks[snap->nchunks - 1].len == 0) {
+        chunk_put(snap->chunks[--snap->nchunks].chunk);
+    }
+    if (snap->nchunks == 0) {
+        snap->start = snap->end;
+    }
+
+    stats_add(STAT_SNAP_BUILDS, 1);
+    stats_add(STAT_SNAP_READ, loaded);
+    return snap;
+}
+
+/* snapshot at the current generation, with a reference for the caller */
+static struct snapshot *snap_get(struct snap_cache *sc, struct aesd_store *st)
+{
+    uint64_t generation = atomic_load(&sc->generation);
+    pthread_mutex_lock(&sc->lock);
+    struct snapshot *snap = sc->current;
+    if (snap == NULL || snap->generation != generation) {
+        // the first replay at this generation builds it, the others wait for it
+        struct snapshot *next = snap_build(sc, st, snap, generation);
+        if (next != NULL) {
+            snap_put(snap);
+            sc->current = snap = next;
+        }
+    }
+    if (snap != NULL) {
+        atomic_fetch_add(&snap->refs, 1);
+    }
+    pthread_mutex_unlock(&sc->lock);
+    return snap;
+}
+
+/* index of the chunk holding offset (start <= offset < end), binary search */
+static int snap_find(const struct snapshot *snap, off_t offset)
+{
+    int lo = 0, hi = snap->nchunks - 1;
+    while (lo < hi) {
+        int mid = (lo + hi + 1) / 2;
+        if (snap->chunks[mid].chunk->offset <= offset) {
+            lo = mid;
+        } else {
+            hi = mid - 1;
+        }
+    }
+    return lo;
+}
+
+/************************************************************************************
+ * ----------------------  API  ----------------------
+ * **********************************************************************************/
+struct snap_cache *snap_create(size_t max_bytes)
+{
+    struct snap_cache *sc = calloc(1, sizeof(struct snap_cache));
+    if (sc == NULL) {
+        return NULL;
+    }
+    pthread_mutex_init(&sc->lock, NULL);
+    atomic_init(&sc->generation, 0);
+    sc->max_bytes = max_bytes > 0 ? max_bytes : SNAP_DEFAULT_BYTES;
+    return sc;
+}
+
+void snap_advance(struct snap_cache *sc)
+{
+    atomic_fetch_add(&sc->generation, 1);
+}
+
+int snap_send(struct snap_cache *sc, struct aesd_store *st, int sock, off_t *offset, off_t end)
+{
+    while (*offset < end) {
+        struct snapshot *snap = snap_get(sc, st);
+        if (snap == NULL || *offset < snap->start || *offset >= snap->end) {
+            // older than the snapshot (or beyond it, appended since): straight from the store
+            off_t stop = (snap != NULL && *offset < snap->start && snap->start < end) ? snap->start : end;
+            snap_put(snap);
+            if (st->ops->send(st, sock, offset, stop) == -1) {
+                return -1;
+            }
+            if (*offset < stop) {
+                // the store has nothing more to give
+                break;
+            }
+            continue;
+        }
+
+        struct iovec iov[SNAP_IOV_MAX];
+        int n = 0;
+        off_t pos = *offset;
+        for (int i = snap_find(snap, pos); i < snap->nchunks && n < SNAP_IOV_MAX && pos < end; i++) {
+            const struct snap_ref *ref = &snap->chunks[i];
+            size_t skip = pos - ref->chunk->offset;
+            size_t len = ref->len - skip;
+            if ((off_t) len > end - pos) {
+                len = end - pos;
+            }
+            iov[n].iov_base = ref->chunk->data + skip;
+            iov[n].iov_len = len;
+            pos += len;
+            n++;
+        }
+
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = n;
+        ssize_t sent = sendmsg(sock, &msg, MSG_NOSIGNAL);
+        int err = errno;
+        snap_put(snap);
+
+        if (sent == -1) {
+            if (err == EINTR) {
+                continue;
+            }
+            errno = err;
+            return -1;
+        }
+        *offset += sent;
+    }
+    return 0;
+}
+
+ssize_t snap_read(struct snap_cache *sc, struct aesd_store *st, char *buf, size_t len, off_t *offset)
+{
+    struct snapshot *snap = snap_get(sc, st);
+    if (snap == NULL || *offset < snap->start || *offset >= snap->end) {
+        snap_put(snap);
+        return st->ops->read(st, buf, len, offset);
+    }
+
+    size_t copied = 0;
+    off_t pos = *offset;
+    for (int i = snap_find(snap, pos); i < snap->nchunks && copied < len; i++) {
+        const struct snap_ref *ref = &snap->chunks[i];
+        size_t skip = pos - ref->chunk->offset;
+        size_t n = ref->len - skip;
+        if (n > len - copied) {
+            n = len - copied;
+        }
+        memcpy(buf + copied, ref->chunk->data + skip, n);
+        copied += n;
+        pos += n;
+    }
+    snap_put(snap);
+    return copied;
+}
+
+void snap_destroy(struct snap_cache *sc)
+{
+    if (sc == NULL) {
+        return;
+    }
+    snap_put(sc->current);
+    pthread_mutex_destroy(&sc->lock);
+    free(sc);
+}
@@ -0,0 +1,290 @@
+/**
+ * Socket server - statistics
+ * Author: Martin Mauersberg
+ * Date: 10/12/2023
+ *
+ * Counters and latency histograms kept per thread: every thread that records
+ * something gets its own block on first use and is its only writer, so the
+ * hot paths never contend on a counter or take a lock. A report walks all
+ * blocks and sums them up. Histograms are log-linear (HDR style): one bucket
+ * range per power of two, split into HIST_SUB_BUCKETS linear buckets, which
+ * keeps the relative error under 1 / HIST_SUB_BUCKETS at any magnitude.
+ *
+ * The report is served on an admin port on 127.0.0.1: connect and read it.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <time.h>
+
+#include <sys/socket.h>
+#include <netdb.h>
+
+#include <syslog.h>
+#include <pthread.h>
+
+#include "aesdsocket.h"
+
+#define HIST_SUB_BITS 3
+#define HIST_SUB_BUCKETS (1 << HIST_SUB_BITS)   // linear buckets per power of two (12.5 % error)
+#define HIST_MAX_BITS 40                        // values up to 2^40 ns (~18 min), larger ones are clamped
+#define HIST_BUCKETS ((HIST_MAX_BITS - HIST_SUB_BITS + 1) * HIST_SUB_BUCKETS)
+#define STATS_REPORT_SIZE 4096
+
+/* statistics of one thread, written only by that thread */
+struct stats_block {
+    struct stats_block *next;
+    _Atomic uint64_t counter[STAT_COUNTERS];
+    _Atomic uint64_t hist[STAT_HISTS][HIST_BUCKETS];
+};
+
+/* all blocks ever handed out; blocks are never freed, threads come and go rarely */
+static struct stats_block *blocks = NULL;
+static pthread_mutex_t blocks_lock = PTHREAD_MUTEX_INITIALIZER;
+static __thread struct stats_block *my_block = NULL;
+
+/* admin listener */
+static int admin_fd = -1;
+static pthread_t admin_thread;
+
+static const char *counter_names[STAT_COUNTERS] = {
+    [STAT_ACCEPTED] = "connections_accepted",
+    [STAT_REJECTED] = "connections_rejected",
+    [STAT_CLOSED] = "connections_closed",
+    [STAT_BYTES_IN] = "bytes_in",
+    [STAT_BYTES_OUT] = "bytes_out",
+    [STAT_PACKETS] = "packets_appended",
+    [STAT_REPLAYS] = "replays",
+    [STAT_THROTTLED] = "connections_throttled",
+    [STAT_DROPPED] = "connections_dropped",
+    [STAT_HANDED_OVER] = "connections_handed_over",
+    [STAT_BLOCK_HITS] = "block_cache_hits",
+    [STAT_BLOCK_MISSES] = "block_cache_misses",
+    [STAT_SNAP_BUILDS] = "snapshot_builds",
+    [STAT_SNAP_READ] = "snapshot_bytes_read",
+};
+
+static const char *hist_names[STAT_HISTS] = {
+    [HIST_REPLAY] = "replay_latency_us",
+    [HIST_APPEND] = "append_latency_us",
+};
+
+/************************************************************************************
+ * ----------------------  recording  ----------------------
+ * **********************************************************************************/
+static struct stats_block *stats_block(void)
+{
+    if (my_block == NULL) {
+        struct stats_block *blk = calloc(1, sizeof(struct stats_block));
+        if (blk == NULL) {
+            return NULL;
+        }
+        pthread_mutex_lock(&blocks_lock);
+        blk->next = blocks;
+        blocks = blk;
+        pthread_mutex_unlock(&blocks_lock);
+        my_block = blk;
+    }
+    return my_block;
+}
+
+/* single writer: a relaxed load + store is enough, no locked read-modify-write */
+static inline void stats_bump(_Atomic uint64_t *slot, uint64_t n)
+{
+    atomic_store_explicit(slot, atomic_load_explicit(slot, memory_order_relaxed) + n, memory_order_relaxed);
+}
+
+static int hist_bucket(uint64_t value)
+{
+    if (value < HIST_SUB_BUCKETS) {
+        return value;
+    }
+    int msb = 63 - __builtin_clzll(value);
+    if (msb >= HIST_MAX_BITS) {
+        return HIST_BUCKETS - 1;
+    }
+    int shift = msb - HIST_SUB_BITS;
+    return (shift + 1) * HIST_SUB_BUCKETS + ((value >> shift) & (HIST_SUB_BUCKETS - 1));
+}
+
+/* largest value that lands in bucket idx */
+static uint64_t hist_bucket_max(int idx)
+{
+    if (idx < HIST_SUB_BUCKETS) {
+        return idx;
+    }
+    int shift = idx / HIST_SUB_BUCKETS - 1;
+    uint64_t lower = (uint64_t)(HIST_SUB_BUCKETS + idx % HIST_SUB_BUCKETS) << shift;
+    return lower + ((uint64_t) 1 << shift) - 1;
+}
+
+uint64_t stats_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void stats_add(enum stat_counter c, uint64_t n)
+{
+    struct stats_block *blk = stats_block();
+    if (blk != NULL) {
+        stats_bump(&blk->counter[c], n);
+    }
+}
+
+void stats_record(enum stat_hist h, uint64_t ns)
+{
+    struct stats_block *blk = stats_block();
+    if (blk != NULL) {
+        stats_bump(&blk->hist[h][hist_bucket(ns)], 1);
+    }
+}
+
+/************************************************************************************
+ * ----------------------  report  ----------------------
+ * **********************************************************************************/
+/* value at quantile q (0..1) of a summed histogram, in us */
+static double hist_quantile(const uint64_t *hist, uint64_t total, double q)
+{
+    uint64_t rank = (uint64_t)(q * total);
+    uint64_t seen = 0;
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        seen += hist[i];
+        if (hist[i] > 0 && seen > rank) {
+            return hist_bucket_max(i) / 1000.0;
+        }
+    }
+    return 0;
+}
+
+size_t stats_report(char *buf, size_t size)
+{
+    uint64_t counter[STAT_COUNTERS] = { 0 };
+    static uint64_t hist[STAT_HISTS][HIST_BUCKETS];     // only used by the admin thread
+    memset(hist, 0, sizeof(hist));
+
+    pthread_mutex_lock(&blocks_lock);
+    for (struct stats_block *blk = blocks; blk != NULL; blk = blk->next) {
+        for (int c = 0; c < STAT_COUNTERS; c++) {
+            counter[c] += atomic_load_explicit(&blk->counter[c], memory_order_relaxed);
+        }
+        for (int h = 0; h < STAT_HISTS; h++) {
+            for (int i = 0; i < HIST_BUCKETS; i++) {
+                hist[h][i] += atomic_load_explicit(&blk->hist[h][i], memory_order_relaxed);
+            }
+        }
+    }
+    pthread_mutex_unlock(&blocks_lock);
+
+    size_t len = 0;
+    for (int c = 0; c < STAT_COUNTERS && len < size; c++) {
+        len += snprintf(buf + len, size - len, "%s %llu\n", counter_names[c], (unsigned long long) counter[c]);
+    }
+    if (len < size) {
+        // closed can briefly run ahead of accepted as the two are summed from different threads
+        uint64_t active = counter[STAT_ACCEPTED] > counter[STAT_CLOSED] ? counter[STAT_ACCEPTED] - counter[STAT_CLOSED] : 0;
+        len += snprintf(buf + len, size - len, "connections_active %llu\n", (unsigned long long) active);
+    }
+    for (int h = 0; h < STAT_HISTS && len < size; h++) {
+        uint64_t total = 0;
+        int last = -1;
+        for (int i = 0; i < HIST_BUCKETS; i++) {
+            total += hist[h][i];
+            if (hist[h][i] > 0) {
+                last = i;
+            }
+        }
+        len += snprintf(buf + len, size - len, "%s count=%llu p50=%.1f p90=%.1f p99=%.1f p999=%.1f max=%.1f\n",
+                        hist_names[h], (unsigned long long) total,
+                        hist_quantile(hist[h], total, 0.5), hist_quantile(hist[h], total, 0.9),
+                        hist_quantile(hist[h], total, 0.99), hist_quantile(hist[h], total, 0.999),
+                        last >= 0 ? hist_bucket_max(last) / 1000.0 : 0);
+    }
+    return len < size ? len : size - 1;
+}
+
+/************************************************************************************
+ * ----------------------  admin port  ----------------------
+ * **********************************************************************************/
+static void *admin_loop(void *unused)
+{
+    char report[STATS_REPORT_SIZE];
+
+    while (done == 0) {
+        // wake up every RECV_TIMEOUT_SEC to check done
+        struct pollfd pfd = { .fd = admin_fd, .events = POLLIN };
+        if (poll(&pfd, 1, RECV_TIMEOUT_SEC * 1000) <= 0) {
+            continue;
+        }
+        int fd = accept(admin_fd, NULL, NULL);
+        if (fd == -1) {
+            continue;
+        }
+        size_t len = stats_report(report, sizeof(report));
+        if (send(fd, report, len, MSG_NOSIGNAL) == -1) {
+            syslog(LOG_ERR, "failed to send statistics: %s\n", strerror(errno));
+        }
+        close(fd);
+    }
+    return 0;
+}
+
+int stats_listen(const char *port)
+{
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;    // no AI_PASSIVE: 127.0.0.1 only
+
+    struct addrinfo *servinfo;
+    int retval = getaddrinfo(NULL, port, &hints, &servinfo);
+    if (retval != 0) {
+        syslog(LOG_ERR, "admin port getaddrinfo: %s\n", gai_strerror(retval));
+        return -1;
+    }
+
+    int yes = 1;
+    struct addrinfo *p;
+    for (p = servinfo; p != NULL; p = p->ai_next) {
+        admin_fd = socket(p->ai_family, p->ai_socktype, p->ai_protocol);
+        if (admin_fd == -1) {
+            continue;
+        }
+        if (setsockopt(admin_fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(int)) == 0 &&
+            bind(admin_fd, p->ai_addr, p->ai_addrlen) == 0 && listen(admin_fd, SOCKET_BACKLOG) == 0) {
+            break;
+        }
+        close(admin_fd);
+        admin_fd = -1;
+    }
+    freeaddrinfo(servinfo);
+    if (admin_fd == -1) {
+        syslog(LOG_ERR, "failed to open admin port %s\n", port);
+        return -1;
+    }
+
+    if (create_worker_thread(&admin_thread, admin_loop, NULL)) {
+        syslog(LOG_ERR, "could not create admin thread\n");
+        close(admin_fd);
+        admin_fd = -1;
+        return -1;
+    }
+    syslog(LOG_USER, "statistics on admin port %s\n", port);
+    return 0;
+}
+
+void stats_close(void)
+{
+    if (admin_fd != -1) {
+        pthread_join(admin_thread, NULL);
+        close(admin_fd);
+        admin_fd = -1;
+    }
+}
@@ -0,0 +1,796 @@
+/**
+ * Socket server - packet store
+ * Author: Martin Mauersberg
+ * Date: 10/12/2023
+ *
+ * File store: replay streams OUTFILE with sendfile. Appends do not share a
+ * lock: a writer reserves its range with a fetch-add on the reserved tail,
+ * pwrites it, and publishes it by moving the committed watermark once every
+ * range before its own is written. Readers replay up to the watermark, so
+ * they never see a packet that is still being written, and never block a
+ * writer. A failed write stops the store there: the watermark never moves
+ * past it (that would publish a hole), so that append and every one
+ * reserved after it fail. (With the group commit writer, or once the file is handed out for
+ * direct appends, the file size is the end as before.)
+ *
+ * Ring store: fixed capacity circular buffer of packets in memory (same
+ * in_offs / out_offs / full scheme as the aesd-circular-buffer), with a
+ * running total so each entry knows its logical offset. Packets are
+ * reference counted so a replay can gather-send them without holding the
+ * lock while the socket blocks. With write back, a restart (persist) reloads
+ * the newest packets from OUTFILE and continues its offsets.
+ *
+ * The segmented log lives in aesd_segment.c, the block compressed store in
+ * aesd_block.c. Any of them can replay from shared snapshots (aesd_snap.c).
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include <syslog.h>
+#include <pthread.h>
+
+#include "aesdsocket.h"
+#include "aesd_store.h"
+
+#define RING_IOV_MAX 64     // packets gathered per sendmsg during replay
+
+/* write all of data to fd */
+static int write_all(int fd, const char *data, size_t len)
+{
+    while (len > 0) {
+        ssize_t written = write(fd, data, len);
+        if (written == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        data += written;
+        len -= written;
+    }
+    return 0;
+}
+
+/* write all of data at pos */
+static int pwrite_all(int fd, const char *data, size_t len, off_t pos)
+{
+    while (len > 0) {
+        ssize_t written = pwrite(fd, data, len, pos);
+        if (written == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        data += written;
+        len -= written;
+        pos += written;
+    }
+    return 0;
+}
+
+/************************************************************************************
+ * ----------------------  file store  ----------------------
+ * **********************************************************************************/
+struct file_store {
+    struct aesd_store base;
+    int fd;                     // OUTFILE, O_APPEND only for the group commit writer
+    struct aesd_wlog *wlog;     // group commit writer or NULL
+    _Atomic off_t reserved;     // end of the ranges handed to writers
+    _Atomic off_t committed;    // end of the ranges written, in order
+    _Atomic off_t failed;       // start of the first range that could not be written, -1 = none
+    atomic_int waiters;         // writers waiting for an earlier range
+    pthread_mutex_t publish_lock;
+    pthread_cond_t published;
+    atomic_bool direct;         // fd handed out with file_fd, appends bypass the watermark
+};
+
+static int file_append(struct aesd_store *st, const char *data, size_t len)
+{
+    struct file_store *fs = (struct file_store*) st;
+    if (fs->wlog != NULL) {
+        return wlog_append(fs->wlog, data, len);
+    }
+
+    if (atomic_load(&fs->failed) != -1) {
+        errno = EIO;
+        return -1;
+    }
+
+    // reserve, then write without holding anything
+    off_t start = atomic_fetch_add(&fs->reserved, (off_t) len);
+    if (pwrite_all(fs->fd, data, len, start) == -1) {
+        syslog(LOG_ERR, "file store append failed, no more appends: %s\n", strerror(errno));
+        // keep the lowest failed range, the ranges before it are still published
+        off_t failed = -1;
+        while ((failed == -1 || start < failed) &&
+               !atomic_compare_exchange_weak(&fs->failed, &failed, start)) {
+        }
+        pthread_mutex_lock(&fs->publish_lock);
+        pthread_cond_broadcast(&fs->published);
+        pthread_mutex_unlock(&fs->publish_lock);
+        errno = EIO;
+        return -1;
+    }
+
+    // publish in reservation order: wait until the ranges before ours are written,
+    // unless one of them failed and the watermark stays before it for good
+    if (atomic_load(&fs->committed) != start) {
+        pthread_mutex_lock(&fs->publish_lock);
+        atomic_fetch_add(&fs->waiters, 1);
+        while (atomic_load(&fs->committed) != start) {
+            off_t failed = atomic_load(&fs->failed);
+            if (failed != -1 && failed < start) {
+                break;
+            }
+            pthread_cond_wait(&fs->published, &fs->publish_lock);
+        }
+        atomic_fetch_sub(&fs->waiters, 1);
+        pthread_mutex_unlock(&fs->publish_lock);
+        if (atomic_load(&fs->committed) != start) {
+            errno = EIO;
+            return -1;
+        }
+    }
+    atomic_store(&fs->committed, start + (off_t) len);
+    if (atomic_load(&fs->waiters) > 0) {
+        pthread_mutex_lock(&fs->publish_lock);
+        pthread_cond_broadcast(&fs->published);
+        pthread_mutex_unlock(&fs->publish_lock);
+    }
+    return 0;
+}
+
+static off_t file_start(struct aesd_store *st)
+{
+    return 0;
+}
+
+static off_t file_end(struct aesd_store *st)
+{
+    struct file_store *fs = (struct file_store*) st;
+    if (fs->wlog == NULL && !atomic_load(&fs->direct)) {
+        return atomic_load(&fs->committed);
+    }
+    struct stat sb;
+    if (fstat(fs->fd, &sb) == -1) {
+        return 0;
+    }
+    return sb.st_size;
+}
+
+static int file_send(struct aesd_store *st, int sock, off_t *offset, off_t end)
+{
+    struct file_store *fs = (struct file_store*) st;
+    return send_file_range(sock, fs->fd, offset, end);
+}
+
+static ssize_t file_read(struct aesd_store *st, char *buf, size_t len, off_t *offset)
+{
+    struct file_store *fs = (struct file_store*) st;
+    if (fs->wlog == NULL && !atomic_load(&fs->direct)) {
+        // nothing past the watermark, that may be a write in progress
+        off_t end = atomic_load(&fs->committed);
+        if (*offset >= end) {
+            return 0;
+        }
+        if ((off_t) len > end - *offset) {
+            len = end - *offset;
+        }
+    }
+    ssize_t fileRead;
+    do {
+        fileRead = pread(fs->fd, buf, len, *offset);
+    } while (fileRead == -1 && errno == EINTR);
+    return fileRead;
+}
+
+static int file_fd(struct aesd_store *st)
+{
+    struct file_store *fs = (struct file_store*) st;
+    // appends through the group commit writer must not be bypassed
+    if (fs->wlog != NULL) {
+        return -1;
+    }
+    // the caller appends at its own offsets from now on, the file size is the end
+    atomic_store(&fs->direct, true);
+    return fs->fd;
+}
+
+static void file_close(struct aesd_store *st, int keep)
+{
+    struct file_store *fs = (struct file_store*) st;
+    if (fs->wlog != NULL) {
+        wlog_close(fs->wlog);
+    }
+    close(fs->fd);
+    pthread_cond_destroy(&fs->published);
+    pthread_mutex_destroy(&fs->publish_lock);
+    free(fs);
+}
+
+static const struct store_ops file_ops = {
+    .append = file_append,
+    .start = file_start,
+    .end = file_end,
+    .send = file_send,
+    .read = file_read,
+    .file_fd = file_fd,
+    .close = file_close,
+};
+
+static struct aesd_store *file_open(const struct store_config *cfg)
+{
+    struct file_store *fs = calloc(1, sizeof(struct file_store));
+    if (fs == NULL) {
+        return NULL;
+    }
+    fs->base.ops = &file_ops;
+    pthread_mutex_init(&fs->publish_lock, NULL);
+    pthread_cond_init(&fs->published, NULL);
+    // the group commit writer appends with write(), everyone else writes at a reserved offset
+    fs->fd = open(cfg->path, O_RDWR | O_CREAT | (cfg->group_commit ? O_APPEND : 0) | O_CLOEXEC, 0644);
+    if (fs->fd == -1) {
+        syslog(LOG_ERR, "could not open %s: %s\n", cfg->path, strerror(errno));
+        pthread_cond_destroy(&fs->published);
+        pthread_mutex_destroy(&fs->publish_lock);
+        free(fs);
+        return NULL;
+    }
+    struct stat sb;
+    if (fstat(fs->fd, &sb) == -1) {
+        syslog(LOG_ERR, "could not stat %s: %s\n", cfg->path, strerror(errno));
+        file_close(&fs->base, 0);
+        return NULL;
+    }
+    atomic_init(&fs->reserved, sb.st_size);
+    atomic_init(&fs->committed, sb.st_size);
+    atomic_init(&fs->failed, -1);
+    if (cfg->group_commit) {
+        fs->wlog = wlog_open(fs->fd, cfg->sync_ms);
+        if (fs->wlog == NULL) {
+            file_close(&fs->base, 0);
+            return NULL;
+        }
+    }
+    return &fs->base;
+}
+
+/************************************************************************************
+ * ----------------------  ring store  ----------------------
+ * **********************************************************************************/
+
+/* one packet, shared by the ring and any replay currently sending it */
+struct ring_pkt {
+    atomic_int refs;
+    size_t size;
+    char data[];
+};
+
+struct ring_entry {
+    struct ring_pkt *pkt;
+    off_t offset;               // logical offset of the first byte of pkt
+};
+
+struct ring_store {
+    struct aesd_store base;
+    pthread_mutex_t lock;
+    struct ring_entry *entry;   // capacity entries
+    size_t capacity;
+    size_t in_offs;             // next entry to write
+    size_t out_offs;            // oldest entry
+    bool full;
+    off_t total;                // running total of bytes appended
+    int wbfd;                   // write back file or -1
+    struct aesd_wlog *wlog;     // group commit writer for wbfd or NULL
+};
+
+static void ring_pkt_put(struct ring_pkt *pkt)
+{
+    if (atomic_fetch_sub(&pkt->refs, 1) == 1) {
+        free(pkt);
+    }
+}
+
+static size_t ring_count(struct ring_store *rs)
+{
+    if (rs->full) {
+        return rs->capacity;
+    }
+    return (rs->in_offs + rs->capacity - rs->out_offs) % rs->capacity;
+}
+
+/* i-th entry in logical order, 0 = oldest */
+static struct ring_entry *ring_at(struct ring_store *rs, size_t i)
+{
+    return &rs->entry[(rs->out_offs + i) % rs->capacity];
+}
+
+static off_t ring_start_locked(struct ring_store *rs)
+{
+    return ring_count(rs) > 0 ? ring_at(rs, 0)->offset : rs->total;
+}
+
+/* index (in logical order) of the entry holding offset, binary search */
+static size_t ring_find(struct ring_store *rs, off_t offset)
+{
+    size_t lo = 0, hi = ring_count(rs);
+    while (hi - lo > 1) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (ring_at(rs, mid)->offset <= offset) {
+            lo = mid;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+/* add one ring entry per packet, dropping the oldest ones */
+static int ring_insert_locked(struct ring_store *rs, const char *data, size_t len)
+{
+    while (len > 0) {
+        const char *nl = memchr(data, '\n', len);
+        size_t size = nl ? (size_t)(nl - data) + 1 : len;
+
+        struct ring_pkt *pkt = malloc(sizeof(struct ring_pkt) + size);
+        if (pkt == NULL) {
+            return -1;
+        }
+        atomic_init(&pkt->refs, 1);
+        pkt->size = size;
+        memcpy(pkt->data, data, size);
+
+        if (rs->full) {
+            // drop the oldest packet
+            ring_pkt_put(rs->entry[rs->out_offs].pkt);
+            rs->out_offs = (rs->out_offs + 1) % rs->capacity;
+        }
+        rs->entry[rs->in_offs].pkt = pkt;
+        rs->entry[rs->in_offs].offset = rs->total;
+        rs->in_offs = (rs->in_offs + 1) % rs->capacity;
+        rs->full = (rs->in_offs == rs->out_offs);
+        rs->total += size;
+
+        data += size;
+        len -= size;
+    }
+    return 0;
+}
+
+/* persist: load the newest packets of the write back file into the ring,
+ * logical offsets continue from the file */
+static int ring_load(struct ring_store *rs, const char *path)
+{
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        return errno == ENOENT ? 0 : -1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+        close(fd);
+        return -1;
+    }
+
+    // walk back from the end until capacity packets are covered
+    char buf[BUF_SIZE * 16];
+    off_t start = 0;
+    size_t kept = 0;
+    off_t pos = st.st_size;
+    while (pos > 0 && kept < rs->capacity) {
+        size_t n = pos > (off_t) sizeof(buf) ? sizeof(buf) : (size_t) pos;
+        pos -= n;
+        if (pread(fd, buf, n, pos) != (ssize_t) n) {
+            close(fd);
+            return -1;
+        }
+        for (size_t i = n; i > 0 && kept < rs->capacity; i--) {
+            if (buf[i - 1] == '\n' && pos + (off_t) i < st.st_size) {
+                start = pos + i;
+                kept++;
+            }
+        }
+    }
+    if (kept < rs->capacity) {
+        start = 0;
+    }
+
+    // then read them in order, a packet may be larger than any buffer
+    rs->total = start;
+    char *data = NULL;
+    size_t have = 0, cap = 0;
+    int rc = 0;
+    for (off_t off = start; off < st.st_size && rc == 0; ) {
+        if (cap - have < sizeof(buf)) {
+            char *grown = realloc(data, cap > 0 ? cap * 2 : sizeof(buf));
+            if (grown == NULL) {
+                rc = -1;
+                break;
+            }
+            data = grown;
+            cap = cap > 0 ? cap * 2 : sizeof(buf);
+        }
+        ssize_t got = pread(fd, data + have, cap - have, off);
+        if (got <= 0) {
+            rc = -1;
+            break;
+        }
+        have += got;
+        off += got;
+
+        size_t complete = have;
+        while (complete > 0 && data[complete - 1] != '\n') {
+            complete--;
+        }
+        rc = ring_insert_locked(rs, data, complete);
+        memmove(data, data + complete, have - complete);
+        have -= complete;
+    }
+    if (rc == 0 && have > 0) {
+        // file ends without a newline, keep the rest as a packet like ring_append does
+        rc = ring_insert_locked(rs, data, have);
+    }
+    free(data);
+    close(fd);
+
+    syslog(LOG_USER, "ring store reloaded %zu packets from %s\n", ring_count(rs), path);
+    return rc;
+}
+
+static int ring_append(struct aesd_store *st, const char *data, size_t len)
+{
+    struct ring_store *rs = (struct ring_store*) st;
+    int rc = 0;
+
+    if (rs->wlog != NULL) {
+        // outside the ring lock so concurrent appends can share a batch
+        if (wlog_append(rs->wlog, data, len) == -1) {
+            syslog(LOG_ERR, "ring store write back failed: %s\n", strerror(errno));
+            rc = -1;
+        }
+    }
+
+    pthread_mutex_lock(&rs->lock);
+    if (rs->wlog == NULL && rs->wbfd != -1 && write_all(rs->wbfd, data, len) == -1) {
+        syslog(LOG_ERR, "ring store write back failed: %s\n", strerror(errno));
+        rc = -1;
+    }
+    if (ring_insert_locked(rs, data, len) == -1) {
+        rc = -1;
+    }
+    pthread_mutex_unlock(&rs->lock);
+
+    return rc;
+}
+
+static off_t ring_start(struct aesd_store *st)
+{
+    struct ring_store *rs = (struct ring_store*) st;
+    pthread_mutex_lock(&rs->lock);
+    off_t start = ring_start_locked(rs);
+    pthread_mutex_unlock(&rs->lock);
+    return start;
+}
+
+static off_t ring_end(struct aesd_store *st)
+{
+    struct ring_store *rs = (struct ring_store*) st;
+    pthread_mutex_lock(&rs->lock);
+    off_t end = rs->total;
+    pthread_mutex_unlock(&rs->lock);
+    return end;
+}
+
+static int ring_send(struct aesd_store *st, int sock, off_t *offset, off_t end)
+{
+    struct ring_store *rs = (struct ring_store*) st;
+
+    while (*offset < end) {
+        struct iovec iov[RING_IOV_MAX];
+        struct ring_pkt *held[RING_IOV_MAX];
+        int n = 0;
+
+        pthread_mutex_lock(&rs->lock);
+        off_t start = ring_start_locked(rs);
+        if (*offset < start) {
+            // the packets at offset were dropped, continue with the oldest one
+            *offset = start;
+        }
+        if (end > rs->total) {
+            end = rs->total;
+        }
+
+        // gather packets up to end, holding a reference to each
+        off_t pos = *offset;
+        for (size_t i = ring_find(rs, pos); i < ring_count(rs) && n < RING_IOV_MAX && pos < end; i++) {
+            struct ring_entry *e = ring_at(rs, i);
+            size_t skip = pos - e->offset;
+            size_t len = e->pkt->size - skip;
+            if ((off_t) len > end - pos) {
+                len = end - pos;
+            }
+            atomic_fetch_add(&e->pkt->refs, 1);
+            held[n] = e->pkt;
+            iov[n].iov_base = e->pkt->data + skip;
+            iov[n].iov_len = len;
+            pos += len;
+            n++;
+        }
+        pthread_mutex_unlock(&rs->lock);
+
+        if (n == 0) {
+            break;
+        }
+
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = n;
+        ssize_t sent = sendmsg(sock, &msg, MSG_NOSIGNAL);
+        int err = errno;
+
+        for (int i = 0; i < n; i++) {
+            ring_pkt_put(held[i]);
+        }
+
+        if (sent == -1) {
+            if (err == EINTR) {
+                continue;
+            }
+            errno = err;
+            return -1;
+        }
+        *offset += sent;
+    }
+    return 0;
+}
+
+static off_t ring_seek(struct aesd_store *st, size_t packet, size_t byte)
+{
+    struct ring_store *rs = (struct ring_store*) st;
+    off_t offset = -1;
+
+    // every entry is one packet, so this is a direct lookup
+    pthread_mutex_lock(&rs->lock);
+    if (packet < ring_count(rs) && byte < ring_at(rs, packet)->pkt->size) {
+        offset = ring_at(rs, packet)->offset + byte;
+    }
+    pthread_mutex_unlock(&rs->lock);
+
+    if (offset == -1) {
+        errno = EINVAL;
+    }
+    return offset;
+}
+
+static ssize_t ring_read(struct aesd_store *st, char *buf, size_t len, off_t *offset)
+{
+    struct ring_store *rs = (struct ring_store*) st;
+    size_t copied = 0;
+
+    pthread_mutex_lock(&rs->lock);
+    off_t start = ring_start_locked(rs);
+    if (*offset < start) {
+        *offset = start;
+    }
+    off_t pos = *offset;
+    for (size_t i = ring_find(rs, pos); i < ring_count(rs) && copied < len; i++) {
+        struct ring_entry *e = ring_at(rs, i);
+        size_t skip = pos - e->offset;
+        size_t n = e->pkt->size - skip;
+        if (n > len - copied) {
+            n = len - copied;
+        }
+        memcpy(buf + copied, e->pkt->data + skip, n);
+        copied += n;
+        pos += n;
+    }
+    pthread_mutex_unlock(&rs->lock);
+
+    return copied;
+}
+
+static void ring_close(struct aesd_store *st, int keep)
+{
+    struct ring_store *rs = (struct ring_store*) st;
+    for (size_t i = 0; i < ring_count(rs); i++) {
+        ring_pkt_put(ring_at(rs, i)->pkt);
+    }
+    if (rs->wlog != NULL) {
+        wlog_close(rs->wlog);
+    }
+    if (rs->wbfd != -1) {
+        close(rs->wbfd);
+    }
+    pthread_mutex_destroy(&rs->lock);
+    free(rs->entry);
+    free(rs);
+}
+
+static const struct store_ops ring_ops = {
+    .append = ring_append,
+    .start = ring_start,
+    .end = ring_end,
+    .send = ring_send,
+    .read = ring_read,
+    .seek = ring_seek,
+    .close = ring_close,
+};
+
+static struct aesd_store *ring_open(const struct store_config *cfg)
+{
+    struct ring_store *rs = calloc(1, sizeof(struct ring_store));
+    if (rs == NULL) {
+        return NULL;
+    }
+    rs->base.ops = &ring_ops;
+    rs->capacity = cfg->ring_packets > 0 ? cfg->ring_packets : RING_DEFAULT_PACKETS;
+    rs->entry = calloc(rs->capacity, sizeof(struct ring_entry));
+    if (rs->entry == NULL) {
+        free(rs);
+        return NULL;
+    }
+    pthread_mutex_init(&rs->lock, NULL);
+
+    rs->wbfd = -1;
+    if (cfg->writeback && cfg->persist && ring_load(rs, cfg->path) == -1) {
+        syslog(LOG_ERR, "could not reload %s: %s\n", cfg->path, strerror(errno));
+        ring_close(&rs->base, 0);
+        return NULL;
+    }
+    if (cfg->writeback) {
+        rs->wbfd = open(cfg->path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+        if (rs->wbfd == -1) {
+            syslog(LOG_ERR, "could not open %s: %s\n", cfg->path, strerror(errno));
+            ring_close(&rs->base, 0);
+            return NULL;
+        }
+        if (cfg->group_commit) {
+            rs->wlog = wlog_open(rs->wbfd, cfg->sync_ms);
+            if (rs->wlog == NULL) {
+                ring_close(&rs->base, 0);
+                return NULL;
+            }
+        }
+    }
+    return &rs->base;
+}
+
+/************************************************************************************
+ * ----------------------  store API  ----------------------
+ * **********************************************************************************/
+struct aesd_store *store_open(const struct store_config *cfg)
+{
+    struct aesd_store *st;
+    switch (cfg->type) {
+        case STORE_RING:
+            st = ring_open(cfg);
+            break;
+        case STORE_SEGMENT:
+            st = segment_open(cfg);
+            break;
+        case STORE_BLOCK:
+            st = block_open(cfg);
+            break;
+        case STORE_FILE:
+        default:
+            st = file_open(cfg);
+            break;
+    }
+    if (st != NULL && cfg->snapshot_bytes > 0) {
+        st->snap = snap_create(cfg->snapshot_bytes);
+        if (st->snap == NULL) {
+            syslog(LOG_ERR, "out of memory for replay snapshots, replaying from the store\n");
+        }
+    }
+    return st;
+}
+
+int store_append(struct aesd_store *st, const char *data, size_t len)
+{
+    int rc = st->ops->append(st, data, len);
+    if (st->snap != NULL) {
+        // even a failed append may have written part of it
+        snap_advance(st->snap);
+    }
+    return rc;
+}
+
+off_t store_start(struct aesd_store *st)
+{
+    return st->ops->start(st);
+}
+
+off_t store_end(struct aesd_store *st)
+{
+    return st->ops->end(st);
+}
+
+int store_send(struct aesd_store *st, int sock, off_t *offset, off_t end)
+{
+    if (st->snap != NULL) {
+        return snap_send(st->snap, st, sock, offset, end);
+    }
+    return st->ops->send(st, sock, offset, end);
+}
+
+ssize_t store_read(struct aesd_store *st, char *buf, size_t len, off_t *offset)
+{
+    if (st->snap != NULL) {
+        return snap_read(st->snap, st, buf, len, offset);
+    }
+    return st->ops->read(st, buf, len, offset);
+}
+
+/* seek for stores without an index: count packets from the start */
+static off_t store_scan(struct aesd_store *st, size_t packet, size_t byte)
+{
+    char buf[BUF_SIZE * 16];
+    off_t offset = store_start(st);
+    off_t pkt_start = offset;
+    size_t seen = 0;
+
+    while (1) {
+        off_t pos = offset;
+        ssize_t got = store_read(st, buf, sizeof(buf), &pos);
+        if (got <= 0) {
+            break;
+        }
+        const char *p = buf, *end = buf + got;
+        const char *nl;
+        while ((nl = memchr(p, '\n', end - p)) != NULL) {
+            off_t next = pos + (nl + 1 - buf);
+            if (seen == packet) {
+                // found the packet, byte must lie inside it
+                if ((off_t) byte < next - pkt_start) {
+                    return pkt_start + byte;
+                }
+                errno = EINVAL;
+                return -1;
+            }
+            seen++;
+            pkt_start = next;
+            p = nl + 1;
+        }
+        offset = pos + got;
+    }
+    errno = EINVAL;
+    return -1;
+}
+
+off_t store_seek(struct aesd_store *st, size_t packet, size_t byte)
+{
+    if (st->ops->seek != NULL) {
+        return st->ops->seek(st, packet, byte);
+    }
+    return store_scan(st, packet, byte);
+}
+
+int store_file_fd(struct aesd_store *st)
+{
+    return st->ops->file_fd != NULL && st->snap == NULL ? st->ops->file_fd(st) : -1;
+}
+
+int store_replay(struct aesd_store *st, int sock)
+{
+    off_t offset = store_start(st);
+    return store_send(st, sock, &offset, store_end(st));
+}
+
+void store_close(struct aesd_store *st, int keep)
+{
+    snap_destroy(st->snap);
+    st->ops->close(st, keep);
+}
@@ -0,0 +1,119 @@
+/**
+ * Socket server - packet store
+ * Author: Martin Mauersberg
+ * Date: 10/12/2023
+ *
+ * All connections append to and replay from one shared store. The store is
+ * a stream of complete newline terminated packets addressed by logical byte
+ * offset: store_end() is the running total of all bytes ever appended and
+ * store_start() the first byte still held (a bounded store drops the oldest
+ * packets and moves its start forward).
+*/
+
+#ifndef AESD_STORE_H
+#define AESD_STORE_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+#define RING_DEFAULT_PACKETS 1024   // default capacity of the in-memory ring store
+#define SEGMENT_DEFAULT_SIZE (64 * 1024 * 1024)    // default segment file size of the segmented log
+#define BLOCK_DEFAULT_SIZE (64 * 1024)              // default raw bytes per block of the block store
+#define SNAP_DEFAULT_BYTES (64 * 1024 * 1024)       // default newest bytes kept in the replay snapshot
+
+/* storage backends */
+enum store_type {
+    STORE_FILE,     // append to OUTFILE, replay with sendfile
+    STORE_RING,     // fixed number of packets in memory, replay with gather send
+    STORE_SEGMENT,  // OUTFILE split into segment files with a packet index (aesd_segment.c)
+    STORE_BLOCK,    // OUTFILE as compressed, checksummed blocks (aesd_block.c)
+};
+
+/* store configuration (filled in from the command line) */
+struct store_config {
+    enum store_type type;
+    const char *path;           // data file (file store, ring write back)
+    size_t ring_packets;        // ring: number of packets kept in memory
+    int writeback;              // ring: also append every packet to path
+    int group_commit;           // append to path through the single writer (aesd_wlog.c)
+    int sync_ms;                // group commit fdatasync interval, -1 = no sync
+    size_t segment_size;        // segment: bytes per segment file
+    size_t retain_bytes;        // segment: drop old segments beyond this many bytes, 0 = keep all
+    int retain_sec;             // segment: drop segments not written for this long, 0 = keep all
+    size_t block_size;          // block: raw bytes collected per compressed block
+    size_t snapshot_bytes;      // replay from a shared in-memory snapshot of this many newest bytes, 0 = off
+    int persist;                // pick up the data a previous process left on disk (hot restart)
+};
+
+struct aesd_store;
+struct snap_cache;
+
+/* backend operations, every backend embeds struct aesd_store as its first member */
+struct store_ops {
+    int (*append)(struct aesd_store *st, const char *data, size_t len);
+    off_t (*start)(struct aesd_store *st);
+    off_t (*end)(struct aesd_store *st);
+    int (*send)(struct aesd_store *st, int sock, off_t *offset, off_t end);
+    ssize_t (*read)(struct aesd_store *st, char *buf, size_t len, off_t *offset);
+    off_t (*seek)(struct aesd_store *st, size_t packet, size_t byte);   // optional
+    int (*file_fd)(struct aesd_store *st);     // optional
+    void (*close)(struct aesd_store *st, int keep);
+};
+
+struct aesd_store {
+    const struct store_ops *ops;
+    struct snap_cache *snap;    // shared replay snapshots (aesd_snap.c), or NULL
+};
+
+/* open the store described by cfg; returns NULL on error */
+struct aesd_store *store_open(const struct store_config *cfg);
+
+/* append data, which must consist of complete newline terminated packets */
+int store_append(struct aesd_store *st, const char *data, size_t len);
+
+/* first logical offset still held by the store */
+off_t store_start(struct aesd_store *st);
+
+/* logical offset one past the last appended byte */
+off_t store_end(struct aesd_store *st);
+
+/* send [*offset, end) to sock, same contract as send_file_range: *offset is
+ * advanced past the bytes sent (and moved up to store_start() if those bytes
+ * were dropped), returns -1 with errno set on error or EAGAIN */
+int store_send(struct aesd_store *st, int sock, off_t *offset, off_t end);
+
+/* copy up to len bytes starting at *offset into buf (*offset is moved up to
+ * store_start() if those bytes were dropped, but not past the bytes copied);
+ * returns the number of bytes copied, 0 at the end of the store, -1 on error */
+ssize_t store_read(struct aesd_store *st, char *buf, size_t len, off_t *offset);
+
+/* logical offset of byte `byte` of packet `packet`, packets counted from the
+ * oldest one still held (like AESDCHAR_IOCSEEKTO); stores without an index
+ * scan for it. Returns -1 with errno EINVAL if there is no such byte */
+off_t store_seek(struct aesd_store *st, size_t packet, size_t byte);
+
+/* data file descriptor if the store is a plain append-only file that callers
+ * may append to (and read) directly, -1 otherwise (also with snapshots, whose
+ * generation only moves with store_append) */
+int store_file_fd(struct aesd_store *st);
+
+/* send the whole store content */
+int store_replay(struct aesd_store *st, int sock);
+
+/* close the store; with keep its data stays on disk (only the segment store
+ * removes its own files, OUTFILE is removed by the caller) */
+void store_close(struct aesd_store *st, int keep);
+
+/* backends in their own files */
+struct aesd_store *segment_open(const struct store_config *cfg);
+struct aesd_store *block_open(const struct store_config *cfg);
+
+/* shared replay snapshots: store_send / store_read serve from the newest
+ * max_bytes of the store (0 = SNAP_DEFAULT_BYTES), rebuilt once per generation */
+struct snap_cache *snap_create(size_t max_bytes);
+void snap_advance(struct snap_cache *sc);   // an append started a new generation
+int snap_send(struct snap_cache *sc, struct aesd_store *st, int sock, off_t *offset, off_t end);
+ssize_t snap_read(struct snap_cache *sc, struct aesd_store *st, char *buf, size_t len, off_t *offset);
+void snap_destroy(struct snap_cache *sc);
+
+#endif /* AESD_STORE_H */
@@ -0,0 +1,945 @@
+/**
+ * Socket server - io_uring backend
+ * Author: Martin Mauersberg
+ * Date: 10/12/2023
+ *
+ * Single threaded server loop on io_uring (raw syscalls, no liburing):
+ *  - one multishot accept for the listening socket (and the unix listener, -U)
+ *  - recv into buffers from a registered provided-buffer ring
+ *  - for the plain file store, OUTFILE is a registered file and a completed
+ *    packet run is appended and replayed with one linked chain
+ *    WRITE -> READ -> SEND (further chunks are READ -> SEND chains). WRITEs
+ *    complete in any order, so replays only read up to the committed
+ *    watermark, which moves over the WRITEs in file order as they complete;
+ *    a WRITE with earlier ones still in flight is not linked, its replay
+ *    starts once the watermark has passed it
+ *  - for other stores the append is done with store_append and the replay
+ *    chunks are copied with store_read, only the SEND goes through the ring
+ * Every connection has either one recv or one chain in flight, never both,
+ * so a connection never holds more than one replay chunk and does not read
+ * while its replay is pending. A timeout ticking once a second drops peers
+ * whose replay stopped moving (out_limits.stall_sec).
+ * On hot restart, connections that are between operations once everything is
+ * cancelled (waiting for input, or owing a replay) go to the new process;
+ * packets that arrive while cancelling are stored before they are passed on.
+*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <linux/io_uring.h>
+
+#include <syslog.h>
+
+#include "aesdsocket.h"
+#include "aesd_store.h"
+
+#define URING_ENTRIES 256
+#define URING_BUF_COUNT 256             // provided recv buffers, power of two
+#define URING_BUF_SIZE 8192
+#define URING_BGID 1                    // provided buffer group id
+#define URING_REPLAY_CHUNK (256 * 1024) // bytes per READ -> SEND chain
+#define URING_OUTFILE_INDEX 0           // registered file slot of OUTFILE
+
+/* operation tag kept in the low bits of user_data next to the connection pointer
+ * (for UR_ACCEPT: the listening socket) */
+enum ur_op {
+    UR_ACCEPT = 1,
+    UR_RECV,
+    UR_WRITE,
+    UR_READ,
+    UR_SEND,
+    UR_CANCEL,
+    UR_TICK,
+};
+#define UR_OP_BITS 3
+#define UR_OP_MASK ((1 << UR_OP_BITS) - 1)
+
+struct ur_conn {
+    struct ur_conn *prev, *next;    // list of open connections
+    int fd;
+    int inflight;                   // submitted operations not yet completed
+    int closing;                    // close once inflight drops to 0
+    struct frame_buf packet;        // incomplete packet
+    struct frame_buf wbuf;          // complete packets being appended (file path)
+    char *replay_buf;               // current replay chunk
+    size_t replay_cap;
+    ssize_t replay_read;            // result of the chunk READ
+    off_t replay_off;               // next store offset to send
+    off_t replay_end;               // store end when the replay started
+    off_t owed[HANDOFF_RANGES - 1][2];  // taken over: replays owed after this one
+    int nowed;
+    off_t cursor;                   // tail: where the next replay starts
+    int negotiating;                // first line may still be a command
+    int tail;                       // TAIL_COMMAND: replay only new data
+    int seeking;                    // resolve seek once the WRITE of wbuf completed
+    int deferred;                   // replay once the watermark has passed the WRITE
+    int stored;                     // frame flags of the packets being written
+    off_t write_end;                // end of the WRITE of wbuf in the file
+    int write_done;                 // that WRITE completed
+    int write_queued;               // in the list of WRITEs not yet committed
+    struct ur_conn *write_next;
+    struct frame_seek seek;         // seek command received with the packets
+    uint64_t received;              // stats: when the packet that started the replay came in
+    uint64_t written;               // stats: when the WRITE was submitted
+    uint64_t progress;              // when the replay last moved, 0 while not replaying
+    char addr[INET6_ADDRSTRLEN];
+};
+
+struct uring {
+    int fd;
+    unsigned sq_entries;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_ptr, *cq_ptr;
+    size_t sq_sz, cq_sz, sqes_sz;
+    unsigned to_submit;
+
+    struct io_uring_buf_ring *br;   // provided buffer ring
+    char *bufs;
+    unsigned short br_tail;
+
+    int sockfd;
+    int unix_fd;                    // unix domain listener, or -1
+    int multishot;                  // multishot accept supported
+    struct aesd_store *store;
+    int file_path;                  // OUTFILE registered, use linked chains
+    off_t file_size;                // OUTFILE size including submitted writes
+    off_t committed;                // OUTFILE written without holes, replays stop here
+    struct ur_conn *writes, *writes_tail;   // WRITEs not yet committed, in file order
+    int write_failed;               // a WRITE failed, the watermark stays before it
+    struct __kernel_timespec tick;  // interval of the stalled replay check
+    struct ur_conn *conns;
+};
+
+/************************************************************************************
+ * ----------------------  ring setup and submission  ----------------------
+ * **********************************************************************************/
+static int ur_setup(struct uring *ur)
+{
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    ur->fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &p);
+    if (ur->fd < 0) {
+        return -1;
+    }
+
+    ur->sq_sz = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    ur->cq_sz = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        ur->sq_sz = ur->cq_sz = (ur->sq_sz > ur->cq_sz) ? ur->sq_sz : ur->cq_sz;
+    }
+    ur->sq_ptr = mmap(NULL, ur->sq_sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ur->fd, IORING_OFF_SQ_RING);
+    if (ur->sq_ptr == MAP_FAILED) {
+        return -1;
+    }
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        ur->cq_ptr = ur->sq_ptr;
+    } else {
+        ur->cq_ptr = mmap(NULL, ur->cq_sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ur->fd, IORING_OFF_CQ_RING);
+        if (ur->cq_ptr == MAP_FAILED) {
+            return -1;
+        }
+    }
+    ur->sqes_sz = p.sq_entries * sizeof(struct io_uring_sqe);
+    ur->sqes = mmap(NULL, ur->sqes_sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ur->fd, IORING_OFF_SQES);
+    if (ur->sqes == MAP_FAILED) {
+        return -1;
+    }
+
+    ur->sq_entries = p.sq_entries;
+    ur->sq_head = (unsigned*)((char*) ur->sq_ptr + p.sq_off.head);
+    ur->sq_tail = (unsigned*)((char*) ur->sq_ptr + p.sq_off.tail);
+    ur->sq_mask = (unsigned*)((char*) ur->sq_ptr + p.sq_off.ring_mask);
+    ur->sq_array = (unsigned*)((char*) ur->sq_ptr + p.sq_off.array);
+    ur->cq_head = (unsigned*)((char*) ur->cq_ptr + p.cq_off.head);
+    ur->cq_tail = (unsigned*)((char*) ur->cq_ptr + p.cq_off.tail);
+    ur->cq_mask = (unsigned*)((char*) ur->cq_ptr + p.cq_off.ring_mask);
+    ur->cqes = (struct io_uring_cqe*)((char*) ur->cq_ptr + p.cq_off.cqes);
+    return 0;
+}
+
+/* submit queued entries, optionally waiting for at least one completion */
+static int ur_enter(struct uring *ur, unsigned wait)
+{
+    int rc = syscall(__NR_io_uring_enter, ur->fd, ur->to_submit, wait, wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+    if (rc > 0) {
+        ur->to_submit -= (unsigned) rc < ur->to_submit ? (unsigned) rc : ur->to_submit;
+    }
+    return rc;
+}
+
+/* make sure n entries are free, so a linked chain is never split across submits */
+static void ur_reserve(struct uring *ur, unsigned n)
+{
+    unsigned head = __atomic_load_n(ur->sq_head, __ATOMIC_ACQUIRE);
+    if (*ur->sq_tail - head + n > ur->sq_entries) {
+        ur_enter(ur, 0);
+    }
+}
+
+static struct io_uring_sqe *ur_get_sqe(struct uring *ur, struct ur_conn *conn, enum ur_op op)
+{
+    ur_reserve(ur, 1);
+    unsigned tail = *ur->sq_tail;
+    unsigned idx = tail & *ur->sq_mask;
+    struct io_uring_sqe *sqe = &ur->sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->user_data = (__u64)(uintptr_t) conn | op;
+    ur->sq_array[idx] = idx;
+    // the kernel only looks at the ring in io_uring_enter, so publishing early is fine
+    __atomic_store_n(ur->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ur->to_submit++;
+    if (conn != NULL) {
+        conn->inflight++;
+    }
+    return sqe;
+}
+
+/* hand a provided buffer back to the kernel */
+static void ur_buf_recycle(struct uring *ur, unsigned short bid)
+{
+    struct io_uring_buf *buf = &ur->br->bufs[ur->br_tail & (URING_BUF_COUNT - 1)];
+    buf->addr = (__u64)(uintptr_t)(ur->bufs + (size_t) bid * URING_BUF_SIZE);
+    buf->len = URING_BUF_SIZE;
+    buf->bid = bid;
+    ur->br_tail++;
+    __atomic_store_n(&ur->br->tail, ur->br_tail, __ATOMIC_RELEASE);
+}
+
+static int ur_setup_buffers(struct uring *ur)
+{
+    ur->br = mmap(NULL, URING_BUF_COUNT * sizeof(struct io_uring_buf), PROT_READ | PROT_WRITE,
+                  MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+    if (ur->br == MAP_FAILED) {
+        ur->br = NULL;
+        return -1;
+    }
+    ur->bufs = malloc((size_t) URING_BUF_COUNT * URING_BUF_SIZE);
+    if (ur->bufs == NULL) {
+        return -1;
+    }
+
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (__u64)(uintptr_t) ur->br;
+    reg.ring_entries = URING_BUF_COUNT;
+    reg.bgid = URING_BGID;
+    if (syscall(__NR_io_uring_register, ur->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+        return -1;
+    }
+    for (unsigned i = 0; i < URING_BUF_COUNT; i++) {
+        ur_buf_recycle(ur, i);
+    }
+    return 0;
+}
+
+/************************************************************************************
+ * ----------------------  operations  ----------------------
+ * **********************************************************************************/
+static void ur_arm_accept(struct uring *ur, int sockfd)
+{
+    struct io_uring_sqe *sqe = ur_get_sqe(ur, NULL, UR_ACCEPT);
+    sqe->user_data |= (__u64) sockfd << UR_OP_BITS;
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = sockfd;
+    sqe->accept_flags = SOCK_CLOEXEC;
+    if (ur->multishot) {
+        sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    }
+}
+
+static void ur_arm_recv(struct uring *ur, struct ur_conn *conn)
+{
+    struct io_uring_sqe *sqe = ur_get_sqe(ur, conn, UR_RECV);
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = conn->fd;
+    sqe->len = URING_BUF_SIZE;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BGID;
+}
+
+static void ur_conn_close(struct uring *ur, struct ur_conn *conn)
+{
+    conn->closing = 1;
+    if (conn->inflight > 0) {
+        // wait for the remaining completions (cancelled links) first
+        return;
+    }
+    if (conn->write_queued) {
+        struct ur_conn **link = &ur->writes, *prev = NULL;
+        while (*link != conn) {
+            prev = *link;
+            link = &(*link)->write_next;
+        }
+        *link = conn->write_next;
+        if (ur->writes_tail == conn) {
+            ur->writes_tail = prev;
+        }
+    }
+    close(conn->fd);
+    stats_add(STAT_CLOSED, 1);
+    syslog(LOG_USER, "closed connection from %s\n", conn->addr);
+
+    if (conn->prev != NULL) {
+        conn->prev->next = conn->next;
+    } else {
+        ur->conns = conn->next;
+    }
+    if (conn->next != NULL) {
+        conn->next->prev = conn->prev;
+    }
+    frame_release(&conn->packet);
+    frame_release(&conn->wbuf);
+    free(conn->replay_buf);
+    free(conn);
+}
+
+/* once a second: check for stalled replays */
+static void ur_arm_tick(struct uring *ur)
+{
+    struct io_uring_sqe *sqe = ur_get_sqe(ur, NULL, UR_TICK);
+    sqe->opcode = IORING_OP_TIMEOUT;
+    sqe->fd = -1;
+    sqe->addr = (__u64)(uintptr_t) &ur->tick;
+    sqe->len = 1;
+}
+
+/* drop connections whose replay has not moved for out_limits.stall_sec; shutting
+ * the socket down completes the pending SEND, which then closes the connection */
+static void ur_drop_stalled(struct uring *ur)
+{
+    uint64_t now = stats_now();
+    uint64_t limit = (uint64_t) out_limits.stall_sec * 1000000000;
+    for (struct ur_conn *conn = ur->conns; conn != NULL; conn = conn->next) {
+        if (conn->progress != 0 && !conn->closing && now - conn->progress > limit) {
+            syslog(LOG_ERR, "dropping %s: replay stalled for %d s\n", conn->addr, out_limits.stall_sec);
+            stats_add(STAT_DROPPED, 1);
+            conn->closing = 1;
+            shutdown(conn->fd, SHUT_RDWR);
+        }
+    }
+}
+
+/* queue the next replay chunk, or go back to receiving when the replay is done */
+static void ur_replay_next(struct uring *ur, struct ur_conn *conn)
+{
+    if (conn->replay_off >= conn->replay_end) {
+        // replay finished; keep small buffers for the next round
+        conn->cursor = conn->replay_off;
+        conn->progress = 0;
+        stats_add(STAT_REPLAYS, 1);
+        stats_record(HIST_REPLAY, stats_now() - conn->received);
+        if (conn->nowed > 0) {
+            // taken over owing more than one replay: on to the next
+            conn->replay_off = conn->owed[0][0];
+            conn->replay_end = conn->owed[0][1];
+            memmove(conn->owed, conn->owed + 1, --conn->nowed * sizeof(conn->owed[0]));
+            conn->received = conn->progress = stats_now();
+            ur_replay_next(ur, conn);
+            return;
+        }
+        if (conn->replay_cap > URING_BUF_SIZE) {
+            free(conn->replay_buf);
+            conn->replay_buf = NULL;
+            conn->replay_cap = 0;
+        }
+        ur_arm_recv(ur, conn);
+        return;
+    }
+
+    size_t len = conn->replay_end - conn->replay_off;
+    if (len > URING_REPLAY_CHUNK) {
+        len = URING_REPLAY_CHUNK;
+    }
+    if (len > conn->replay_cap) {
+        char *grown = realloc(conn->replay_buf, len);
+        if (grown == NULL) {
+            ur_conn_close(ur, conn);
+            return;
+        }
+        conn->replay_buf = grown;
+        conn->replay_cap = len;
+    }
+
+    ur_reserve(ur, 2);
+    if (ur->file_path) {
+        struct io_uring_sqe *sqe = ur_get_sqe(ur, conn, UR_READ);
+        sqe->opcode = IORING_OP_READ;
+        sqe->fd = URING_OUTFILE_INDEX;
+        sqe->flags = IOSQE_FIXED_FILE | IOSQE_IO_LINK;
+        sqe->addr = (__u64)(uintptr_t) conn->replay_buf;
+        sqe->len = len;
+        sqe->off = conn->replay_off;
+    } else {
+        ssize_t copied = store_read(ur->store, conn->replay_buf, len, &conn->replay_off);
+        if (copied <= 0) {
+            // nothing left to send (or the store failed): end the replay
+            conn->replay_end = conn->replay_off;
+            if (copied == -1) {
+                ur_conn_close(ur, conn);
+            } else {
+                ur_replay_next(ur, conn);
+            }
+            return;
+        }
+        len = copied;
+    }
+
+    struct io_uring_sqe *sqe = ur_get_sqe(ur, conn, UR_SEND);
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = conn->fd;
+    sqe->addr = (__u64)(uintptr_t) conn->replay_buf;
+    sqe->len = len;
+    sqe->msg_flags = MSG_NOSIGNAL;
+}
+
+/* replay from where the packets (and seek command) just stored ask for */
+static void ur_replay_from(struct uring *ur, struct ur_conn *conn, int stored)
+{
+    off_t from = conn->tail ? conn->cursor : ur->file_path ? 0 : store_start(ur->store);
+    conn->replay_off = frame_replay_from(ur->store, stored, &conn->seek, from);
+    if (conn->replay_off == -1) {
+        conn->progress = 0;
+        ur_arm_recv(ur, conn);
+        return;
+    }
+    conn->replay_end = ur->file_path ? ur->committed : store_end(ur->store);
+    ur_replay_next(ur, conn);
+}
+
+/* move the watermark over the completed WRITEs at the front, and start the
+ * replays that waited for it */
+static void ur_commit(struct uring *ur)
+{
+    while (ur->writes != NULL && ur->writes->write_done) {
+        struct ur_conn *conn = ur->writes;
+        ur->writes = conn->write_next;
+        if (ur->writes == NULL) {
+            ur->writes_tail = NULL;
+        }
+        conn->write_queued = 0;
+        if (!ur->write_failed) {
+            ur->committed = conn->write_end;
+        }
+        if (!conn->deferred) {
+            continue;
+        }
+        conn->deferred = 0;
+        if (conn->closing || ur->write_failed) {
+            ur_conn_close(ur, conn);
+        } else if (conn->seeking) {
+            conn->seeking = 0;
+            ur_replay_from(ur, conn, FRAME_STORED | FRAME_SEEK);
+        } else {
+            ur_replay_from(ur, conn, conn->stored);
+        }
+    }
+}
+
+/* start a replay after a run of complete packets (or a seek command) was received */
+static void ur_replay_start(struct uring *ur, struct ur_conn *conn, int stored)
+{
+    conn->progress = stats_now();
+    if (!ur->file_path || conn->wbuf.len == 0) {
+        // stored already, or a seek without new packets: nothing to write
+        ur_replay_from(ur, conn, stored);
+        return;
+    }
+
+    if (ur->write_failed) {
+        syslog(LOG_ERR, "failed to store data from %s: data file failed\n", conn->addr);
+        ur_conn_close(ur, conn);
+        return;
+    }
+
+    // WRITE the packets, then the first READ -> SEND chunk linked behind it.
+    // With earlier WRITEs still in flight the file may have holes before ours,
+    // and a seek can only be resolved once the packets are in the file: those
+    // replays wait until the watermark has passed the WRITE instead
+    conn->seeking = (stored & FRAME_SEEK) != 0;
+    conn->deferred = conn->seeking || ur->writes != NULL;
+    conn->stored = stored;
+    ur_reserve(ur, 3);
+    struct io_uring_sqe *sqe = ur_get_sqe(ur, conn, UR_WRITE);
+    sqe->opcode = IORING_OP_WRITE;
+    sqe->fd = URING_OUTFILE_INDEX;
+    sqe->flags = IOSQE_FIXED_FILE | (conn->deferred ? 0 : IOSQE_IO_LINK);
+    sqe->addr = (__u64)(uintptr_t) conn->wbuf.data;
+    sqe->len = conn->wbuf.len;
+    sqe->off = ur->file_size;
+    ur->file_size += conn->wbuf.len;
+    conn->written = stats_now();
+
+    conn->write_end = ur->file_size;
+    conn->write_done = 0;
+    conn->write_queued = 1;
+    conn->write_next = NULL;
+    if (ur->writes_tail != NULL) {
+        ur->writes_tail->write_next = conn;
+    } else {
+        ur->writes = conn;
+    }
+    ur->writes_tail = conn;
+
+    if (!conn->deferred) {
+        // the watermark is at the start of our WRITE, which the READ waits for
+        conn->replay_off = conn->tail ? conn->cursor : 0;
+        conn->replay_end = conn->write_end;
+        ur_replay_next(ur, conn);
+    }
+}
+
+/* track a new connection; NULL (and fd closed) if out of memory */
+static struct ur_conn *ur_conn_new(struct uring *ur, int fd)
+{
+    stats_add(STAT_ACCEPTED, 1);
+    struct ur_conn *conn = calloc(1, sizeof(struct ur_conn));
+    if (conn == NULL) {
+        syslog(LOG_ERR, "server: out of memory for connection\n");
+        close(fd);
+        stats_add(STAT_CLOSED, 1);
+        return NULL;
+    }
+    conn->fd = fd;
+    conn->negotiating = 1;
+
+    conn->next = ur->conns;
+    if (ur->conns != NULL) {
+        ur->conns->prev = conn;
+    }
+    ur->conns = conn;
+    return conn;
+}
+
+static struct ur_conn *ur_conn_accepted(struct uring *ur, int fd)
+{
+    struct ur_conn *conn = ur_conn_new(ur, fd);
+    if (conn == NULL) {
+        return NULL;
+    }
+    struct sockaddr_storage sin_addr;
+    socklen_t sin_size = sizeof(sin_addr);
+    if (getpeername(fd, (struct sockaddr*)&sin_addr, &sin_size) == 0) {
+        peer_name((struct sockaddr*)&sin_addr, conn->addr, sizeof(conn->addr));
+    }
+    syslog(LOG_USER, "accepted connection from %s\n", conn->addr);
+    return conn;
+}
+
+static void ur_conn_open(struct uring *ur, int fd)
+{
+    struct ur_conn *conn = ur_conn_accepted(ur, fd);
+    if (conn != NULL) {
+        ur_arm_recv(ur, conn);
+    }
+}
+
+/* carry on with a connection taken over from the previous process */
+static void ur_conn_adopt(struct uring *ur, struct handoff_conn *state)
+{
+    struct ur_conn *conn = ur_conn_new(ur, state->fd);
+    if (conn == NULL) {
+        return;
+    }
+    handoff_fit(state, ur->file_path ? 0 : store_start(ur->store), ur->file_path ? ur->committed : store_end(ur->store));
+    conn->negotiating = state->negotiating;
+    conn->tail = state->tail;
+    conn->cursor = state->cursor;
+    memcpy(conn->addr, state->addr, sizeof(conn->addr));
+    // the other modes leave their sockets O_NONBLOCK, which would make our RECV / SEND fail with EAGAIN
+    int flags = fcntl(conn->fd, F_GETFL, 0);
+    if (flags == -1 || fcntl(conn->fd, F_SETFL, flags & ~O_NONBLOCK) == -1 ||
+        frame_restore(&conn->packet, state->pending, state->pending_len) == -1) {
+        syslog(LOG_ERR, "server: could not take over connection from %s\n", conn->addr);
+        ur_conn_close(ur, conn);
+        return;
+    }
+    if (state->nout == 0) {
+        ur_arm_recv(ur, conn);
+        return;
+    }
+    conn->replay_off = state->out[0][0];
+    conn->replay_end = state->out[0][1];
+    conn->nowed = state->nout - 1;
+    memcpy(conn->owed, state->out + 1, conn->nowed * sizeof(conn->owed[0]));
+    conn->received = conn->progress = stats_now();
+    ur_replay_next(ur, conn);
+}
+
+/************************************************************************************
+ * ----------------------  completions  ----------------------
+ * **********************************************************************************/
+/* first line of a connection: a TAIL_COMMAND is taken off the data */
+static void ur_negotiate(struct uring *ur, struct ur_conn *conn, const char **data, size_t *len)
+{
+    if (!conn->negotiating) {
+        return;
+    }
+    enum frame_cmd cmd = frame_first_line(&conn->packet, data, len);
+    conn->negotiating = (cmd == FRAME_CMD_PENDING);
+    if (cmd == FRAME_CMD_TAIL) {
+        conn->tail = 1;
+        conn->cursor = ur->file_path ? ur->committed : store_end(ur->store);
+        syslog(LOG_USER, "tail replay for %s\n", conn->addr);
+    }
+}
+
+static void ur_complete(struct uring *ur, struct io_uring_cqe *cqe)
+{
+    enum ur_op op = cqe->user_data & UR_OP_MASK;
+    struct ur_conn *conn = (struct ur_conn*)(uintptr_t)(cqe->user_data & ~(__u64) UR_OP_MASK);
+    int res = cqe->res;
+
+    if (op == UR_TICK) {
+        ur_drop_stalled(ur);
+        ur_arm_tick(ur);
+        return;
+    }
+    if (op == UR_ACCEPT) {
+        if (res >= 0) {
+            ur_conn_open(ur, res);
+        } else if (res == -EINVAL && ur->multishot) {
+            // kernel without multishot accept: one accept per completion
+            ur->multishot = 0;
+        } else if (res != -EINTR && res != -ECONNABORTED) {
+            syslog(LOG_ERR, "server: failed to accept connection: %s\n", strerror(-res));
+        }
+        if (!(cqe->flags & IORING_CQE_F_MORE)) {
+            ur_arm_accept(ur, cqe->user_data >> UR_OP_BITS);
+        }
+        return;
+    }
+
+    conn->inflight--;
+    if (conn->closing) {
+        ur_conn_close(ur, conn);
+        return;
+    }
+
+    switch (op) {
+        case UR_RECV: {
+            if (res == -ENOBUFS) {
+                // all provided buffers busy, try again
+                ur_arm_recv(ur, conn);
+                break;
+            }
+            if (res <= 0) {
+                ur_conn_close(ur, conn);
+                break;
+            }
+            conn->received = stats_now();
+            stats_add(STAT_BYTES_IN, res);
+            unsigned short bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+            const char *data = ur->bufs + (size_t) bid * URING_BUF_SIZE;
+            size_t len = res;
+            ur_negotiate(ur, conn, &data, &len);
+            int stored;
+            if (ur->file_path) {
+                stored = frame_collect(&conn->packet, data, len, &conn->wbuf, &conn->seek);
+            } else {
+                stored = frame_input(&conn->packet, ur->store, data, len, &conn->seek);
+            }
+            ur_buf_recycle(ur, bid);
+
+            if (stored == -1) {
+                syslog(LOG_ERR, "failed to store data from %s\n", conn->addr);
+                ur_conn_close(ur, conn);
+            } else if (stored > 0) {
+                ur_replay_start(ur, conn, stored);
+            } else {
+                ur_arm_recv(ur, conn);
+            }
+            break;
+        }
+        case UR_WRITE:
+            stats_record(HIST_APPEND, stats_now() - conn->written);
+            if (res < 0 || (size_t) res != conn->wbuf.len) {
+                // a hole from here on: stop the watermark before it for good
+                syslog(LOG_ERR, "failed to append data from %s\n", conn->addr);
+                ur->write_failed = 1;
+                conn->closing = 1;   // the linked READ / SEND come back cancelled
+            }
+            conn->wbuf.len = 0;
+            conn->write_done = 1;
+            ur_commit(ur);
+            break;
+        case UR_READ:
+            conn->replay_read = res;
+            if (res < 0 && res != -ECANCELED) {
+                conn->closing = 1;
+            }
+            break;
+        case UR_SEND:
+            if (res == -ECANCELED) {
+                // the READ came back short: retry from the same offset unless the file ended
+                if (conn->replay_read == 0) {
+                    conn->replay_end = conn->replay_off;
+                }
+                ur_replay_next(ur, conn);
+            } else if (res < 0) {
+                ur_conn_close(ur, conn);
+            } else {
+                // a partial send simply continues at the new offset
+                conn->replay_off += res;
+                conn->progress = stats_now();
+                stats_add(STAT_BYTES_OUT, res);
+                ur_replay_next(ur, conn);
+            }
+            break;
+        default:
+            break;
+    }
+}
+
+/************************************************************************************
+ * ----------------------  run io_uring loop  ----------------------
+ * **********************************************************************************/
+/* data received while cancelling: store the complete packets right away, the
+ * connection is idle while its RECV is armed and the ring no longer runs a
+ * WRITE for it. Their replay and the incomplete rest go to the new process
+ * like any other; -1 if the data cannot be kept */
+static int ur_recv_cancelled(struct uring *ur, struct ur_conn *conn, const char *data, size_t len)
+{
+    ur_negotiate(ur, conn, &data, &len);
+    int stored;
+    if (ur->file_path) {
+        stored = frame_collect(&conn->packet, data, len, &conn->wbuf, &conn->seek);
+        if (stored > 0 && conn->wbuf.len > 0) {
+            // written in place of the WRITE, only behind a watermark without holes
+            if (ur->writes != NULL || ur->write_failed ||
+                pwrite(store_file_fd(ur->store), conn->wbuf.data, conn->wbuf.len, ur->file_size) != (ssize_t) conn->wbuf.len) {
+                return -1;
+            }
+            ur->file_size += conn->wbuf.len;
+            ur->committed = ur->file_size;
+            conn->wbuf.len = 0;
+        }
+    } else {
+        stored = frame_input(&conn->packet, ur->store, data, len, &conn->seek);
+    }
+    if (stored == -1) {
+        return -1;
+    }
+    if (stored > 0) {
+        off_t from = conn->tail ? conn->cursor : ur->file_path ? 0 : store_start(ur->store);
+        off_t offset = frame_replay_from(ur->store, stored, &conn->seek, from);
+        if (offset != -1) {
+            conn->replay_off = offset;
+            conn->replay_end = ur->file_path ? ur->committed : store_end(ur->store);
+        }
+    }
+    return 0;
+}
+
+/* completion while cancelling: keep track of where each connection stands,
+ * so the ones left in a consistent state can be handed over */
+static void ur_complete_cancelled(struct uring *ur, struct io_uring_cqe *cqe, int *cancelled)
+{
+    enum ur_op op = cqe->user_data & UR_OP_MASK;
+    struct ur_conn *conn = (struct ur_conn*)(uintptr_t)(cqe->user_data & ~(__u64) UR_OP_MASK);
+    int res = cqe->res;
+
+    if (op == UR_CANCEL) {
+        *cancelled = 1;
+        return;
+    }
+    if (op == UR_ACCEPT) {
+        if (res >= 0) {
+            // accepted just now, nothing received yet
+            ur_conn_accepted(ur, res);
+        }
+        return;
+    }
+    if (conn == NULL) {
+        return;
+    }
+
+    conn->inflight--;
+    if (res == -ECANCELED) {
+        return;
+    }
+    if (op == UR_SEND && res > 0) {
+        conn->replay_off += res;
+        stats_add(STAT_BYTES_OUT, res);
+    } else if (op == UR_WRITE && res >= 0 && (size_t) res == conn->wbuf.len && !conn->seeking) {
+        // packets are in the file, the replay behind them is owed
+        conn->wbuf.len = 0;
+    } else if (op == UR_WRITE) {
+        ur->write_failed = 1;
+        conn->closing = 1;
+    } else if (op == UR_RECV && res > 0) {
+        stats_add(STAT_BYTES_IN, res);
+        unsigned short bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+        if (ur_recv_cancelled(ur, conn, ur->bufs + (size_t) bid * URING_BUF_SIZE, res) == -1) {
+            syslog(LOG_ERR, "failed to store data from %s\n", conn->addr);
+            conn->closing = 1;
+        }
+        ur_buf_recycle(ur, bid);
+    } else if (op != UR_READ) {
+        // end of input, or a failure we cannot carry over
+        conn->closing = 1;
+    }
+}
+
+/* cancel everything in flight; the ring's requests hold references to the
+ * listening socket and connections that would otherwise only be dropped by
+ * the kernel's asynchronous ring teardown (keeping the port bound) */
+static void ur_cancel_all(struct uring *ur)
+{
+    struct io_uring_sqe *sqe = ur_get_sqe(ur, NULL, UR_CANCEL);
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->cancel_flags = IORING_ASYNC_CANCEL_ANY;
+
+    int cancelled = 0;
+    while (!cancelled) {
+        if (ur_enter(ur, 1) < 0 && errno != EINTR) {
+            break;
+        }
+        unsigned head = *ur->cq_head;
+        unsigned tail = __atomic_load_n(ur->cq_tail, __ATOMIC_ACQUIRE);
+        while (head != tail) {
+            ur_complete_cancelled(ur, &ur->cqes[head & *ur->cq_mask], &cancelled);
+            head++;
+        }
+        __atomic_store_n(ur->cq_head, head, __ATOMIC_RELEASE);
+    }
+}
+
+/* hot restart: pass a connection to the new process if one is taking over
+ * and the connection is between operations; returns -1 if not passed */
+static int ur_conn_pass(struct uring *ur, struct ur_conn *conn)
+{
+    if (conn->inflight > 0 || conn->closing || conn->wbuf.len > 0 || conn->seeking ||
+        (conn->deferred && ur->write_failed)) {
+        return -1;
+    }
+    struct handoff_conn state = { .fd = conn->fd, .negotiating = conn->negotiating, .tail = conn->tail,
+                                  .cursor = conn->cursor, .pending = conn->packet.data, .pending_len = conn->packet.len };
+    if (conn->deferred) {
+        // written, but its replay was waiting for an earlier WRITE
+        conn->replay_off = conn->tail ? conn->cursor : 0;
+        conn->replay_end = conn->write_end;
+    }
+    if (conn->replay_off < conn->replay_end) {
+        state.out[state.nout][0] = conn->replay_off;
+        state.out[state.nout++][1] = conn->replay_end;
+    }
+    for (int i = 0; i < conn->nowed; i++) {
+        state.out[state.nout][0] = conn->owed[i][0];
+        state.out[state.nout++][1] = conn->owed[i][1];
+    }
+    memcpy(state.addr, conn->addr, sizeof(state.addr));
+    return handoff_pass(&state);
+}
+
+static void ur_teardown(struct uring *ur)
+{
+    while (ur->conns != NULL) {
+        struct ur_conn *conn = ur->conns;
+        ur->conns = conn->next;
+        if (ur_conn_pass(ur, conn) == -1) {
+            stats_add(STAT_CLOSED, 1);
+            syslog(LOG_USER, "closed connection from %s\n", conn->addr);
+        }
+        close(conn->fd);
+        frame_release(&conn->packet);
+        frame_release(&conn->wbuf);
+        free(conn->replay_buf);
+        free(conn);
+    }
+    if (ur->fd >= 0) {
+        close(ur->fd);
+    }
+    if (ur->sqes != NULL && ur->sqes != MAP_FAILED) {
+        munmap(ur->sqes, ur->sqes_sz);
+    }
+    if (ur->cq_ptr != NULL && ur->cq_ptr != MAP_FAILED && ur->cq_ptr != ur->sq_ptr) {
+        munmap(ur->cq_ptr, ur->cq_sz);
+    }
+    if (ur->sq_ptr != NULL && ur->sq_ptr != MAP_FAILED) {
+        munmap(ur->sq_ptr, ur->sq_sz);
+    }
+    if (ur->br != NULL) {
+        munmap(ur->br, URING_BUF_COUNT * sizeof(struct io_uring_buf));
+    }
+    free(ur->bufs);
+}
+
+int run_uring_loop(int sockfd, int unix_fd, struct aesd_store *store, struct handoff_conn *adopted)
+{
+    struct uring ur;
+    memset(&ur, 0, sizeof(ur));
+    ur.fd = -1;
+    ur.sockfd = sockfd;
+    ur.unix_fd = unix_fd;
+    ur.store = store;
+    ur.multishot = 1;
+    ur.tick.tv_sec = 1;
+
+    if (ur_setup(&ur) == -1 || ur_setup_buffers(&ur) == -1) {
+        int err = errno;
+        syslog(LOG_ERR, "io_uring not available: %s\n", strerror(err));
+        ur_teardown(&ur);
+        errno = err;
+        return -1;
+    }
+
+    // plain file store: register OUTFILE and do the file I/O in the ring as well
+    int outfd = store_file_fd(store);
+    if (outfd != -1 && syscall(__NR_io_uring_register, ur.fd, IORING_REGISTER_FILES, &outfd, 1) == 0) {
+        ur.file_path = 1;
+        ur.file_size = store_end(store);
+        ur.committed = ur.file_size;
+    }
+    syslog(LOG_USER, "running io_uring loop (%s)\n", ur.file_path ? "registered data file" : "store copies");
+
+    ur_arm_accept(&ur, ur.sockfd);
+    if (ur.unix_fd != -1) {
+        ur_arm_accept(&ur, ur.unix_fd);
+    }
+    if (out_limits.stall_sec > 0) {
+        ur_arm_tick(&ur);
+    }
+    while (adopted != NULL) {
+        struct handoff_conn *state = adopted;
+        adopted = state->next;
+        ur_conn_adopt(&ur, state);
+        handoff_free(state);
+    }
+
+    while (done == 0) {
+        if (ur_enter(&ur, 1) < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+            syslog(LOG_ERR, "io_uring_enter: %s\n", strerror(errno));
+            break;
+        }
+
+        unsigned head = *ur.cq_head;
+        unsigned tail = __atomic_load_n(ur.cq_tail, __ATOMIC_ACQUIRE);
+        while (head != tail) {
+            ur_complete(&ur, &ur.cqes[head & *ur.cq_mask]);
+            head++;
+        }
+        __atomic_store_n(ur.cq_head, head, __ATOMIC_RELEASE);
+    }
+
+    ur_cancel_all(&ur);
+    ur_teardown(&ur);
+    return 0;
+}
@@ -0,0 +1,315 @@
+/**
+ * Socket server - group commit append log
+ * Author: Martin Mauersberg
+ * Date: 10/12/2023
+ *
+ * One writer thread owns all appends to the data file. Connection handlers
+ * push their packets onto a lock-free multi producer / single consumer queue
+ * (intrusive, Vyukov style) and wait until the writer reports them written.
+ * The writer drains whatever has queued up and writes it with one writev, so
+ * every packet lands in the file in one piece and under load many packets
+ * share one syscall. Optionally the writer also calls fdatasync, either
+ * before acknowledging each batch (sync interval 0) or at most once per
+ * interval in the background. A failed sync fails the batch it covers; a
+ * failed background sync fails the next batch instead, whose packets are
+ * the first ones acknowledged after it.
+*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <time.h>
+#include <sched.h>
+
+#include <sys/uio.h>
+#include <sys/eventfd.h>
+
+#include <syslog.h>
+#include <pthread.h>
+
+#include "aesdsocket.h"
+
+#define WLOG_BATCH_MAX 64   // packets per writev (well below IOV_MAX)
+
+/* one queued append, lives on the stack of the waiting handler */
+struct wlog_node {
+    _Atomic(struct wlog_node*) next;
+    const char *data;
+    size_t len;
+    atomic_int done;        // 1 = written, -1 = write failed
+};
+
+struct aesd_wlog {
+    int fd;                             // data file (O_APPEND), not owned
+    int sync_ms;                        // -1 no sync, 0 sync every batch, >0 sync interval
+    int sync_failed;                    // a background sync failed, not reported yet (writer only)
+    pthread_t thread;
+
+    _Atomic(struct wlog_node*) head;    // producers push here
+    struct wlog_node *tail;             // consumer pops here
+    struct wlog_node stub;
+
+    int wake_fd;                        // eventfd to wake the writer
+    atomic_int wake_pending;            // a wakeup is already on its way
+    atomic_int stop;
+
+    pthread_mutex_t done_lock;          // handlers wait here for their packet
+    pthread_cond_t done_cond;
+};
+
+/************************************************************************************
+ * ----------------------  MPSC queue  ----------------------
+ * **********************************************************************************/
+static void wlog_push(struct aesd_wlog *wl, struct wlog_node *node)
+{
+    atomic_store(&node->next, NULL);
+    struct wlog_node *prev = atomic_exchange(&wl->head, node);
+    atomic_store(&prev->next, node);
+}
+
+/* pop the oldest node; NULL if empty or a producer is between its two steps */
+static struct wlog_node *wlog_pop(struct aesd_wlog *wl)
+{
+    struct wlog_node *tail = wl->tail;
+    struct wlog_node *next = atomic_load(&tail->next);
+
+    if (tail == &wl->stub) {
+        if (next == NULL) {
+            return NULL;
+        }
+        wl->tail = next;
+        tail = next;
+        next = atomic_load(&tail->next);
+    }
+    if (next != NULL) {
+        wl->tail = next;
+        return tail;
+    }
+    if (tail != atomic_load(&wl->head)) {
+        return NULL;
+    }
+    // tail is the last real node: put the stub behind it so it can be unlinked
+    wlog_push(wl, &wl->stub);
+    next = atomic_load(&tail->next);
+    if (next != NULL) {
+        wl->tail = next;
+        return tail;
+    }
+    return NULL;
+}
+
+static int wlog_empty(struct aesd_wlog *wl)
+{
+    return wl->tail == &wl->stub && atomic_load(&wl->head) == &wl->stub;
+}
+
+/************************************************************************************
+ * ----------------------  writer thread  ----------------------
+ * **********************************************************************************/
+static long now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* writev the whole batch, continuing after partial writes */
+static int wlog_write_batch(struct aesd_wlog *wl, struct iovec *iov, int n)
+{
+    while (n > 0) {
+        ssize_t written = writev(wl->fd, iov, n);
+        if (written == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        while (n > 0 && (size_t) written >= iov->iov_len) {
+            written -= iov->iov_len;
+            iov++;
+            n--;
+        }
+        if (n > 0) {
+            iov->iov_base = (char*) iov->iov_base + written;
+            iov->iov_len -= written;
+        }
+    }
+    return 0;
+}
+
+/* fdatasync the data file; a failure is logged and returned */
+static int wlog_sync(struct aesd_wlog *wl)
+{
+    if (fdatasync(wl->fd) == -1) {
+        syslog(LOG_ERR, "append log sync failed: %s\n", strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+static void *wlog_writer(void *wlog_info)
+{
+    struct aesd_wlog *wl = (struct aesd_wlog*) wlog_info;
+    struct wlog_node *batch[WLOG_BATCH_MAX];
+    struct iovec iov[WLOG_BATCH_MAX];
+    int dirty = 0;              // written but not yet synced
+    long last_sync = now_ms();
+
+    while (1) {
+        int n = 0;
+        struct wlog_node *node;
+        while (n < WLOG_BATCH_MAX && (node = wlog_pop(wl)) != NULL) {
+            batch[n] = node;
+            iov[n].iov_base = (void*) node->data;
+            iov[n].iov_len = node->len;
+            n++;
+        }
+
+        if (n > 0) {
+            int rc = wlog_write_batch(wl, iov, n);
+            if (rc == -1) {
+                syslog(LOG_ERR, "append log write failed: %s\n", strerror(errno));
+            }
+            dirty = 1;
+            if (rc == 0 && wl->sync_ms == 0) {
+                // group commit: one fdatasync covers the whole batch
+                rc = wlog_sync(wl);
+                dirty = 0;
+                last_sync = now_ms();
+            }
+            if (wl->sync_failed) {
+                rc = -1;
+                wl->sync_failed = 0;
+            }
+
+            // report completion; a handler may return (and drop its node) right after
+            for (int i = 0; i < n; i++) {
+                atomic_store(&batch[i]->done, rc == 0 ? 1 : -1);
+            }
+            pthread_mutex_lock(&wl->done_lock);
+            pthread_cond_broadcast(&wl->done_cond);
+            pthread_mutex_unlock(&wl->done_lock);
+            continue;
+        }
+
+        if (!wlog_empty(wl)) {
+            // a producer is halfway through a push
+            sched_yield();
+            continue;
+        }
+
+        if (dirty && wl->sync_ms > 0 && now_ms() - last_sync >= wl->sync_ms) {
+            wl->sync_failed = wlog_sync(wl) == -1;
+            dirty = 0;
+            last_sync = now_ms();
+        }
+
+        if (atomic_load(&wl->stop)) {
+            break;
+        }
+
+        // queue is empty: arm the wakeup and check once more before sleeping
+        atomic_store(&wl->wake_pending, 0);
+        if (!wlog_empty(wl) || atomic_load(&wl->stop)) {
+            continue;
+        }
+        int timeout = -1;
+        if (dirty && wl->sync_ms > 0) {
+            timeout = wl->sync_ms - (now_ms() - last_sync);
+            timeout = timeout > 0 ? timeout : 0;
+        }
+        struct pollfd pfd = { .fd = wl->wake_fd, .events = POLLIN };
+        if (poll(&pfd, 1, timeout) > 0) {
+            uint64_t count;
+            if (read(wl->wake_fd, &count, sizeof(count)) == -1 && errno != EAGAIN) {
+                syslog(LOG_ERR, "append log wakeup failed: %s\n", strerror(errno));
+            }
+        }
+    }
+
+    if (dirty && wl->sync_ms >= 0) {
+        wlog_sync(wl);
+    }
+    return 0;
+}
+
+static void wlog_wake(struct aesd_wlog *wl)
+{
+    if (atomic_exchange(&wl->wake_pending, 1) == 0) {
+        uint64_t one = 1;
+        if (write(wl->wake_fd, &one, sizeof(one)) == -1) {
+            syslog(LOG_ERR, "append log wakeup failed: %s\n", strerror(errno));
+        }
+    }
+}
+
+/************************************************************************************
+ * ----------------------  append log API  ----------------------
+ * **********************************************************************************/
+struct aesd_wlog *wlog_open(int fd, int sync_ms)
+{
+    struct aesd_wlog *wl = calloc(1, sizeof(struct aesd_wlog));
+    if (wl == NULL) {
+        return NULL;
+    }
+    wl->fd = fd;
+    wl->sync_ms = sync_ms;
+    atomic_init(&wl->stub.next, NULL);
+    atomic_init(&wl->head, &wl->stub);
+    wl->tail = &wl->stub;
+    atomic_init(&wl->wake_pending, 0);
+    atomic_init(&wl->stop, 0);
+    pthread_mutex_init(&wl->done_lock, NULL);
+    pthread_cond_init(&wl->done_cond, NULL);
+
+    wl->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (wl->wake_fd == -1) {
+        free(wl);
+        return NULL;
+    }
+    if (create_worker_thread(&wl->thread, wlog_writer, wl)) {
+        syslog(LOG_ERR, "could not create append log writer thread\n");
+        close(wl->wake_fd);
+        free(wl);
+        return NULL;
+    }
+    return wl;
+}
+
+int wlog_append(struct aesd_wlog *wl, const char *data, size_t len)
+{
+    struct wlog_node node;
+    node.data = data;
+    node.len = len;
+    atomic_init(&node.done, 0);
+
+    wlog_push(wl, &node);
+    wlog_wake(wl);
+
+    // wait until the writer has written (and, with sync interval 0, synced) our packet
+    pthread_mutex_lock(&wl->done_lock);
+    while (atomic_load(&node.done) == 0) {
+        pthread_cond_wait(&wl->done_cond, &wl->done_lock);
+    }
+    pthread_mutex_unlock(&wl->done_lock);
+
+    return atomic_load(&node.done) == 1 ? 0 : -1;
+}
+
+void wlog_close(struct aesd_wlog *wl)
+{
+    atomic_store(&wl->stop, 1);
+    atomic_store(&wl->wake_pending, 0);
+    wlog_wake(wl);
+    pthread_join(wl->thread, NULL);
+
+    close(wl->wake_fd);
+    pthread_cond_destroy(&wl->done_cond);
+    pthread_mutex_destroy(&wl->done_lock);
+    free(wl);
+}
@@ -0,0 +1,691 @@
+/**
+ * Socket server - load generator and latency benchmark
+ * Author: Martin Mauersberg
+ * Date: 10/12/2023
+ *
+ * Opens N connections to aesdsocket on localhost, each sending numbered
+ * packets of a fixed size (optionally at a fixed rate) and waiting for the
+ * replay that contains the packet just sent. Every line received is checked
+ * to be a well formed packet of the expected size; the replay of a packet
+ * counts as complete once the packet itself has come back, which also works
+ * when other connections append in between. Latency is measured from the
+ * (scheduled) send time to that point, so a slow server cannot hide behind a
+ * rate limited client. Results go to stdout as text or JSON (-j).
+ * With -U the connections go to the server's unix socket instead of TCP,
+ * run both to compare the two transports.
+ *
+ * Reader connections (-R) only replay: while the writers run they keep
+ * seeking to the first packet and check that each writer's packets show up
+ * whole and in order, without gaps, which catches a replay reading into a
+ * packet still being appended or past one not yet written.
+ *
+ * Replay mode (-F MB) measures how fast the server replays its data file: it
+ * fills OUTFILE to MB megabytes with large packets, then sends a few packets
+ * of -s bytes and times each full replay. The replay is complete once the
+ * whole file has come back, so it needs the file store and no other client.
+ * It uses only the plain protocol and can be run against older servers too.
+*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+#include <poll.h>
+#include <stdatomic.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+#include <netdb.h>
+
+#include <pthread.h>
+
+#include "aesdsocket.h"
+
+#define BENCH_HEADER_LEN 24             // "rrrrrr-cccccc-sssssssss-": run, connection and sequence number
+#define BENCH_MIN_SIZE (BENCH_HEADER_LEN + 1)
+#define BENCH_RECV_SIZE 65536
+#define BENCH_IDLE_MS 20                // a reader's replay is over once the connection is quiet this long
+#define BENCH_FILL_PACKET (1024 * 1024) // -F: bytes per send filling the data file
+#define BENCH_REPLAY_ROUNDS 3           // -F: timed replays
+
+/* benchmark parameters (from the command line) */
+struct bench_config {
+    const char *port;
+    const char *unix_path;  // -U connect to this unix socket instead ("@name": abstract namespace)
+    int connections;        // -c
+    int packets;            // -n per connection
+    size_t size;            // -s bytes per packet including the newline
+    double rate;            // -r packets per second per connection, 0 = as fast as possible
+    int tail;               // -t negotiate tail replay
+    int readers;            // -R replay only connections checking packet order
+    int json;               // -j
+    size_t fill_mb;         // -F replay mode: fill OUTFILE to this many MB and time its replay
+    int run;                // tells our packets apart from those of earlier runs in the store
+};
+
+/* per connection state and results */
+struct bench_conn {
+    pthread_t thread;
+    const struct bench_config *cfg;
+    int id;
+    uint64_t *latency;      // ns, one per packet sent
+    int sent;
+    int received;           // own packets seen back
+    uint64_t invalid;       // malformed lines
+    uint64_t bytes_in;
+    uint64_t bytes_out;
+    int failed;             // connect / send / recv error
+    uint64_t passes;        // reader: replays requested
+    uint64_t order_errors;  // reader: a writer's packet out of order or missing
+    char line[BENCH_RECV_SIZE];     // line carried across reads
+    size_t line_len;
+};
+
+static pthread_barrier_t start_barrier;
+static atomic_int writers_done;
+
+/************************************************************************************
+ * ----------------------  helpers  ----------------------
+ * **********************************************************************************/
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void sleep_until(uint64_t ns)
+{
+    struct timespec ts = { .tv_sec = ns / 1000000000, .tv_nsec = ns % 1000000000 };
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR) {
+    }
+}
+
+static int bench_connect_unix(const char *path)
+{
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    size_t len = strlen(path);
+    if (len == 0 || len >= sizeof(addr.sun_path)) {
+        return -1;
+    }
+    memcpy(addr.sun_path, path, len);
+    socklen_t addrlen = offsetof(struct sockaddr_un, sun_path) + len + 1;
+    if (path[0] == '@') {
+        addr.sun_path[0] = '\0';
+        addrlen--;
+    }
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd != -1 && connect(fd, (struct sockaddr*) &addr, addrlen) == -1) {
+        close(fd);
+        fd = -1;
+    }
+    return fd;
+}
+
+static int bench_connect(const struct bench_config *cfg)
+{
+    if (cfg->unix_path != NULL) {
+        return bench_connect_unix(cfg->unix_path);
+    }
+
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+
+    struct addrinfo *servinfo;
+    if (getaddrinfo("localhost", cfg->port, &hints, &servinfo) != 0) {
+        return -1;
+    }
+    int fd = -1;
+    for (struct addrinfo *p = servinfo; p != NULL; p = p->ai_next) {
+        fd = socket(p->ai_family, p->ai_socktype, p->ai_protocol);
+        if (fd == -1) {
+            continue;
+        }
+        if (connect(fd, p->ai_addr, p->ai_addrlen) == 0) {
+            break;
+        }
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(servinfo);
+    return fd;
+}
+
+static int send_all(int fd, const char *data, size_t len)
+{
+    while (len > 0) {
+        ssize_t sent = send(fd, data, len, MSG_NOSIGNAL);
+        if (sent == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        data += sent;
+        len -= sent;
+    }
+    return 0;
+}
+
+/* build packet seq of connection id: header, 'x' padding, newline */
+static void make_packet(char *pkt, size_t size, int run, int id, int seq)
+{
+    char header[BENCH_HEADER_LEN + 1];
+    // each field wraps at its width so the header keeps its length
+    snprintf(header, sizeof(header), "%06u-%06u-%09u-",
+             (unsigned) run % 1000000, (unsigned) id % 1000000, (unsigned) seq % 1000000000);
+    memcpy(pkt, header, BENCH_HEADER_LEN);
+    memset(pkt + BENCH_HEADER_LEN, 'x', size - BENCH_HEADER_LEN - 1);
+    pkt[size - 1] = '\n';
+}
+
+/* is line any well formed benchmark packet (earlier runs may have used other sizes) */
+static int valid_line(const char *line, size_t len)
+{
+    int valid = (len >= BENCH_MIN_SIZE && line[6] == '-' && line[13] == '-' && line[23] == '-');
+    for (size_t i = 0; valid && i < BENCH_HEADER_LEN - 1; i++) {
+        valid = (i == 6) || (i == 13) || (line[i] >= '0' && line[i] <= '9');
+    }
+    for (size_t i = BENCH_HEADER_LEN; valid && i < len - 1; i++) {
+        valid = (line[i] == 'x');
+    }
+    return valid;
+}
+
+/* check one replayed line; returns its sequence number if it is ours, -1 otherwise */
+static int check_line(struct bench_conn *conn, const char *line, size_t len)
+{
+    if (!valid_line(line, len)) {
+        conn->invalid++;
+        return -1;
+    }
+    if (atoi(line) != conn->cfg->run || atoi(line + 7) != conn->id) {
+        return -1;
+    }
+    // our own packets must come back exactly as sent
+    if (len != conn->cfg->size) {
+        conn->invalid++;
+        return -1;
+    }
+    return atoi(line + 14);
+}
+
+/* reader: every writer's packets come back whole and in order, each replay
+ * starting over from its first one; next holds the number expected per writer */
+static void check_order(struct bench_conn *conn, const char *line, size_t len, int *next)
+{
+    if (!valid_line(line, len)) {
+        conn->invalid++;
+        return;
+    }
+    int id = atoi(line + 7);
+    if (atoi(line) != conn->cfg->run || id < 0 || id >= conn->cfg->connections) {
+        return;
+    }
+    if (len != conn->cfg->size) {
+        conn->invalid++;
+        return;
+    }
+    int seq = atoi(line + 14);
+    if (seq != next[id] && seq != 0) {
+        conn->order_errors++;
+    }
+    next[id] = seq + 1;
+}
+
+/* add received bytes to the line being collected, returns how many were
+ * used; *complete is set once conn->line holds a whole line */
+static size_t take_line(struct bench_conn *conn, const char *p, const char *end, int *complete)
+{
+    const char *nl = memchr(p, '\n', end - p);
+    size_t n = (nl != NULL ? nl + 1 : end) - p;
+    if (conn->line_len + n > sizeof(conn->line)) {
+        // far longer than any packet we send
+        conn->invalid++;
+        conn->line_len = 0;
+    } else {
+        memcpy(conn->line + conn->line_len, p, n);
+        conn->line_len += n;
+    }
+    *complete = (nl != NULL);
+    return n;
+}
+
+/* read replay data until packet seq has come back */
+static int wait_for_packet(struct bench_conn *conn, int fd, int seq, char *buf)
+{
+    while (1) {
+        ssize_t got = recv(fd, buf, BENCH_RECV_SIZE, 0);
+        if (got <= 0) {
+            if (got == -1 && errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        conn->bytes_in += got;
+
+        int found = 0;
+        const char *p = buf, *end = buf + got;
+        while (p < end) {
+            int complete;
+            p += take_line(conn, p, end, &complete);
+            if (!complete) {
+                break;
+            }
+            if (conn->line_len > 0 && check_line(conn, conn->line, conn->line_len) == seq) {
+                found = 1;
+            }
+            conn->line_len = 0;
+        }
+        // the rest of this replay (packets of others) is read before the next one
+        if (found) {
+            return 0;
+        }
+    }
+}
+
+/************************************************************************************
+ * ----------------------  connection thread  ----------------------
+ * **********************************************************************************/
+static void *bench_run(void *conn_info)
+{
+    struct bench_conn *conn = (struct bench_conn*) conn_info;
+    const struct bench_config *cfg = conn->cfg;
+    char *pkt = malloc(cfg->size);
+    char *buf = malloc(BENCH_RECV_SIZE);
+
+    int fd = bench_connect(cfg);
+    if (fd == -1 || pkt == NULL || buf == NULL) {
+        conn->failed = 1;
+    } else if (cfg->tail && send_all(fd, TAIL_COMMAND, strlen(TAIL_COMMAND)) == -1) {
+        conn->failed = 1;
+    }
+    pthread_barrier_wait(&start_barrier);
+
+    uint64_t interval = cfg->rate > 0 ? (uint64_t)(1e9 / cfg->rate) : 0;
+    uint64_t next = now_ns();
+    for (int seq = 0; !conn->failed && seq < cfg->packets; seq++) {
+        if (interval > 0) {
+            sleep_until(next);
+        } else {
+            next = now_ns();
+        }
+        make_packet(pkt, cfg->size, cfg->run, conn->id, seq);
+        if (send_all(fd, pkt, cfg->size) == -1) {
+            conn->failed = 1;
+            break;
+        }
+        conn->sent++;
+        conn->bytes_out += cfg->size;
+        if (wait_for_packet(conn, fd, seq, buf) == -1) {
+            conn->failed = 1;
+            break;
+        }
+        // measured from the scheduled send time (no coordinated omission)
+        conn->latency[conn->received++] = now_ns() - next;
+        next += interval;
+    }
+
+    if (fd != -1) {
+        close(fd);
+    }
+    free(buf);
+    free(pkt);
+    return 0;
+}
+
+/************************************************************************************
+ * ----------------------  reader thread  ----------------------
+ * **********************************************************************************/
+static void *bench_read(void *conn_info)
+{
+    struct bench_conn *conn = (struct bench_conn*) conn_info;
+    const struct bench_config *cfg = conn->cfg;
+    static const char seek[] = SEEK_COMMAND "0,0\n";
+    char *buf = malloc(BENCH_RECV_SIZE);
+    int *next = calloc(cfg->connections, sizeof(int));
+
+    int fd = bench_connect(cfg);
+    if (fd == -1 || buf == NULL || next == NULL) {
+        conn->failed = 1;
+    }
+    pthread_barrier_wait(&start_barrier);
+
+    while (!conn->failed && !atomic_load(&writers_done)) {
+        if (send_all(fd, seek, sizeof(seek) - 1) == -1) {
+            conn->failed = 1;
+            break;
+        }
+        conn->passes++;
+
+        // read this replay until the connection goes quiet
+        while (1) {
+            struct pollfd pfd = { .fd = fd, .events = POLLIN };
+            int rc = poll(&pfd, 1, BENCH_IDLE_MS);
+            if (rc == 0) {
+                break;
+            }
+            ssize_t got = rc == -1 ? -1 : recv(fd, buf, BENCH_RECV_SIZE, 0);
+            if (got <= 0) {
+                if (got == -1 && errno == EINTR) {
+                    continue;
+                }
+                conn->failed = 1;
+                break;
+            }
+            conn->bytes_in += got;
+
+            const char *p = buf, *end = buf + got;
+            while (p < end) {
+                int complete;
+                p += take_line(conn, p, end, &complete);
+                if (!complete) {
+                    break;
+                }
+                if (conn->line_len > 0) {
+                    check_order(conn, conn->line, conn->line_len, next);
+                }
+                conn->line_len = 0;
+            }
+        }
+    }
+
+    if (fd != -1) {
+        close(fd);
+    }
+    free(next);
+    free(buf);
+    return 0;
+}
+
+/************************************************************************************
+ * ----------------------  replay mode  ----------------------
+ * **********************************************************************************/
+/* read the replay of the whole data file, expected bytes long */
+static int replay_recv(int fd, uint64_t expected, char *buf, uint64_t *bytes)
+{
+    struct stat st;
+    uint64_t total = 0;
+    while (total < expected) {
+        ssize_t got = recv(fd, buf, BENCH_RECV_SIZE, 0);
+        if (got <= 0) {
+            if (got == -1 && errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        total += got;
+    }
+    // anything else in the file (another client, a store without it) spoils the count
+    if (stat(OUTFILE, &st) == -1 || (uint64_t) st.st_size != expected) {
+        fprintf(stderr, "replay mode needs the file store (%s) and no other client\n", OUTFILE);
+        return -1;
+    }
+    *bytes = total;
+    return 0;
+}
+
+/* send a packet and read its replay, the whole data file ending with that packet */
+static int replay_packet(int fd, const char *pkt, size_t len, char *buf, uint64_t *bytes)
+{
+    struct stat st;
+    uint64_t expected = (stat(OUTFILE, &st) == 0 ? (uint64_t) st.st_size : 0) + len;
+    if (send_all(fd, pkt, len) == -1) {
+        return -1;
+    }
+    return replay_recv(fd, expected, buf, bytes);
+}
+
+static int run_replay(const struct bench_config *cfg)
+{
+    char *pkt = malloc(BENCH_FILL_PACKET);
+    char *buf = malloc(BENCH_RECV_SIZE);
+    int fd = bench_connect(cfg);
+    if (fd == -1 || pkt == NULL || buf == NULL) {
+        fprintf(stderr, "could not connect to the server\n");
+        return 1;
+    }
+
+    // every packet costs a replay of the whole file: fill with packets as
+    // long as the server takes, sent BENCH_FILL_PACKET bytes at a time
+    int seq = 0;
+    uint64_t bytes = 0, target = (uint64_t) cfg->fill_mb * 1024 * 1024;
+    struct stat st;
+    memset(pkt, 'f', BENCH_FILL_PACKET);
+    while (stat(OUTFILE, &st) == -1 || (uint64_t) st.st_size < target) {
+        uint64_t size = stat(OUTFILE, &st) == 0 ? (uint64_t) st.st_size : 0;
+        uint64_t run = target - size < FRAME_MAX_PACKET ? target - size : FRAME_MAX_PACKET;
+        for (uint64_t sent = 0; sent + 1 < run; ) {
+            size_t len = run - 1 - sent < BENCH_FILL_PACKET ? (size_t)(run - 1 - sent) : BENCH_FILL_PACKET;
+            if (send_all(fd, pkt, len) == -1) {
+                return 1;
+            }
+            sent += len;
+        }
+        if (send_all(fd, "\n", 1) == -1 || replay_recv(fd, size + run, buf, &bytes) == -1) {
+            return 1;
+        }
+    }
+
+    double best = 0, sum = 0;
+    for (int round = 0; round < BENCH_REPLAY_ROUNDS; round++) {
+        make_packet(pkt, cfg->size, cfg->run, 0, seq++);
+        uint64_t start = now_ns();
+        if (replay_packet(fd, pkt, cfg->size, buf, &bytes) == -1) {
+            return 1;
+        }
+        double mbps = bytes / ((now_ns() - start) / 1e9) / 1e6;
+        best = mbps > best ? mbps : best;
+        sum += mbps;
+    }
+    close(fd);
+    free(buf);
+    free(pkt);
+
+    if (cfg->json) {
+        printf("{\"transport\":\"%s\",\"replay_bytes\":%llu,\"rounds\":%d,\"mb_per_s_best\":%.1f,\"mb_per_s_mean\":%.1f}\n",
+               cfg->unix_path != NULL ? "unix" : "tcp", (unsigned long long) bytes, BENCH_REPLAY_ROUNDS,
+               best, sum / BENCH_REPLAY_ROUNDS);
+    } else {
+        printf("replay of %.1f MB over %s, %d rounds: best %.1f MB/s, mean %.1f MB/s\n",
+               bytes / 1048576.0, cfg->unix_path != NULL ? "unix" : "tcp", BENCH_REPLAY_ROUNDS,
+               best, sum / BENCH_REPLAY_ROUNDS);
+    }
+    return 0;
+}
+
+/************************************************************************************
+ * ----------------------  report  ----------------------
+ * **********************************************************************************/
+static int cmp_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t*) a, y = *(const uint64_t*) b;
+    return x < y ? -1 : x > y;
+}
+
+static double percentile_us(const uint64_t *sorted, size_t n, double q)
+{
+    if (n == 0) {
+        return 0;
+    }
+    size_t idx = (size_t)(q * (n - 1) + 0.5);
+    return sorted[idx] / 1000.0;
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr, "usage: %s [-p port | -U path] [-c connections] [-n packets] [-s size] [-r rate] [-t] [-R readers] [-F MB] [-j]\n"
+                    "  -p port         server port (default %s)\n"
+                    "  -U path         server unix socket instead of TCP (@name: abstract namespace)\n"
+                    "  -c connections  concurrent connections (default 1)\n"
+                    "  -n packets      packets per connection (default 1000)\n"
+                    "  -s size         bytes per packet including newline (default 64, min %d)\n"
+                    "  -r rate         packets per second per connection (default 0 = unlimited)\n"
+                    "  -t              negotiate tail replay (only new data per replay)\n"
+                    "  -R readers      replay only connections checking that packets stay whole and in order\n"
+                    "  -F MB           replay mode: fill the data file to MB and time full replays of it\n"
+                    "  -j              JSON output\n",
+            name, SOCKET_PORT, BENCH_MIN_SIZE);
+}
+
+/************************************************************************************
+ * ----------------------  MAIN ----------------------
+ * **********************************************************************************/
+int main(int argc, char *argv[])
+{
+    struct bench_config cfg = { .port = SOCKET_PORT, .connections = 1, .packets = 1000, .size = 64 };
+
+    int opt;
+    while ((opt = getopt(argc, argv, "p:U:c:n:s:r:tR:F:j")) != -1) {
+        switch (opt) {
+            case 'p':
+                cfg.port = optarg;
+                break;
+            case 'U':
+                cfg.unix_path = optarg;
+                break;
+            case 'c':
+                cfg.connections = atoi(optarg);
+                break;
+            case 'n':
+                cfg.packets = atoi(optarg);
+                break;
+            case 's':
+                cfg.size = strtoul(optarg, NULL, 10);
+                break;
+            case 'r':
+                cfg.rate = atof(optarg);
+                break;
+            case 't':
+                cfg.tail = 1;
+                break;
+            case 'R':
+                cfg.readers = atoi(optarg);
+                break;
+            case 'F':
+                cfg.fill_mb = strtoul(optarg, NULL, 10);
+                break;
+            case 'j':
+                cfg.json = 1;
+                break;
+            default:
+                usage(argv[0]);
+                return 2;
+        }
+    }
+    cfg.run = (getpid() ^ time(NULL)) % 1000000;
+    // connection and sequence numbers have to fit their header fields
+    if (cfg.connections <= 0 || cfg.connections > 999999 || cfg.packets <= 0 || cfg.packets > 999999999 ||
+        cfg.size < BENCH_MIN_SIZE || cfg.size > BENCH_RECV_SIZE || cfg.readers < 0) {
+        usage(argv[0]);
+        return 2;
+    }
+    if (cfg.fill_mb > 0) {
+        return run_replay(&cfg);
+    }
+
+    // readers follow the writers in conns
+    struct bench_conn *conns = calloc(cfg.connections + cfg.readers, sizeof(struct bench_conn));
+    uint64_t *latency = malloc((size_t) cfg.connections * cfg.packets * sizeof(uint64_t));
+    if (conns == NULL || latency == NULL) {
+        perror("malloc");
+        return 1;
+    }
+
+    // all threads connect first, then start sending together with the clock
+    int nconns = cfg.connections + cfg.readers;
+    pthread_barrier_init(&start_barrier, NULL, nconns + 1);
+    int started = 0;
+    for (int i = 0; i < nconns; i++) {
+        conns[i].cfg = &cfg;
+        conns[i].id = i;
+        int reader = i >= cfg.connections;
+        conns[i].latency = reader ? NULL : latency + (size_t) i * cfg.packets;
+        if (pthread_create(&conns[i].thread, NULL, reader ? bench_read : bench_run, &conns[i])) {
+            perror("pthread_create");
+            break;
+        }
+        started++;
+    }
+    if (started < nconns) {
+        // the barrier counts every connection, fail fast instead of waiting forever
+        return 1;
+    }
+    pthread_barrier_wait(&start_barrier);
+    uint64_t t0 = now_ns();
+    for (int i = 0; i < cfg.connections; i++) {
+        pthread_join(conns[i].thread, NULL);
+    }
+    double elapsed = (now_ns() - t0) / 1e9;
+    atomic_store(&writers_done, 1);
+    for (int i = cfg.connections; i < nconns; i++) {
+        pthread_join(conns[i].thread, NULL);
+    }
+    pthread_barrier_destroy(&start_barrier);
+
+    // gather results
+    size_t nlat = 0;
+    uint64_t invalid = 0, bytes_in = 0, bytes_out = 0, passes = 0, order_errors = 0;
+    int failed = 0;
+    for (int i = 0; i < started; i++) {
+        passes += conns[i].passes;
+        order_errors += conns[i].order_errors;
+        if (conns[i].latency != NULL) {
+            // readers record no latencies
+            memmove(latency + nlat, conns[i].latency, conns[i].received * sizeof(uint64_t));
+            nlat += conns[i].received;
+        }
+        invalid += conns[i].invalid;
+        bytes_in += conns[i].bytes_in;
+        bytes_out += conns[i].bytes_out;
+        failed += conns[i].failed;
+    }
+    qsort(latency, nlat, sizeof(uint64_t), cmp_u64);
+
+    double pps = elapsed > 0 ? nlat / elapsed : 0;
+    double p50 = percentile_us(latency, nlat, 0.5);
+    double p99 = percentile_us(latency, nlat, 0.99);
+    double p999 = percentile_us(latency, nlat, 0.999);
+    double max = nlat > 0 ? latency[nlat - 1] / 1000.0 : 0;
+
+    if (cfg.json) {
+        printf("{\"transport\":\"%s\",\"connections\":%d,\"packets_per_connection\":%d,\"packet_size\":%zu,\"rate\":%.1f,\"tail\":%d,"
+               "\"packets\":%zu,\"invalid_lines\":%llu,\"failed_connections\":%d,\"elapsed_s\":%.6f,"
+               "\"packets_per_s\":%.1f,\"bytes_out\":%llu,\"bytes_in\":%llu,\"mb_out_per_s\":%.3f,\"mb_in_per_s\":%.3f,"
+               "\"latency_us\":{\"p50\":%.1f,\"p99\":%.1f,\"p999\":%.1f,\"max\":%.1f},"
+               "\"readers\":%d,\"reader_passes\":%llu,\"order_errors\":%llu}\n",
+               cfg.unix_path != NULL ? "unix" : "tcp", cfg.connections, cfg.packets, cfg.size, cfg.rate, cfg.tail,
+               nlat, (unsigned long long) invalid, failed, elapsed,
+               pps, (unsigned long long) bytes_out, (unsigned long long) bytes_in,
+               bytes_out / elapsed / 1e6, bytes_in / elapsed / 1e6,
+               p50, p99, p999, max,
+               cfg.readers, (unsigned long long) passes, (unsigned long long) order_errors);
+    } else {
+        printf("%d %s connection(s) x %d packets of %zu bytes, %s, %s replay\n",
+               cfg.connections, cfg.unix_path != NULL ? "unix" : "tcp", cfg.packets, cfg.size, cfg.rate > 0 ? "rate limited" : "unlimited rate",
+               cfg.tail ? "tail" : "full");
+        printf("packets     %zu replayed, %llu invalid lines, %d failed connection(s)\n",
+               nlat, (unsigned long long) invalid, failed);
+        printf("elapsed     %.3f s\n", elapsed);
+        printf("throughput  %.0f packets/s, %.3f MB/s out, %.3f MB/s in\n",
+               pps, bytes_out / elapsed / 1e6, bytes_in / elapsed / 1e6);
+        printf("latency us  p50 %.1f  p99 %.1f  p999 %.1f  max %.1f\n", p50, p99, p999, max);
+        if (cfg.readers > 0) {
+            printf("readers     %d connection(s), %llu replays, %llu packets out of order\n",
+                   cfg.readers, (unsigned long long) passes, (unsigned long long) order_errors);
+        }
+    }
+
+    free(latency);
+    free(conns);
+    return (invalid > 0 || failed > 0 || order_errors > 0) ? 1 : 0;
+}
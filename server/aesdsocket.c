@@ -4,15 +4,23 @@
  * Date: 10/12/2023
 */
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <string.h>
 #include <errno.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
 
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/wait.h>
+#include <sys/stat.h>
+#include <sys/sendfile.h>
+#include <sys/un.h>
+#include <sys/eventfd.h>
 
 #include <netinet/in.h>
 #include <netdb.h>
@@ -23,32 +31,29 @@
 
 #include <pthread.h>
 
-#define SOCKET_PORT "9000"
-#define SOCKET_BACKLOG 10
-#define BUF_SIZE 512
-#define OUTFILE "/var/tmp/aesdsocketdata"
+#include "aesdsocket.h"
+#include "aesd_store.h"
 
 /* volatile atomic signal for done */
 volatile sig_atomic_t done = 0;
+/* signal that set done, logged by main: syslog and printf are not async-signal-safe */
+static volatile sig_atomic_t caught = 0;
+/* eventfd signalled once done is set, so waiting connection handlers notice
+ * it right away (-1: they notice within RECV_TIMEOUT_SEC) */
+static int handler_wake_fd = -1;
 
-/* structure for thread data */
-struct th_data  {
-    int socket_fd;  // socket file descriptor
-    char* addr;     // socket peer address
-};
+struct out_limits out_limits = { .stall_sec = SEND_STALL_SEC, .queue_bytes = OUT_QUEUE_BYTES };
 
 /************************************************************************************
  * ----------------------  handlers for SIGINT and SIGTERM ----------------------
  * **********************************************************************************/
 void sigterm_handler(int s) {
-    printf("Caught SIGTERM, exiting\n");
-    syslog(LOG_USER,"Caught signal, exiting\n");
+    caught = s;
     done = 1;
 }
 
 void sigint_handler(int s) {
-    printf("Caught SIGINT, exiting\n");
-    syslog(LOG_USER,"Caught signal, exiting\n");
+    caught = s;
     done = 1;
 }
 
@@ -60,67 +65,506 @@ void *get_in_addr(struct sockaddr *sa) {
     return &(((struct sockaddr_in6*)sa)->sin6_addr);
 }
 
+/* printable peer address: the IP, or "unix" for a local client */
+void peer_name(struct sockaddr *sa, char *buf, size_t len)
+{
+    if (sa->sa_family != AF_INET && sa->sa_family != AF_INET6) {
+        snprintf(buf, len, "%s", sa->sa_family == AF_UNIX ? "unix" : "unknown");
+        return;
+    }
+    inet_ntop(sa->sa_family, get_in_addr(sa), buf, len);
+}
+
+/* create a thread that leaves SIGINT/SIGTERM to the main thread */
+int create_worker_thread(pthread_t *thread, void *(*fn)(void *), void *arg)
+{
+    sigset_t sigs, oldsigs;
+    sigemptyset(&sigs);
+    sigaddset(&sigs, SIGINT);
+    sigaddset(&sigs, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &sigs, &oldsigs);
+    int rc = pthread_create(thread, NULL, fn, arg);
+    pthread_sigmask(SIG_SETMASK, &oldsigs, NULL);
+    return rc;
+}
+
+/************************************************************************************
+ * ----------------------  replay file range to socket  ----------------------
+ * **********************************************************************************/
+int send_file_range(int sock, int fd, off_t *offset, off_t end)
+{
+    int useSendfile = 1;
+    char buf[BUF_SIZE * 16];
+
+    while (*offset < end) {
+        size_t len = end - *offset;
+        if (len > REPLAY_CHUNK) {
+            len = REPLAY_CHUNK;
+        }
+
+        ssize_t sent;
+        if (useSendfile) {
+            // zero copy: page cache -> socket, advances *offset by the bytes sent
+            sent = sendfile(sock, fd, offset, len);
+            if (sent == -1 && (errno == EINVAL || errno == ENOSYS)) {
+                // file or socket type does not support sendfile, copy instead
+                useSendfile = 0;
+                continue;
+            }
+        } else {
+            if (len > sizeof(buf)) {
+                len = sizeof(buf);
+            }
+            ssize_t fileRead = pread(fd, buf, len, *offset);
+            if (fileRead <= 0) {
+                errno = (fileRead == 0) ? EIO : errno;
+                return -1;
+            }
+            sent = send(sock, buf, fileRead, MSG_NOSIGNAL);
+            if (sent > 0) {
+                // a partial send just leaves the rest for the next round
+                *offset += sent;
+            }
+        }
+
+        if (sent == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        if (sent == 0) {
+            // file is shorter than expected
+            errno = EIO;
+            return -1;
+        }
+    }
+    return 0;
+}
+
 /************************************************************************************
  * ----------------------  connection handler  ----------------------
  * **********************************************************************************/
+/* send [*offset, end) of the store on the nonblocking socket, waiting for it to
+ * become writable; fails with ETIMEDOUT once the peer has taken nothing for
+ * out_limits.stall_sec, and with ECANCELED when done is set */
+static int replay_range(struct aesd_store *store, int sock, off_t *offset, off_t end)
+{
+    int idle = 0;   // seconds the socket has stayed full
+    for (;;) {
+        off_t from = *offset;
+        if (store_send(store, sock, offset, end) == 0) {
+            return 0;
+        }
+        if (errno != EAGAIN && errno != EWOULDBLOCK) {
+            return -1;
+        }
+        if (*offset > from) {
+            idle = 0;
+        }
+
+        // socket buffer full: wait for room or done, waking up every RECV_TIMEOUT_SEC to check for a stall
+        struct pollfd pfd[2] = { { .fd = sock, .events = POLLOUT }, { .fd = handler_wake_fd, .events = POLLIN } };
+        int ready = poll(pfd, 2, RECV_TIMEOUT_SEC * 1000);
+        if (ready == -1 && errno != EINTR) {
+            return -1;
+        }
+        if (ready == 0) {
+            idle += RECV_TIMEOUT_SEC;
+            if (out_limits.stall_sec > 0 && idle >= out_limits.stall_sec) {
+                errno = ETIMEDOUT;
+                return -1;
+            }
+        }
+        if (done) {
+            errno = ECANCELED;
+            return -1;
+        }
+    }
+}
+
+/* replay [*offset, end) to the connection and account for it; returns -1 if
+ * the connection has to end (ECANCELED: shut down, *offset tells how far it got) */
+static int handler_replay(struct th_data *conn, off_t *offset, off_t end, uint64_t received)
+{
+    off_t from = *offset;
+    int rc = replay_range(conn->store, conn->socket_fd, offset, end);
+    stats_add(STAT_BYTES_OUT, *offset - from);
+    if (rc == -1) {
+        if (errno == ETIMEDOUT) {
+            syslog(LOG_ERR, "dropping %s: replay stalled for %d s\n", conn->addr, out_limits.stall_sec);
+            stats_add(STAT_DROPPED, 1);
+        } else if (errno != ECANCELED) {
+            syslog(LOG_ERR, "replay to %s failed: %s\n", conn->addr, strerror(errno));
+        }
+        return -1;
+    }
+    stats_add(STAT_REPLAYS, 1);
+    stats_record(HIST_REPLAY, stats_now() - received);
+    return 0;
+}
+
 void *connection_handler (void *socket_info)
 {
     // get socket from socket_info parameter
     struct th_data socket_data = *(struct th_data*) socket_info;
     int sock = socket_data.socket_fd;
+    struct aesd_store *store = socket_data.store;
 
-    // read from socket and write to file
+    // read from socket and append complete packets to the store
     ssize_t sockRead;
-    char buf[BUF_SIZE] = {0};
-    FILE *fp = fopen(OUTFILE, "ab+");
-    if (fp == NULL) {
-        perror("fopen");
-        exit(-1);
+    char buf[RECV_BUF_SIZE];
+    struct frame_buf packet = { 0 };    // packet assembled across reads
+    int negotiating = 1;                // first line may still be a command
+    int tail = 0;                       // TAIL_COMMAND: replay only what is new since the last replay
+    off_t cursor = 0;                   // tail: store offset of the next replay
+    struct frame_seek seek;             // replay start requested by a seek command
+    int alive = 1;                      // cleared once the connection ended or failed
+    off_t owed = 0, owedEnd = 0;        // replay cut short by shutdown
+
+    // a connection taken over from the previous process carries on where it was
+    struct handoff_conn *adopted = socket_data.adopted;
+    if (adopted != NULL) {
+        handoff_fit(adopted, store_start(store), store_end(store));
+        negotiating = adopted->negotiating;
+        tail = adopted->tail;
+        cursor = adopted->cursor;
+        alive = frame_restore(&packet, adopted->pending, adopted->pending_len) == 0;
+        for (int i = 0; i < adopted->nout && alive; i++) {
+            off_t offset = adopted->out[i][0];
+            if (handler_replay(&socket_data, &offset, adopted->out[i][1], stats_now()) == -1) {
+                alive = (errno == ECANCELED);
+                owed = offset;
+                owedEnd = adopted->out[i][1];
+                break;
+            }
+            cursor = offset;
+        }
+        handoff_free(adopted);
     }
-    do {
-        sockRead = recv(sock, &buf, BUF_SIZE, 0);
+
+    while (alive && done == 0) {
+        sockRead = recv(sock, &buf, sizeof(buf), 0);
         if (sockRead == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+                // wait for data or done
+                struct pollfd pfd[2] = { { .fd = sock, .events = POLLIN }, { .fd = handler_wake_fd, .events = POLLIN } };
+                poll(pfd, 2, RECV_TIMEOUT_SEC * 1000);
+                continue;
+            }
             perror("recv");
-            exit(-1);
+            alive = 0;
+        } else if (sockRead == 0) {
+            alive = 0;
         } else {
-            fwrite(&buf, 1, sockRead, fp);
-            fseek(fp, 0, SEEK_SET);
-            for (int i = 0; i < sockRead; i++){
-                if (buf[i] == '\n') {
-                    while (1){
-                        int c = fgetc(fp);
-                        if (c == EOF) {
-                            break;
-                        }
-                        send(sock, &c, 1, 0);
-                    }
+            uint64_t received = stats_now();
+            stats_add(STAT_BYTES_IN, sockRead);
+            const char *data = buf;
+            size_t len = sockRead;
+            if (negotiating) {
+                enum frame_cmd cmd = frame_first_line(&packet, &data, &len);
+                negotiating = (cmd == FRAME_CMD_PENDING);
+                if (cmd == FRAME_CMD_TAIL) {
+                    tail = 1;
+                    cursor = store_end(store);
+                    syslog(LOG_USER, "tail replay for %s\n", socket_data.addr);
                 }
             }
+            int stored = frame_input(&packet, store, data, len, &seek);
+            if (stored == -1) {
+                syslog(LOG_ERR, "could not store data from %s: %s\n", socket_data.addr, strerror(errno));
+                alive = 0;
+                break;
+            }
+            // at most one replay per read, however many packets it completed
+            off_t offset = stored > 0 ? frame_replay_from(store, stored, &seek, tail ? cursor : store_start(store)) : -1;
+            if (offset != -1) {
+                off_t end = store_end(store);
+                if (handler_replay(&socket_data, &offset, end, received) == -1) {
+                    alive = (errno == ECANCELED);
+                    owed = offset;
+                    owedEnd = end;
+                    break;
+                }
+                cursor = offset;
+            }
         }
-    } while(sockRead != 0 && done ==0);
-    fclose(fp);
+    }
 
-    // free socket_info (which was malloc'd when the thread was created in main)
+    // hot restart: a connection still open is passed to the new process
+    int passed = 0;
+    if (alive && done) {
+        struct handoff_conn state = { .fd = sock, .negotiating = negotiating, .tail = tail, .cursor = cursor,
+                                      .nout = owed < owedEnd, .out = { { owed, owedEnd } },
+                                      .pending = packet.data, .pending_len = packet.len };
+        memcpy(state.addr, socket_data.addr, sizeof(state.addr));
+        passed = (handoff_pass(&state) == 0);
+    }
+    frame_release(&packet);
+    close(sock);
+
+    // free socket_info (which was malloc'd when the connection was accepted in main)
     free(socket_info);
-    syslog(LOG_USER, "closed connection from %s\n", socket_data.addr);
+    if (!passed) {
+        stats_add(STAT_CLOSED, 1);
+        syslog(LOG_USER, "closed connection from %s\n", socket_data.addr);
+    }
 
     return 0;
 }
 
+/* queue a connection (taken over on hot restart if adopted is set) for the worker pool */
+static void queue_connection(struct aesd_pool *pool, struct aesd_store *store, int fd, const char *addr,
+                             struct handoff_conn *adopted)
+{
+    struct th_data *socket_data = malloc(sizeof(struct th_data));
+    if (socket_data == NULL){
+        syslog(LOG_ERR,"out of memory for connection from %s\n", addr);
+        close(fd);
+        if (adopted != NULL){
+            handoff_free(adopted);
+        }
+        stats_add(STAT_CLOSED, 1);
+        return;
+    }
+    socket_data->socket_fd = fd;
+    socket_data->store = store;
+    snprintf(socket_data->addr, sizeof(socket_data->addr), "%s", addr);
+    socket_data->adopted = adopted;
+
+    if (pool_submit(pool, connection_handler, (void*) socket_data)) {
+        // shed load instead of queueing without bound
+        syslog(LOG_ERR,"worker queue full, rejecting connection from %s\n", addr);
+        close(fd);
+        free(socket_data);
+        if (adopted != NULL){
+            handoff_free(adopted);
+        }
+        stats_add(STAT_REJECTED, 1);
+        stats_add(STAT_CLOSED, 1);
+    }
+}
+
+/************************************************************************************
+ * ----------------------  socket activation  ----------------------
+ * **********************************************************************************/
+#define LISTEN_FDS_START 3  // first socket passed by the service manager
+
+/* listening sockets passed in by a service manager (systemd style: LISTEN_FDS
+ * of them starting at fd 3, if LISTEN_PID is this process); returns how many */
+static int inherited_listeners(int *fds, int max)
+{
+    const char *pid = getenv("LISTEN_PID");
+    const char *count = getenv("LISTEN_FDS");
+    if (pid == NULL || count == NULL || atol(pid) != getpid()) {
+        return 0;
+    }
+    // not meant for our children
+    unsetenv("LISTEN_PID");
+    unsetenv("LISTEN_FDS");
+    unsetenv("LISTEN_FDNAMES");
+
+    int n = atoi(count);
+    for (int i = 0; i < n; i++) {
+        int fd = LISTEN_FDS_START + i;
+        if (i >= max) {
+            close(fd);
+            continue;
+        }
+        fcntl(fd, F_SETFD, FD_CLOEXEC);
+        fds[i] = fd;
+    }
+    return n < max ? n : max;
+}
+
+/************************************************************************************
+ * ----------------------  unix domain listener  ----------------------
+ * **********************************************************************************/
+/* fill in the address of path ("@name": name in the abstract namespace, no
+ * socket file); returns its length, 0 if the path does not fit */
+static socklen_t unix_addr(const char *path, struct sockaddr_un *addr)
+{
+    size_t len = strlen(path);
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    if (len == 0 || len >= sizeof(addr->sun_path)) {
+        return 0;
+    }
+    memcpy(addr->sun_path, path, len);
+    if (path[0] == '@') {
+        addr->sun_path[0] = '\0';
+        return offsetof(struct sockaddr_un, sun_path) + len;
+    }
+    return offsetof(struct sockaddr_un, sun_path) + len + 1;
+}
+
+/* local clients skip the TCP/IP stack: a stream listener on path, speaking the same protocol */
+static int unix_listen(const char *path)
+{
+    struct sockaddr_un addr;
+    socklen_t addrlen = unix_addr(path, &addr);
+    if (addrlen == 0) {
+        syslog(LOG_ERR, "unix socket path %s too long\n", path);
+        return -1;
+    }
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd == -1) {
+        syslog(LOG_ERR, "failed to create unix socket: %s\n", strerror(errno));
+        return -1;
+    }
+
+    int rc = bind(fd, (struct sockaddr*) &addr, addrlen);
+    if (rc == -1 && errno == EADDRINUSE && path[0] != '@') {
+        // a socket file left behind by a crash: take it over if nobody accepts on it
+        int probe = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        int stale = probe != -1 && connect(probe, (struct sockaddr*) &addr, addrlen) == -1 && errno == ECONNREFUSED;
+        if (probe != -1) {
+            close(probe);
+        }
+        errno = EADDRINUSE;
+        if (stale) {
+            unlink(path);
+            rc = bind(fd, (struct sockaddr*) &addr, addrlen);
+        }
+    }
+    if (rc == -1) {
+        syslog(LOG_ERR, "failed to bind unix socket %s: %s\n", path, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    printf("Listening on unix: %s \n", path);
+    return fd;
+}
+
+/* close the unix listener; its socket file goes unless a new process took it over */
+static void unix_close(int fd, int keep)
+{
+    struct sockaddr_un addr;
+    socklen_t len = sizeof(addr) - 1;
+    memset(&addr, 0, sizeof(addr));
+    if (!keep && getsockname(fd, (struct sockaddr*) &addr, &len) == 0 &&
+        len > offsetof(struct sockaddr_un, sun_path) && addr.sun_path[0] != '\0') {
+        unlink(addr.sun_path);
+    }
+    close(fd);
+}
+
 /************************************************************************************
  * ----------------------  MAIN ----------------------
  * **********************************************************************************/
 int main(int argc, char *argv[]){
 
     int isDaemon = 0;
+    int useEpoll = 0;   // -e: epoll event loop instead of a thread per connection
+    int nloops = 1;     // -n: number of event loops (0 = one per core)
+    int useUring = 0;   // -u: io_uring loop (falls back to the worker pool if unavailable)
+    int nworkers = 0;   // -w: worker threads (0 = POOL_THREADS_PER_CPU per core)
+    int queueLimit = 0; // -q: max connections waiting for a worker (0 = POOL_QUEUE_LIMIT)
+    const char *adminPort = NULL;   // -a PORT: serve statistics on this loopback port
+    int shards = -1;    // -S N: N SO_REUSEPORT listeners, each with its own event loop (0 = one per core)
+    int pinLoops = 0;   // -C: pin event loops to CPUs
+    // -t SEC: drop connections whose replay stalls this long (0 = never), -o KB: output queued per connection
+    const char *handoffPath = NULL; // -H PATH: hot restart, take over from / hand over to the server on this unix socket
+    const char *unixPath = NULL;    // -U PATH: also serve local clients on this unix socket ("@name": abstract namespace)
+
+    // -r N: keep the last N packets in memory instead of OUTFILE, -b: write them back to OUTFILE
+    // -g: append to OUTFILE through a single group commit writer, -s MS: fdatasync every MS ms (0 = every batch)
+    // -l KB: segmented log with KB sized segments, -m MB / -k SEC: retire old segments beyond MB / after SEC
+    // -z KB: OUTFILE as compressed blocks of KB raw bytes (0 = BLOCK_DEFAULT_SIZE)
+    // -f MB: replays share an in-memory snapshot of the newest MB of the store (0 = SNAP_DEFAULT_BYTES)
+    struct store_config storeConfig = { .type = STORE_FILE, .path = OUTFILE, .sync_ms = -1 };
+
+    int opt;
+    while ((opt = getopt(argc, argv, "den:w:q:r:bgs:ua:S:Cl:m:k:t:o:H:z:U:f:")) != -1){
+        switch (opt){
+            case 'd':
+                isDaemon = 1;
+                break;
+            case 'e':
+                useEpoll = 1;
+                break;
+            case 'n':
+                nloops = atoi(optarg);
+                break;
+            case 'w':
+                nworkers = atoi(optarg);
+                break;
+            case 'q':
+                queueLimit = atoi(optarg);
+                break;
+            case 'r':
+                storeConfig.type = STORE_RING;
+                storeConfig.ring_packets = atoi(optarg);
+                break;
+            case 'b':
+                storeConfig.writeback = 1;
+                break;
+            case 'u':
+                useUring = 1;
+                break;
+            case 'a':
+                adminPort = optarg;
+                break;
+            case 'S':
+                shards = atoi(optarg);
+                break;
+            case 'C':
+                pinLoops = 1;
+                break;
+            case 'l':
+                storeConfig.type = STORE_SEGMENT;
+                storeConfig.segment_size = strtoul(optarg, NULL, 10) * 1024;
+                break;
+            case 'z':
+                storeConfig.type = STORE_BLOCK;
+                storeConfig.block_size = strtoul(optarg, NULL, 10) * 1024;
+                break;
+            case 'f':
+                storeConfig.snapshot_bytes = strtoul(optarg, NULL, 10) * 1024 * 1024;
+                if (storeConfig.snapshot_bytes == 0){
+                    storeConfig.snapshot_bytes = SNAP_DEFAULT_BYTES;
+                }
+                break;
+            case 'm':
+                storeConfig.retain_bytes = strtoul(optarg, NULL, 10) * 1024 * 1024;
+                break;
+            case 'k':
+                storeConfig.retain_sec = atoi(optarg);
+                break;
+            case 't':
+                out_limits.stall_sec = atoi(optarg);
+                break;
+            case 'o':
+                out_limits.queue_bytes = strtoul(optarg, NULL, 10) * 1024;
+                break;
+            case 'H':
+                // a restart picks up the data the previous server left behind
+                handoffPath = optarg;
+                storeConfig.persist = 1;
+                break;
+            case 'U':
+                unixPath = optarg;
+                break;
+            case 'g':
+                storeConfig.group_commit = 1;
+                break;
+            case 's':
+                storeConfig.group_commit = 1;
+                storeConfig.sync_ms = atoi(optarg);
+                break;
+            default:
+                fprintf(stderr,"unknown arguments - ignored\n");
+                break;
+        }
+    }
 
-    if (argc > 1){
-        // if we have arguments, check for -d
-        if (strncmp(argv[1], "-d", strlen("-d")) == 0){
-            isDaemon = 1;
-        }else{
-            fprintf(stderr,"unknown arguments - ignored\n");
+    // shards are event loops, each accepting on its own listener
+    if (shards >= 0){
+        if (shards == 0){
+            shards = sysconf(_SC_NPROCESSORS_ONLN) > 0 ? sysconf(_SC_NPROCESSORS_ONLN) : 1;
         }
+        useEpoll = 1;
+        useUring = 0;
     }
 
     /************************************************************************************
@@ -136,6 +580,9 @@ int main(int argc, char *argv[]){
         exit(-1);
     }
 
+    /* Ignore SIGPIPE, a peer closing during replay must only end that connection */
+    signal(SIGPIPE, SIG_IGN);
+
     /* Intialize SIGINT handler */
     struct sigaction sa_sigint;
     memset(&sa_sigint, 0, sizeof(sa_sigint));
@@ -149,13 +596,46 @@ int main(int argc, char *argv[]){
      * OPEN SOCKET
      * **********************************************************************************/
 
-    int sockfd, new_fd;
+    int sockfd = -1, new_fd;
     int yes = 1;
     socklen_t sin_size;
     struct sockaddr_storage sin_addr;
     char addr_string[INET6_ADDRSTRLEN];
     int retval;
 
+    /* take over listening sockets: from the server running on the handoff socket, or the service manager */
+    int listenFds[HANDOFF_MAX_LISTENERS];
+    struct handoff_conn *adopted = NULL;    // connections taken over with them
+    int inherited = 0;
+    if (handoffPath != NULL){
+        inherited = handoff_takeover(handoffPath, listenFds, HANDOFF_MAX_LISTENERS, &adopted);
+        if (inherited == -1){
+            syslog(LOG_ERR, "server: could not take over from %s\n", handoffPath);
+            exit(-1);
+        }
+    }
+    if (inherited == 0){
+        inherited = inherited_listeners(listenFds, HANDOFF_MAX_LISTENERS);
+    }
+    // a unix listener among them serves local clients, the rest are TCP
+    int unixFd = -1;
+    for (int i = 0; i < inherited; i++){
+        struct sockaddr_storage local;
+        socklen_t len = sizeof(local);
+        if (unixFd == -1 && getsockname(listenFds[i], (struct sockaddr*)&local, &len) == 0 && local.ss_family == AF_UNIX){
+            unixFd = listenFds[i];
+            memmove(&listenFds[i], &listenFds[i + 1], (inherited - i - 1) * sizeof(int));
+            inherited--;
+            break;
+        }
+    }
+    if (inherited > 1){
+        // several listeners are SO_REUSEPORT shards, keep serving each with its own loop
+        shards = inherited;
+        useEpoll = 1;
+        useUring = 0;
+    }
+
     /* set hints (connection parameters) */
     struct addrinfo hints;
     memset(&hints, 0, sizeof(hints));
@@ -175,7 +655,7 @@ int main(int argc, char *argv[]){
 
     /* loop through all servinfo results and bind to the first valid one */
     struct addrinfo  *p;
-    for (p = servinfo; p != NULL; p = p -> ai_next){
+    for (p = servinfo; p != NULL && inherited == 0; p = p -> ai_next){
 
         /* read address and ip version per addressinfo record */
         void *addr;
@@ -204,7 +684,8 @@ int main(int argc, char *argv[]){
         }
 
         // set socket options
-        if (setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(int)) == -1){
+        if (setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(int)) == -1 ||
+            (shards > 0 && setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, &yes, sizeof(int)) == -1)){
             close(sockfd);
             syslog(LOG_ERR, "failed to set socket options for %s:%s\n", ipver, ipstr);
             exit (-1);
@@ -220,9 +701,57 @@ int main(int argc, char *argv[]){
         break;
     }
 
+    // -S: bind the other shards to the same address, the kernel spreads connections over them
+    // (taken over listeners are used as they are, p is not a bound address then)
+    int *shardFds = NULL;
+    if (p != NULL && inherited == 0 && shards > 0){
+        shardFds = malloc(shards * sizeof(int));
+        if (shardFds == NULL){
+            syslog(LOG_ERR, "out of memory for listeners\n");
+            exit(-1);
+        }
+        shardFds[0] = sockfd;
+        for (int i = 1; i < shards; i++){
+            shardFds[i] = socket(p->ai_family, p->ai_socktype, p->ai_protocol);
+            if (shardFds[i] == -1 ||
+                setsockopt(shardFds[i], SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(int)) == -1 ||
+                setsockopt(shardFds[i], SOL_SOCKET, SO_REUSEPORT, &yes, sizeof(int)) == -1 ||
+                bind(shardFds[i], p->ai_addr, p->ai_addrlen) == -1){
+                // run with the shards we have
+                syslog(LOG_ERR, "failed to open listener %d: %s\n", i, strerror(errno));
+                if (shardFds[i] != -1){
+                    close(shardFds[i]);
+                }
+                shards = i;
+                break;
+            }
+        }
+    }
+
     // free servinfo allocation
     freeaddrinfo(servinfo);
 
+    // taken over listeners are bound (and listening) already; the accept loop
+    // blocks on them, the event loops make them nonblocking again themselves
+    for (int i = 0; i < inherited; i++){
+        int flags = fcntl(listenFds[i], F_GETFL, 0);
+        if (flags != -1){
+            fcntl(listenFds[i], F_SETFL, flags & ~O_NONBLOCK);
+        }
+    }
+    if (inherited > 0){
+        sockfd = listenFds[0];
+        if (inherited > 1){
+            shardFds = malloc(inherited * sizeof(int));
+            if (shardFds == NULL){
+                syslog(LOG_ERR, "out of memory for listeners\n");
+                exit(-1);
+            }
+            memcpy(shardFds, listenFds, inherited * sizeof(int));
+        }
+        syslog(LOG_USER, "using %d inherited listening socket(s)\n", inherited);
+    }
+
     /************************************************************************************
      * RUN AS DAEMON IF REQUIRED
      * **********************************************************************************/
@@ -242,51 +771,179 @@ int main(int argc, char *argv[]){
      * **********************************************************************************/
 
     // check if we have a port bound
-    if (p == NULL){
+    if (p == NULL && inherited == 0){
         syslog(LOG_ERR, "server: failed to bind\n");
         exit(-1);
     }
+    if (unixPath != NULL && unixFd == -1){
+        unixFd = unix_listen(unixPath);
+        if (unixFd == -1){
+            exit(-1);
+        }
+    }
 
     // Start listening for a connection.
-    if (listen(sockfd, SOCKET_BACKLOG) == -1){
-        syslog(LOG_ERR, "server: failed to listen\n");
+    for (int i = 0; i < (shardFds != NULL ? shards : 1); i++){
+        if (listen(shardFds != NULL ? shardFds[i] : sockfd, SOCKET_BACKLOG) == -1){
+            syslog(LOG_ERR, "server: failed to listen\n");
+            exit(-1);
+        }
+    }
+    if (unixFd != -1 && listen(unixFd, SOCKET_BACKLOG) == -1){
+        syslog(LOG_ERR, "server: failed to listen on unix socket\n");
+        exit(-1);
+    }
+
+    // open the store shared by all connections
+    struct aesd_store *store = store_open(&storeConfig);
+    if (store == NULL){
+        syslog(LOG_ERR, "server: failed to open store\n");
         exit(-1);
     }
 
+    // statistics are always collected, the admin port makes them readable
+    if (adminPort != NULL && stats_listen(adminPort) == -1){
+        syslog(LOG_ERR, "server: failed to open admin port %s\n", adminPort);
+    }
+
+    // -H: a new process started the same way takes over from this one (unix listener first, the TCP ones after it)
+    int handoffFds[HANDOFF_MAX_LISTENERS];
+    int nhandoff = 0;
+    if (unixFd != -1){
+        handoffFds[nhandoff++] = unixFd;
+    }
+    for (int i = 0; i < (shardFds != NULL ? shards : 1) && nhandoff < HANDOFF_MAX_LISTENERS; i++){
+        handoffFds[nhandoff++] = shardFds != NULL ? shardFds[i] : sockfd;
+    }
+    if (handoffPath != NULL && handoff_listen(handoffPath, handoffFds, nhandoff) == -1){
+        syslog(LOG_ERR, "server: failed to open handoff socket %s\n", handoffPath);
+    }
+
     printf("server: waiting for connections...\n");
     syslog(LOG_USER, "waiting for connections...\n");
 
+    if (useUring == 1){
+#ifdef USE_IO_URING
+        // handle all connections in an io_uring loop in this thread until done
+        if (run_uring_loop(sockfd, unixFd, store, adopted) == -1){
+            syslog(LOG_ERR, "server: io_uring not available, using worker pool\n");
+            useUring = 0;
+        } else {
+            adopted = NULL;
+        }
+#else
+        syslog(LOG_ERR, "server: built without io_uring support, using worker pool\n");
+        useUring = 0;
+#endif
+    }
+
+    if (useEpoll == 1 && useUring == 0){
+        // handle all connections in epoll event loop(s) until done
+        if (run_event_loops(sockfd, shardFds, shardFds != NULL ? shards : nloops, unixFd, pinLoops, store, adopted) == -1){
+            syslog(LOG_ERR, "server: failed to start event loops\n");
+        }
+        adopted = NULL;
+    }
+
+    // otherwise connections are handled by a fixed pool of worker threads
+    struct aesd_pool *pool = NULL;
+    if (useEpoll == 0 && useUring == 0){
+        pool = pool_create(nworkers, queueLimit > 0 ? (size_t) queueLimit : 0);
+        if (pool == NULL){
+            syslog(LOG_ERR, "server: failed to create worker pool\n");
+            exit(-1);
+        }
+        handler_wake_fd = eventfd(0, EFD_CLOEXEC);
+        if (handler_wake_fd == -1){
+            syslog(LOG_ERR, "server: failed to create handler wakeup: %s\n", strerror(errno));
+        }
+    }
+
+    // connections taken over from the previous process carry on first
+    while (adopted != NULL && pool != NULL){
+        struct handoff_conn *conn = adopted;
+        adopted = conn->next;
+        stats_add(STAT_ACCEPTED, 1);
+        int flags = fcntl(conn->fd, F_GETFL, 0);
+        if (flags == -1 || fcntl(conn->fd, F_SETFL, flags | O_NONBLOCK) == -1){
+            syslog(LOG_ERR, "failed to make connection from %s nonblocking\n", conn->addr);
+            close(conn->fd);
+            handoff_free(conn);
+            stats_add(STAT_CLOSED, 1);
+            continue;
+        }
+        queue_connection(pool, store, conn->fd, conn->addr, conn);
+    }
+
     // accept connections until done (as set by SIGINT or SIGTERM)
-    while(done == 0){
+    while(done == 0 && pool != NULL){
         sin_size = sizeof(sin_addr);
 
-        // Wait for a connection.
-        new_fd = accept(sockfd, (struct sockaddr*)&sin_addr, &sin_size);
+        // with a unix listener as well, wait for whichever has a connection
+        int acceptFd = sockfd;
+        if (unixFd != -1){
+            struct pollfd listeners[2] = { { .fd = sockfd, .events = POLLIN }, { .fd = unixFd, .events = POLLIN } };
+            if (poll(listeners, 2, -1) == -1){
+                continue;
+            }
+            acceptFd = (listeners[1].revents & POLLIN) ? unixFd : sockfd;
+        }
+
+        // Wait for a connection; handlers poll the nonblocking socket so they notice done and stalled replays
+        new_fd = accept4(acceptFd, (struct sockaddr*)&sin_addr, &sin_size, SOCK_NONBLOCK);
         if (new_fd == -1){
-            syslog(LOG_ERR, "server: failed to accept connection\n");
+            if (errno != EINTR){
+                syslog(LOG_ERR, "server: failed to accept connection\n");
+            }
             continue;
         }
 
+        stats_add(STAT_ACCEPTED, 1);
+
         // get address for incoming connection
-        inet_ntop(sin_addr.ss_family, get_in_addr((struct sockaddr*)&sin_addr), addr_string, sizeof(addr_string));
+        peer_name((struct sockaddr*)&sin_addr, addr_string, sizeof(addr_string));
         syslog(LOG_USER, "accepted connection from %s\n", addr_string);
 
-        // initialize thread to handle connection
-        pthread_t connection_thread;
-        struct th_data *socket_data = malloc(sizeof(struct th_data));
-        socket_data->socket_fd = new_fd;
-        socket_data->addr = addr_string;
 
-        if (pthread_create(&connection_thread, NULL, *connection_handler, (void*) socket_data)) {
-            syslog(LOG_ERR,"could not create thread for connection from %s\n", addr_string);
+        queue_connection(pool, store, new_fd, addr_string, NULL);
+    }
+
+    if (caught != 0){
+        printf("Caught %s, exiting\n", caught == SIGTERM ? "SIGTERM" : "SIGINT");
+        syslog(LOG_USER,"Caught signal, exiting\n");
+    }
+
+    if (pool != NULL){
+        // wake the handlers waiting for data or room, they pass their connections on
+        uint64_t one = 1;
+        if (handler_wake_fd != -1 && write(handler_wake_fd, &one, sizeof(one)) != sizeof(one)){
+            syslog(LOG_ERR, "server: failed to wake connection handlers\n");
         }
+        pool_destroy(pool);
+    }
+    if (handler_wake_fd != -1){
+        close(handler_wake_fd);
     }
+    stats_close();
 
     /************************************************************************************
      * CLEAN UP AND CLOSE SOCKET
      * **********************************************************************************/
-    remove(OUTFILE);
+    // a process that took over opens the store once handoff_close returns
+    int keep = handoff_taken_over();
+    store_close(store, keep);
+    handoff_close();
+    if (!keep){
+        remove(OUTFILE);
+    }
+    if (unixFd != -1){
+        unix_close(unixFd, keep);
+    }
     close(sockfd);
+    for (int i = 1; shardFds != NULL && i < shards; i++){
+        close(shardFds[i]);
+    }
+    free(shardFds);
 
     return 0;
 }
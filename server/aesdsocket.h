@@ -0,0 +1,267 @@
+/**
+ * Socket server - shared definitions
+ * Author: Martin Mauersberg
+ * Date: 10/12/2023
+*/
+
+#ifndef AESDSOCKET_H
+#define AESDSOCKET_H
+
+#include <signal.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#define SOCKET_PORT "9000"
+#define SOCKET_BACKLOG SOMAXCONN
+#define BUF_SIZE 512
+#define RECV_BUF_SIZE (BUF_SIZE * 32)   // bytes per recv call in the connection handler
+#define FRAME_MAX_PACKET (64 * 1024 * 1024) // longest packet a connection may assemble
+#define OUTFILE "/var/tmp/aesdsocketdata"
+#define REPLAY_CHUNK (1024 * 1024)  // max bytes per sendfile call during replay
+#define RECV_TIMEOUT_SEC 1          // waiting threads wake up this often to check done and stalled replays
+#define TAIL_COMMAND "AESD_TAIL\n"  // first line of a connection: replay only new data
+#define SEEK_COMMAND "AESDCHAR_IOCSEEKTO:"  // "AESDCHAR_IOCSEEKTO:X,Y": replay from packet X, byte Y
+#define SEEK_LINE_MAX 64            // longer lines are packets, not seek commands
+#define SEND_STALL_SEC 30           // default: drop a connection whose replay made no progress for this long
+#define OUT_QUEUE_BYTES (4 * 1024 * 1024)   // default: replay bytes queued for a connection before its input pauses
+
+#define POOL_THREADS_PER_CPU 8      // connection handlers block on the socket, oversubscribe cores
+#define POOL_QUEUE_LIMIT 1024       // default max accepted connections waiting for a worker
+
+struct aesd_store;
+
+struct handoff_conn;
+
+/* structure for thread data */
+struct th_data  {
+    int socket_fd;                  // socket file descriptor
+    struct aesd_store *store;       // shared packet store
+    char addr[INET6_ADDRSTRLEN];    // socket peer address (copied, accept reuses its buffer)
+    struct handoff_conn *adopted;   // state of a connection taken over on hot restart, or NULL
+};
+
+/* volatile atomic signal for done (set by SIGINT / SIGTERM) */
+extern volatile sig_atomic_t done;
+
+/* per connection output limits (set from the command line) */
+struct out_limits {
+    int stall_sec;          // -t: drop a connection whose replay made no progress for this long, 0 = never
+    size_t queue_bytes;     // -o: replay bytes queued for a connection before its input is paused
+};
+extern struct out_limits out_limits;
+
+/* get sockaddr for ipv4 or ipv6 */
+void *get_in_addr(struct sockaddr *sa);
+
+/* printable peer address: the IP, or "unix" for a local client */
+void peer_name(struct sockaddr *sa, char *buf, size_t len);
+
+/* create a thread that leaves SIGINT/SIGTERM to the main thread */
+int create_worker_thread(pthread_t *thread, void *(*fn)(void *), void *arg);
+
+/* send bytes [*offset, end) of file fd to sock, zero copy where possible.
+ * *offset is advanced past the bytes sent; returns -1 with errno set on error
+ * (EAGAIN if a nonblocking socket is full, call again when it is writable) */
+int send_file_range(int sock, int fd, off_t *offset, off_t end);
+
+/************************************************************************************
+ * ----------------------  packet framing (aesd_frame.c)  ----------------------
+ * **********************************************************************************/
+
+/* per connection assembly buffer for a packet split across reads */
+struct frame_buf {
+    char *data;         // slab allocated, NULL while empty
+    size_t len;         // bytes of the incomplete packet
+    size_t cap;         // allocated size
+};
+
+/* seek command (SEEK_COMMAND) found among the packets */
+struct frame_seek {
+    size_t packet;      // X: packet number, counted from the oldest one held
+    size_t byte;        // Y: byte within that packet
+};
+
+#define FRAME_STORED 1  // frame_input / frame_collect: complete packets were stored
+#define FRAME_SEEK 2    // frame_input / frame_collect: a seek command was received
+
+/* store all complete packets in data (plus any carried bytes) with one
+ * store_append and keep the incomplete rest. A packet that is a seek command
+ * is not stored but returned in *seek (the last one wins). Returns a mask of
+ * FRAME_STORED and FRAME_SEEK (0 = no replay needed) or -1 on error */
+int frame_input(struct frame_buf *fb, struct aesd_store *store, const char *data, size_t n, struct frame_seek *seek);
+
+/* like frame_input, but move the complete packets into out (appending to
+ * it) instead of storing them, for callers that write them out themselves */
+int frame_collect(struct frame_buf *fb, const char *data, size_t n, struct frame_buf *out, struct frame_seek *seek);
+
+/* where the replay after frame_input / frame_collect returned stored should
+ * start once the packets are in store: the seek target if there was a valid
+ * one, otherwise from; -1 if there is nothing to replay (only a bad seek) */
+off_t frame_replay_from(struct aesd_store *store, int stored, const struct frame_seek *seek, off_t from);
+
+/* seed the assembly buffer with the incomplete packet of a connection taken over */
+int frame_restore(struct frame_buf *fb, const char *data, size_t n);
+
+/* commands a connection may send as its very first line (not stored) */
+enum frame_cmd {
+    FRAME_CMD_NONE,     // first line is a regular packet
+    FRAME_CMD_PENDING,  // could still be a command, call again with the next data
+    FRAME_CMD_TAIL,     // TAIL_COMMAND: each replay sends only data added since the last one
+};
+
+/* check the start of a connection for a command line; a recognized command is
+ * consumed (*data and *n move past it), otherwise data is left untouched and
+ * must be passed on to frame_input / frame_collect as usual */
+enum frame_cmd frame_first_line(struct frame_buf *fb, const char **data, size_t *n);
+
+/* return the assembly buffer to the slab */
+void frame_release(struct frame_buf *fb);
+
+/************************************************************************************
+ * ----------------------  epoll event loop (aesd_epoll.c)  ----------------------
+ * **********************************************************************************/
+
+/* run nloops event loop threads until done is set (nloops 0 = one per core); the
+ * loops share listening socket sockfd, or with listen_fds loop i accepts on
+ * its own listener listen_fds[i] (SO_REUSEPORT shards, nloops entries);
+ * pin binds loop i to CPU i. All loops share the unix listener unix_fd (-1 = none).
+ * The adopted connections are spread over the loops. Returns -1 if no loop
+ * started, or with listen_fds if not all of them did (after stopping the others) */
+int run_event_loops(int sockfd, const int *listen_fds, int nloops, int unix_fd, int pin, struct aesd_store *store,
+                    struct handoff_conn *adopted);
+
+/************************************************************************************
+ * ----------------------  io_uring loop (aesd_uring.c, built with USE_IO_URING)  ----------------------
+ * **********************************************************************************/
+#ifdef USE_IO_URING
+/* serve sockfd, unix_fd (-1 = none) and the adopted connections from an io_uring loop in the calling
+ * thread until done is set; returns -1 right away (leaving adopted alone) if
+ * io_uring (or a feature it needs) is not available */
+int run_uring_loop(int sockfd, int unix_fd, struct aesd_store *store, struct handoff_conn *adopted);
+#endif
+
+/************************************************************************************
+ * ----------------------  worker thread pool (aesd_pool.c)  ----------------------
+ * **********************************************************************************/
+struct aesd_pool;
+
+/* start nworkers threads (0 = POOL_THREADS_PER_CPU per core) with at most queue_limit waiting jobs */
+struct aesd_pool *pool_create(int nworkers, size_t queue_limit);
+
+/* queue fn(arg) on the pool; returns -1 if the queue limit is reached */
+int pool_submit(struct aesd_pool *pool, void *(*fn)(void *), void *arg);
+
+/* let the workers finish their queued jobs, then join and free the pool */
+void pool_destroy(struct aesd_pool *pool);
+
+/************************************************************************************
+ * ----------------------  group commit append log (aesd_wlog.c)  ----------------------
+ * **********************************************************************************/
+struct aesd_wlog;
+
+/* start a writer thread appending to fd; sync_ms -1 = never fdatasync,
+ * 0 = fdatasync each batch before acknowledging it, >0 = at most every sync_ms */
+struct aesd_wlog *wlog_open(int fd, int sync_ms);
+
+/* queue data for the writer and wait until it is written as one piece */
+int wlog_append(struct aesd_wlog *wl, const char *data, size_t len);
+
+/* write everything still queued, stop the writer and free the log */
+void wlog_close(struct aesd_wlog *wl);
+
+/************************************************************************************
+ * ----------------------  statistics (aesd_stats.c)  ----------------------
+ * **********************************************************************************/
+enum stat_counter {
+    STAT_ACCEPTED,      // connections accepted
+    STAT_REJECTED,      // of those, turned away (worker queue full)
+    STAT_CLOSED,        // connections closed (including rejected ones)
+    STAT_BYTES_IN,      // bytes received
+    STAT_BYTES_OUT,     // bytes replayed
+    STAT_PACKETS,       // packets appended to the store
+    STAT_REPLAYS,       // replays completed
+    STAT_THROTTLED,     // times a connection's input was paused for its output to drain
+    STAT_DROPPED,       // connections closed because their replay stalled
+    STAT_HANDED_OVER,   // connections passed to a new process on hot restart
+    STAT_BLOCK_HITS,    // block store replays served from the block cache
+    STAT_BLOCK_MISSES,  // block store replays that read and decompressed a block
+    STAT_SNAP_BUILDS,   // replay snapshots built (at most one per append generation)
+    STAT_SNAP_READ,     // store bytes read to build them
+    STAT_COUNTERS
+};
+
+enum stat_hist {
+    HIST_REPLAY,        // recv of the completing packet -> replay sent
+    HIST_APPEND,        // store append
+    STAT_HISTS
+};
+
+/* monotonic clock in ns, for latencies */
+uint64_t stats_now(void);
+
+/* add n to a counter / record a latency in ns (per thread, lock free) */
+void stats_add(enum stat_counter c, uint64_t n);
+void stats_record(enum stat_hist h, uint64_t ns);
+
+/* write the summed up statistics as text lines into buf; returns the length */
+size_t stats_report(char *buf, size_t size);
+
+/* serve the report to every connection on loopback port until done is set */
+int stats_listen(const char *port);
+void stats_close(void);
+
+/************************************************************************************
+ * ----------------------  hot restart (aesd_handoff.c)  ----------------------
+ * **********************************************************************************/
+#define HANDOFF_MAX_LISTENERS 64    // listening sockets passed to the next process
+#define HANDOFF_RANGES 4            // replays a handed over connection may still owe
+
+/* a connection passed to the next process, with what it needs to carry on */
+struct handoff_conn {
+    struct handoff_conn *next;      // list of connections taken over
+    int fd;
+    int negotiating;                // first line may still be a command
+    int tail;                       // TAIL_COMMAND: replay only new data
+    off_t cursor;                   // tail: where the next replay starts
+    int nout;                       // replays still owed, oldest first
+    off_t out[HANDOFF_RANGES][2];   // [start, end) store offsets of each
+    char *pending;                  // incomplete packet
+    size_t pending_len;
+    char addr[INET6_ADDRSTRLEN];
+};
+
+/* take over from the server listening for handoffs on path: receive its
+ * listening sockets into fds (at most max) and, once it has shut down and
+ * closed its store, the connections it had open. Returns the number of
+ * listening sockets, 0 if no server runs there, -1 on error */
+int handoff_takeover(const char *path, int *fds, int max, struct handoff_conn **conns);
+
+/* free a connection record from handoff_takeover (the socket stays open) */
+void handoff_free(struct handoff_conn *conn);
+
+/* limit the cursor and owed replays of a connection taken over to what the
+ * store of this process holds, [start, end): a store that did not carry over
+ * the previous one (a ring without -b starts empty) has none of its offsets */
+void handoff_fit(struct handoff_conn *conn, off_t start, off_t end);
+
+/* wait for a new process on path; one connecting gets the nfds listening
+ * sockets fds and sets done, connections are then passed on with handoff_pass */
+int handoff_listen(const char *path, const int *fds, int nfds);
+
+/* pass a connection to the process taking over; returns -1 if there is none
+ * (or it failed), then the connection is closed as usual. Either way the
+ * caller closes its copy of conn->fd */
+int handoff_pass(const struct handoff_conn *conn);
+
+/* nonzero once a new process took over: the data on disk is now its data */
+int handoff_taken_over(void);
+
+/* stop listening for handoffs; the process taking over starts serving once
+ * this is called, so call it after the store is closed */
+void handoff_close(void);
+
+#endif /* AESDSOCKET_H */